@@ -0,0 +1,123 @@
+#include "http_protocol.hpp"
+#include "prime_server.hpp"
+#include "uring_server.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <list>
+#include <string>
+#include <thread>
+
+using namespace prime_server;
+
+namespace {
+
+constexpr size_t CLIENTS = 4;
+constexpr size_t REQUESTS = 20000;
+constexpr size_t BATCH = 100;
+constexpr size_t MAX_BYTES = 1024 * 1024 * 1024; // per client, keeps the large responses quick
+
+// replies with a body of the size asked for in the path
+worker_t::result_t respond(const std::list<zmq::message_t>& job,
+                           void* request_info,
+                           worker_t::interrupt_function_t&) {
+  auto request = http_request_view_t::from_string(static_cast<const char*>(job.front().data()),
+                                                  job.front().size());
+  auto size = std::stoul(std::string(request.path().substr(1)));
+  http_response_t response(200, "OK", std::string(size, 'b'));
+  response.from_info(*static_cast<http_request_info_t*>(request_info));
+  worker_t::result_t result{false, {}, {}};
+  result.messages.emplace_back(response.to_string());
+  return result;
+}
+
+// the proxy and workers behind a front end, the same for both kinds
+void start_backend(zmq::context_t& context, const std::string& name) {
+  std::thread proxy(std::bind(&proxy_t::forward, proxy_t(context, "inproc://" + name + "_up",
+                                                         "inproc://" + name + "_down")));
+  proxy.detach();
+  for (size_t i = 0; i < CLIENTS; ++i) {
+    std::thread worker(std::bind(&worker_t::work,
+                                 worker_t(context, "inproc://" + name + "_down", "inproc://dev_null",
+                                          "inproc://" + name + "_results",
+                                          "inproc://" + name + "_interrupt", respond)));
+    worker.detach();
+  }
+}
+
+// hammer the front end from a few clients at once, each one keeping a batch of requests in flight.
+// the http client only handles responses that come back in one read so we use plain stream sockets
+void bench(zmq::context_t& context, const std::string& name, const std::string& endpoint,
+           size_t response_size) {
+  auto request = http_request_t::to_string(method_t::GET, "/" + std::to_string(response_size));
+  auto requests = std::min(REQUESTS, MAX_BYTES / std::max(response_size, size_t(1)));
+  auto start = std::chrono::steady_clock::now();
+  std::list<std::thread> clients;
+  for (size_t i = 0; i < CLIENTS; ++i) {
+    clients.emplace_back([&context, &endpoint, &request, requests]() {
+      zmq::socket_t client(context, ZMQ_STREAM);
+      client.connect(endpoint.c_str());
+      auto connection = client.recv_all(0);
+      http_response_t response;
+      for (size_t received = 0; received < requests;) {
+        auto batch = std::min(BATCH, requests - received);
+        std::string pipelined;
+        for (size_t j = 0; j < batch; ++j)
+          pipelined += request;
+        client.send(connection.front(), ZMQ_SNDMORE);
+        client.send(pipelined.data(), pipelined.size(), 0);
+        for (size_t collected = 0; collected < batch;) {
+          auto messages = client.recv_all(0);
+          collected += response
+                           .from_stream(static_cast<const char*>(messages.back().data()),
+                                        messages.back().size())
+                           .size();
+        }
+        received += batch;
+      }
+    });
+  }
+  for (auto& client : clients)
+    client.join();
+  auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  std::cout << std::left << std::setw(12) << name << std::right << std::setw(10) << response_size
+            << " byte responses" << std::setw(12) << std::fixed << std::setprecision(0)
+            << CLIENTS * requests / elapsed << " requests/s" << std::setw(10)
+            << std::setprecision(1)
+            << CLIENTS * requests * response_size / elapsed / (1024 * 1024) << " MB/s"
+            << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  zmq::context_t context;
+
+  // the same backend behind each kind of front end
+  http_server_t stream(context, "tcp://127.0.0.1:18002", "inproc://bench_stream_up",
+                       "inproc://bench_stream_results", "inproc://bench_stream_interrupt");
+  std::thread(std::bind(&http_server_t::serve, std::move(stream))).detach();
+  start_backend(context, "bench_stream");
+
+  http_uring_server_t uring(context, "tcp://127.0.0.1:18003", "inproc://bench_uring_up",
+                            "inproc://bench_uring_results", "inproc://bench_uring_interrupt");
+  std::thread(std::bind(&http_uring_server_t::serve, std::move(uring))).detach();
+  start_backend(context, "bench_uring");
+
+  // small responses show the per request overhead, large ones show what not copying buys you
+  for (size_t response_size : {size_t(64), size_t(4096), size_t(65536), size_t(1024 * 1024)}) {
+    if (argc > 1)
+      response_size = std::stoul(argv[1]);
+    bench(context, "zmq_stream", "tcp://127.0.0.1:18002", response_size);
+    bench(context, "io_uring", "tcp://127.0.0.1:18003", response_size);
+    if (argc > 1)
+      break;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,100 @@
+#include "http_protocol.hpp"
+#include "simd_scan.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+using namespace prime_server;
+
+namespace {
+
+constexpr size_t REQUESTS = 1000;
+constexpr size_t ROUNDS = 50;
+
+// a realistic mix of requests, a browser like GET with lots of headers and a POST with a body
+std::string make_stream() {
+  std::string stream;
+  for (size_t i = 0; i < REQUESTS; ++i) {
+    if (i % 4) {
+      stream += "GET /route?json={\"locations\":[{\"lat\":40.7,\"lon\":-76.5},{\"lat\":40.8,\"lon\":"
+                "-76.4}]}&id=" +
+                std::to_string(i) +
+                " HTTP/1.1\r\n"
+                "Host: localhost:8002\r\n"
+                "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/119.0\r\n"
+                "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+                "Accept-Language: en-US,en;q=0.5\r\n"
+                "Accept-Encoding: gzip, deflate, br\r\n"
+                "Connection: keep-alive\r\n"
+                "Cache-Control: max-age=0\r\n\r\n";
+    } else {
+      std::string body(512, 'b');
+      stream += "POST /route HTTP/1.1\r\nHost: localhost:8002\r\nContent-Type: application/json\r\n"
+                "Content-Length: " +
+                std::to_string(body.size()) + "\r\n\r\n" + body;
+    }
+  }
+  return stream;
+}
+
+// feed the stream to the parser in pieces of at most piece_size bytes like the socket would
+void bench(const std::string& stream, size_t piece_size, bool framing_only = false) {
+  size_t parsed = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t round = 0; round < ROUNDS; ++round) {
+    http_request_t request(framing_only);
+    for (size_t offset = 0; offset < stream.size(); offset += piece_size) {
+      auto length = std::min(piece_size, stream.size() - offset);
+      parsed += request.from_stream(stream.data() + offset, length).size();
+    }
+  }
+  auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  if (parsed != REQUESTS * ROUNDS) {
+    std::cerr << "Parsed " << parsed << " requests but expected " << REQUESTS * ROUNDS << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+
+  std::cout << std::left << std::setw(10) << (framing_only ? "framing" : simd::implementation())
+            << std::right << std::setw(8) << piece_size << " byte pieces" << std::setw(10)
+            << std::fixed << std::setprecision(1)
+            << stream.size() * ROUNDS / elapsed / (1024 * 1024) << " MB/s" << std::setw(12)
+            << std::setprecision(0) << parsed / elapsed << " requests/s" << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  auto stream = make_stream();
+  std::cout << stream.size() << " byte stream of " << REQUESTS << " requests" << std::endl;
+
+  // scalar is what the parser did before vectorizing so its the baseline to compare against
+  for (const auto* implementation : {"scalar", "sse2", "avx2"}) {
+    if (!simd::select(implementation)) {
+      std::cout << implementation << " is not supported on this machine" << std::endl;
+      continue;
+    }
+    // the whole stream at once and then fragmented the way a busy socket hands it to us
+    for (size_t piece_size : {stream.size(), size_t(8192), size_t(1500), size_t(64)}) {
+      if (argc > 1)
+        piece_size = std::stoul(argv[1]);
+      bench(stream, piece_size);
+      if (argc > 1)
+        break;
+    }
+  }
+
+  // what the server does when it leaves the parsing to the workers
+  for (size_t piece_size : {stream.size(), size_t(8192), size_t(1500), size_t(64)}) {
+    if (argc > 1)
+      piece_size = std::stoul(argv[1]);
+    bench(stream, piece_size, true);
+    if (argc > 1)
+      break;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,111 @@
+#include "zmq_helpers.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <new>
+#include <string>
+
+// count every heap allocation so we can report how many each hop costs
+namespace {
+std::atomic<size_t> allocations{0};
+}
+void* operator new(size_t size) {
+  ++allocations;
+  if (void* p = std::malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept {
+  std::free(p);
+}
+void operator delete(void* p, size_t) noexcept {
+  std::free(p);
+}
+
+namespace {
+
+constexpr size_t ITERATIONS = 200000;
+
+// what a message part used to look like, a heap allocated zmq_msg_t behind a shared_ptr
+std::shared_ptr<zmq_msg_t> legacy_message() {
+  auto* message = new zmq_msg_t();
+  zmq_msg_init(message);
+  return std::shared_ptr<zmq_msg_t>(message, [](zmq_msg_t* message) {
+    zmq_msg_close(message);
+    delete message;
+  });
+}
+
+// a request as it moves between the server and proxy, an address, the request info and the job
+void send_request(zmq::socket_t& socket, const std::string& job) {
+  uint64_t info = 0;
+  socket.send(static_cast<const void*>("worker"), 6, ZMQ_SNDMORE);
+  socket.send(static_cast<const void*>(&info), sizeof(info), ZMQ_SNDMORE);
+  socket.send(static_cast<const void*>(job.data()), job.size(), 0);
+}
+
+template <class hop_t>
+void bench(const std::string& name, const std::string& job, hop_t hop) {
+  zmq::context_t context;
+  zmq::socket_t sender(context, ZMQ_PAIR);
+  zmq::socket_t receiver(context, ZMQ_PAIR);
+  int disabled = 0;
+  sender.setsockopt(ZMQ_SNDHWM, &disabled, sizeof(disabled));
+  receiver.setsockopt(ZMQ_RCVHWM, &disabled, sizeof(disabled));
+  sender.bind(("inproc://bench_" + name).c_str());
+  receiver.connect(("inproc://bench_" + name).c_str());
+
+  // we only time the receiving side
+  for (size_t i = 0; i < ITERATIONS; ++i)
+    send_request(sender, job);
+  auto before = allocations.load();
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < ITERATIONS; ++i)
+    hop(receiver);
+  auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start);
+  auto allocated = allocations.load() - before;
+
+  std::cout << std::left << std::setw(24) << name << std::right << std::setw(10) << std::fixed
+            << std::setprecision(1) << elapsed.count() / ITERATIONS << " ns/hop" << std::setw(8)
+            << std::setprecision(2) << static_cast<double>(allocated) / ITERATIONS
+            << " allocations/hop" << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  // small jobs are stored inside the zmq_msg_t, larger ones make zmq allocate too
+  for (size_t size : {16, 1024}) {
+    std::string job(argc > 1 ? std::stoul(argv[1]) : size, 'j');
+    std::cout << job.size() << " byte job" << std::endl;
+
+    // the way it used to be, a shared_ptr allocation per part and a list node per part
+    bench("shared_ptr+list", job, [](zmq::socket_t& socket) {
+      std::list<std::shared_ptr<zmq_msg_t>> messages;
+      int more = 0;
+      do {
+        messages.emplace_back(legacy_message());
+        zmq_msg_recv(messages.back().get(), socket, 0);
+        more = zmq_msg_more(messages.back().get());
+      } while (more);
+    });
+
+    // inline messages but still a list node per part
+    bench("message_t+list", job, [](zmq::socket_t& socket) { socket.recv_all(0); });
+
+    // inline messages and inline parts
+    zmq::multipart_t messages;
+    bench("message_t+multipart", job,
+          [&messages](zmq::socket_t& socket) { socket.recv_all(messages, 0); });
+
+    if (argc > 1)
+      break;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -8,7 +8,9 @@
 #include <cstdint>
 #include <limits>
 #include <list>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 
 // winnt.h defines DELETE as a macro (access right flag)
@@ -100,6 +102,7 @@ protected:
 struct http_request_info_t {
   uint32_t id;         // the request id
   uint32_t time_stamp; // the request time stamp
+  uint32_t deadline;   // milliseconds after the time stamp that nobody wants it anymore, 0 is never
 
   uint16_t version : 3;               // protocol specific space for versioning info
   uint16_t connection_keep_alive : 1; // header present or not
@@ -122,9 +125,17 @@ public:
   method_t method;
   std::string path;
   query_t query;
+  // which part of the request this is, a piece of a streamed body only has the body filled out
+  part_t part = WHOLE_REQUEST;
 
   virtual ~http_request_t();
   http_request_t();
+  // when framing only, from_stream just finds where each request ends and keeps its bytes so that
+  // to_job can forward them for a worker to parse. of the parsed bits only the method, the path
+  // (not decoded and without the query), the version and the headers needed to find the end, to
+  // handle keep-alive and to set the deadline are filled out. this takes the load off of the server
+  // thread
+  explicit http_request_t(bool framing_only);
   http_request_t(const method_t& method,
                  const std::string& path,
                  const std::string& body = "",
@@ -132,9 +143,14 @@ public:
                  const headers_t& headers = headers_t{},
                  const std::string& version = "HTTP/1.1");
 
+  // a client can set X-Timeout-Ms to how many milliseconds it will wait, which sets the deadline
   http_request_info_t to_info(uint32_t id) const;
   void flush_stream();
   virtual std::string to_string() const override;
+  // what the server sends on to the workers, a compact binary form of the already parsed request
+  // that from_string and http_request_view_t can read back without parsing any http again. when
+  // framing only its just the bytes of the request
+  zmq::message_t to_job() const;
   static std::string to_string(const method_t& method,
                                const std::string& path,
                                const std::string& body = "",
@@ -144,8 +160,13 @@ public:
   static const zmq::message_t& timeout(http_request_info_t& info);
   static http_request_t from_string(const char* start, size_t length);
   static query_t split_path_query(std::string& path);
-  std::list<http_request_t>
-  from_stream(const char* start, size_t length, size_t max_size = std::numeric_limits<size_t>::max());
+  // a request whose body is longer than stream_size is returned as soon as its headers are in and
+  // then its body in pieces, one per call that gets any of it, see part_t. a chunked body starts to
+  // stream once more than stream_size of it has come in. bodies are never streamed when framing only
+  std::list<http_request_t> from_stream(const char* start,
+                                        size_t length,
+                                        size_t max_size = std::numeric_limits<size_t>::max(),
+                                        size_t stream_size = std::numeric_limits<size_t>::max());
   size_t size() const;
   void log(uint32_t id) const;
 
@@ -158,9 +179,19 @@ public:
 
   // TODO: fix this when we refactor to avoid subclassing the server
   std::list<uint64_t> enqueued;
+  // whether we are in the middle of a streamed body and which request it belongs to
+  bool streaming = false;
+  uint64_t streamed = 0;
 
 protected:
+  void finish(std::list<http_request_t>& requests, const char*& raw_begin);
+  void start_streaming(std::list<http_request_t>& requests);
+  void stream_piece(std::list<http_request_t>& requests, part_t part, size_t length);
+
   std::string log_line;
+  bool framing_only;
+  // the bytes of the request when framing only
+  std::string raw;
 };
 
 // TODO: let this subclass exception and make 'message' be the 'what'
@@ -188,11 +219,88 @@ public:
                              const headers_t& headers = headers_t{},
                              const std::string& body = "",
                              const std::string& version = "HTTP/1.1");
+  // a piece of a chunked response, the empty string gives the last chunk. to stream a response set
+  // its Transfer-Encoding header to chunked and send its to_string followed by the chunks
+  static std::string chunk(const std::string& bytes);
 
 protected:
   std::string log_line;
 };
 
+// a read only view of a whole request that points into the bytes it was parsed from rather than
+// copying them out. only the request line is looked at up front, the headers and query parameters
+// are found when you ask for them. the path is only copied if it has escapes that need decoding.
+// it also understands the pre-parsed jobs the server sends to workers (see http_request_t::to_job)
+// in which case nothing is decoded or scanned at all. the bytes you parse must outlive the view.
+// this is meant for workers who get a whole request in a job and just want to look at a few bits of
+// it, use http_request_t for streaming or chunked bodies
+class http_request_view_t {
+public:
+  method_t method;
+  std::string_view version;
+  // the request target as it was sent, ie before any decoding. for a job its already decoded
+  std::string_view target;
+  std::string_view body;
+
+  http_request_view_t();
+  // parse a whole request, throws request_exception_t or runtime_error like http_request_t does
+  static http_request_view_t from_string(const char* start, size_t length);
+  // the same as above but reuses this views decoding buffer
+  void parse(const char* start, size_t length);
+  // whether these bytes are a job made by http_request_t::to_job rather than http text
+  static bool is_job(const char* start, size_t length);
+
+  // the decoded path and the decoded bit after the ?
+  std::string_view path() const;
+  std::string_view query_string() const;
+  // the value of the first header with this name ignoring case or nothing if it isnt there
+  std::optional<std::string_view> header(std::string_view name) const;
+  // the value of the first query parameter with this key or nothing if it isnt there
+  std::optional<std::string_view> query(std::string_view key) const;
+  // calls visitor(name, value) for each header in the order they were sent
+  template <class visitor_t> void visit_headers(const visitor_t& visitor) const {
+    position_t position{header_lines, 0};
+    std::string_view name, value;
+    while (next_header(position, name, value))
+      visitor(name, value);
+  }
+  // calls visitor(key, value) for each query parameter in the order they were sent
+  template <class visitor_t> void visit_query(const visitor_t& visitor) const {
+    position_t position{query_string(), 0};
+    std::string_view key, value;
+    while (next_query(position, key, value))
+      visitor(key, value);
+  }
+  http_request_info_t to_info(uint32_t id) const;
+
+protected:
+  // where we are when walking over the headers or query parameters, the text that is left for a
+  // request or the index into the tables for a job
+  struct position_t {
+    std::string_view rest;
+    uint32_t index;
+  };
+  // get the next header or query parameter, false when there are no more
+  bool next_header(position_t& position, std::string_view& name, std::string_view& value) const;
+  bool next_query(position_t& position, std::string_view& key, std::string_view& value) const;
+  void parse_job(const char* start, size_t length);
+  std::string_view span(uint32_t index) const;
+  std::string_view decoded_target() const;
+
+  // the header lines each with their \r\n but not the blank line on the end
+  std::string_view header_lines;
+  // where the ? is in the decoded target
+  size_t query_begin;
+  // whether the target had escapes and where we keep the decoded copy of it if so
+  bool escaped;
+  std::string decoded;
+  // for a job, where it starts and how many query parameters and headers are in its tables
+  const char* job;
+  uint32_t query_count;
+  uint32_t header_count;
+};
+
 using http_server_t = server_t<http_request_t, http_request_info_t>;
+using http_sharded_server_t = sharded_server_t<http_request_t, http_request_info_t>;
 
 } // namespace prime_server
@@ -29,6 +29,16 @@ worker_t::result_t disk_result(const http_request_t& path,
                                const std::string& root = "./",
                                bool allow_listing = true,
                                size_t size_limit = 1024 * 1024 * 1024);
+worker_t::result_t disk_result(const http_request_view_t& path,
+                               http_request_info_t& request_info,
+                               const std::string& root = "./",
+                               bool allow_listing = true,
+                               size_t size_limit = 1024 * 1024 * 1024);
+worker_t::result_t disk_result(std::string path,
+                               http_request_info_t& request_info,
+                               const std::string& root = "./",
+                               bool allow_listing = true,
+                               size_t size_limit = 1024 * 1024 * 1024);
 
 } // namespace http
 } // namespace prime_server
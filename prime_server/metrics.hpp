@@ -0,0 +1,109 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace prime_server {
+namespace metrics {
+
+// a count of things that only goes up
+class counter_t {
+public:
+  void increment(uint64_t amount = 1) {
+    value.fetch_add(amount, std::memory_order_relaxed);
+  }
+  uint64_t get() const {
+    return value.load(std::memory_order_relaxed);
+  }
+
+protected:
+  std::atomic<uint64_t> value{0};
+};
+
+// a level of something that goes up and down
+class gauge_t {
+public:
+  void set(int64_t level) {
+    value.store(level, std::memory_order_relaxed);
+  }
+  void add(int64_t amount) {
+    value.fetch_add(amount, std::memory_order_relaxed);
+  }
+  int64_t get() const {
+    return value.load(std::memory_order_relaxed);
+  }
+
+protected:
+  std::atomic<int64_t> value{0};
+};
+
+// a log linear histogram a la HdrHistogram. values below 16 get a bucket each and above that every
+// power of two is split into 16 buckets, so any value is known to within 1/16th of itself no matter
+// how large it is. recording is a couple of relaxed atomic adds so its cheap enough for hot paths,
+// reading is only as consistent as the adds that finished before it
+class histogram_t {
+public:
+  void record(uint64_t value);
+  uint64_t count() const;
+  uint64_t sum() const;
+  // the highest value in the bucket where this fraction of the recorded values are at or below it
+  uint64_t quantile(double fraction) const;
+
+protected:
+  static constexpr size_t SUB_BUCKET_BITS = 4;
+  static constexpr size_t SUB_BUCKETS = size_t(1) << SUB_BUCKET_BITS;
+  static constexpr size_t BUCKETS = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+  static size_t index_of(uint64_t value);
+  static uint64_t highest_of(size_t index);
+
+  std::array<std::atomic<uint64_t>, BUCKETS> counts{};
+  std::atomic<uint64_t> total{0};
+  std::atomic<uint64_t> summed{0};
+};
+
+// metrics are made once for a given name and set of labels and live as long as the process does,
+// so the things updating them can hang on to a reference and never lock. only making them and
+// scraping them takes the lock. histograms are scraped as prometheus summaries, the values they
+// record are in microseconds and are reported in seconds
+class registry_t {
+public:
+  static registry_t& get();
+
+  // labels are written out as is, eg: proxy="ipc:///tmp/proxy",shard="0", see label below
+  counter_t&
+  counter(const std::string& name, const std::string& help, const std::string& labels = "");
+  gauge_t& gauge(const std::string& name, const std::string& help, const std::string& labels = "");
+  histogram_t&
+  histogram(const std::string& name, const std::string& help, const std::string& labels = "");
+  // all of the metrics in the prometheus text exposition format
+  std::string scrape() const;
+
+protected:
+  registry_t() = default;
+  template <class metric_t> struct family_t {
+    std::string help;
+    std::map<std::string, std::unique_ptr<metric_t>> labeled;
+  };
+  template <class metric_t>
+  metric_t& make(std::map<std::string, family_t<metric_t>>& families,
+                 const std::string& name,
+                 const std::string& help,
+                 const std::string& labels);
+
+  mutable std::mutex mutex;
+  std::map<std::string, family_t<counter_t>> counters;
+  std::map<std::string, family_t<gauge_t>> gauges;
+  std::map<std::string, family_t<histogram_t>> histograms;
+};
+
+// a label with its value escaped so it can go in a set of labels
+std::string label(const std::string& name, const std::string& value);
+
+} // namespace metrics
+} // namespace prime_server
@@ -11,6 +11,7 @@ namespace prime_server {
 struct netstring_request_info_t {
   uint32_t id;
   uint32_t time_stamp;
+  uint32_t deadline;
 
   void log(size_t response_size) const;
   bool keep_alive() const {
@@ -23,13 +24,20 @@ struct netstring_request_info_t {
 
 struct netstring_entity_t {
   netstring_entity_t();
+  // netstrings are only ever framed, there is nothing more to parse, so this is the same as above
+  explicit netstring_entity_t(bool framing_only);
   netstring_request_info_t to_info(uint32_t id) const;
   std::string to_string() const;
+  // what the server sends on to the workers, the same as to_string
+  zmq::message_t to_job() const;
   static std::string to_string(const std::string& message);
   static netstring_entity_t from_string(const char* start, size_t length);
   static const zmq::message_t& timeout(netstring_request_info_t& info);
-  std::list<netstring_entity_t>
-  from_stream(const char* start, size_t length, size_t max_size = std::numeric_limits<size_t>::max());
+  // netstrings are never streamed, a whole one is small enough to buffer, so stream_size is ignored
+  std::list<netstring_entity_t> from_stream(const char* start,
+                                            size_t length,
+                                            size_t max_size = std::numeric_limits<size_t>::max(),
+                                            size_t stream_size = std::numeric_limits<size_t>::max());
   void flush_stream();
   size_t size() const;
   void log(uint32_t id) const;
@@ -42,9 +50,12 @@ struct netstring_entity_t {
 
   std::string body;
   size_t body_length;
+  part_t part = WHOLE_REQUEST;
 
   // TODO: fix this when we refactor to avoid subclassing the server
   std::list<uint64_t> enqueued;
+  bool streaming = false;
+  uint64_t streamed = 0;
 };
 
 class netstring_client_t : public client_t {
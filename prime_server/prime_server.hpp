@@ -10,12 +10,18 @@
 #include <functional>
 #include <limits>
 #include <list>
+#include <map>
+#include <memory>
+#include <random>
 #include <string>
 #include <type_traits>
 #include <unordered_map>
 #include <unordered_set>
 #include <utility>
+#include <vector>
 
+#include <prime_server/metrics.hpp>
+#include <prime_server/timer_wheel.hpp>
 #include <prime_server/zmq_helpers.hpp>
 
 /*
@@ -57,13 +63,60 @@ protected:
 
 constexpr size_t DEFAULT_MAX_REQUEST_SIZE = 1024 * 1024 * 10; // 10 megabytes
 constexpr uint32_t DEFAULT_REQUEST_TIMEOUT = std::numeric_limits<uint32_t>::max(); // infinity seconds
+constexpr uint32_t DEFAULT_SESSION_TIMEOUT = 75; // idle keep-alive seconds
+constexpr uint32_t DEFAULT_HEADER_TIMEOUT = 60;  // seconds to finish sending a request once started
+constexpr size_t DEFAULT_WAKEUP_BUDGET = 64;     // messages to take off each socket per poll
+constexpr size_t DEFAULT_MAX_REORDER_SIZE = 1024 * 1024 * 64; // pipelined response bytes to hold back
+constexpr size_t DEFAULT_STREAM_BODY_SIZE = std::numeric_limits<size_t>::max(); // never stream bodies
+constexpr uint32_t DEFAULT_WORKER_CREDITS = 1;    // jobs a worker holds at once, 1 is no prefetch
+constexpr size_t DEFAULT_BATCH_SIZE = 1;          // jobs the proxy gathers per worker, 1 is off
+constexpr uint32_t DEFAULT_BATCH_WAIT = 0;        // microseconds the proxy holds jobs to fill a batch
+constexpr uint32_t DEFAULT_WORKER_EXPIRY = 5;     // seconds a worker can go without checking in
+constexpr uint32_t DEFAULT_AFFINITY_WAIT = 1000;  // microseconds a job waits for its own worker
+
+// what part of a request a request container parsed out of the stream. a request whose body is
+// larger than the servers stream_body_size is handed back as soon as its headers are in, with
+// whatever of its body came with them, and the rest of its body follows in pieces
+enum part_t : uint8_t { WHOLE_REQUEST, REQUEST_START, BODY_PIECE, BODY_END };
+
+// which available worker the proxy gives a job to when there is no choose function or it has no
+// preference. each credit a worker has is like a place in line:
+//   FIFO        the worker thats been waiting longest, a worker with credits left goes to the back
+//   LIFO        the worker that most recently became available, keeping its caches warm
+//   ROUND_ROBIN the workers take turns in the order they first showed up
+//   RANDOM      any of them
+//   BEST_OF_TWO the faster of two random ones, going by how long each has been taking to finish jobs
+enum schedule_t : uint8_t { FIFO, LIFO, ROUND_ROBIN, RANDOM, BEST_OF_TWO };
 
 // TODO: bundle both request_containter_t (req, rep) and request_info_t into
 // a single session_t that implements all the guts of the protocol
 
 // TODO: make configuration objects to use as parameter packs because these constructors are large
 
-// server sits between a clients and a load balanced backend
+// milliseconds since the epoch, deadlines go between processes so they are on the wall clock
+uint64_t epoch_ms();
+
+// where a server sits among the shards of a sharded front end
+struct shard_t {
+  uint32_t index; // request ids handed out are index, index + count, index + 2 * count, etc
+  uint32_t count; // how many shards there are
+  int listen_fd;  // an already listening socket to accept clients on instead of binding one, or -1
+};
+
+// a listening socket for a tcp://host:port endpoint that other sockets can also listen on at the same
+// port, the kernel then spreads the incoming connections over all of them. throws if it cant
+int reuseport_listener(const std::string& endpoint);
+
+// server sits between a clients and a load balanced backend. request infos start with the id, the
+// time stamp in seconds and the deadline in milliseconds after the time stamp, each a uint32, which
+// is all the proxies and workers look at. the deadline is the sooner of what the request asked for
+// and the request timeout, once it passes proxies drop the job and workers are interrupted. a
+// streamed body gets more time as it comes in so those requests dont have a deadline. interrupts are
+// published with the id and time stamp as the topic so subscribers can filter for the jobs they have,
+// and a subscription to a request that is already gone gets its interrupt again so a worker that
+// subscribes after it went out still hears it.
+// requests matching the metrics matcher are answered right away, like health checks, with a scrape of
+// the metrics registry for everything in the process
 template <class request_container_t, class request_info_t>
 class server_t {
 public:
@@ -78,21 +131,78 @@ public:
            size_t max_request_size = DEFAULT_MAX_REQUEST_SIZE,
            uint32_t request_timeout = DEFAULT_REQUEST_TIMEOUT,
            const health_check_matcher_t& health_check_matcher = {},
-           const std::string& health_check_response = {});
+           const std::string& health_check_response = {},
+           uint32_t session_timeout = DEFAULT_SESSION_TIMEOUT,
+           uint32_t header_timeout = DEFAULT_HEADER_TIMEOUT,
+           size_t wakeup_budget = DEFAULT_WAKEUP_BUDGET,
+           bool framing_only = false,
+           const shard_t& shard = {0, 1, -1},
+           size_t max_reorder_size = DEFAULT_MAX_REORDER_SIZE,
+           size_t stream_body_size = DEFAULT_STREAM_BODY_SIZE,
+           const health_check_matcher_t& metrics_matcher = {});
+  server_t(server_t&&) = default;
   virtual ~server_t();
-  void serve();
+  virtual void serve();
 
 protected:
-  void handle_request(std::list<zmq::message_t>& messages);
+  // what the timers in the wheel are keeping track of
+  enum timer_kind_t : uint8_t { REQUEST_TIMEOUT, SESSION_TIMEOUT, HEADER_TIMEOUT };
+  // a connection and the timer that will expire it if the client doesnt do anything
+  struct session_t {
+    request_container_t request;
+    timer_wheel_t::handle_t timer;
+    timer_kind_t timer_kind;
+    // bytes of responses held back because an earlier pipelined request isnt done yet
+    size_t reordered;
+  };
+  using sessions_t = std::unordered_map<zmq::message_t, session_t>;
+  // a request in progress, who its for and the timer that will expire it
+  struct pending_t {
+    zmq::message_t requester;
+    request_info_t info;
+    timer_wheel_t::handle_t timer;
+    // pieces of the response that have to wait for an earlier request on the same session to finish
+    std::list<zmq::message_t> held;
+    // whether the last piece is in held and whether we already sent the client some of it
+    bool done;
+    bool started;
+    // when in steady microseconds we sent it on
+    uint64_t since;
+  };
+  using requests_t = std::unordered_map<uint64_t, pending_t>;
+
+  void handle_request(zmq::multipart_t& messages);
+  // results are the request info and the response, a third part means its only a piece of the
+  // response and more are on the way
+  void handle_result(zmq::multipart_t& messages);
+  bool stream(const request_info_t& info, const zmq::message_t& piece);
+  void hold(typename requests_t::iterator request,
+            const zmq::message_t& response,
+            typename sessions_t::iterator session);
   virtual bool enqueue(const zmq::message_t& requester,
                        const zmq::message_t& message,
                        request_container_t& streaming_request);
   virtual bool dequeue(const request_info_t& info, const zmq::message_t& response);
+  bool forward_body(uint64_t key, const std::string& piece, bool last);
+  bool respond(typename requests_t::iterator request,
+               const request_info_t& info,
+               const zmq::message_t& response,
+               typename sessions_t::iterator session);
   void handle_timeouts();
+  // republish the interrupts of requests we no longer have to whoever just subscribed to them
+  void handle_subscriptions();
+  void handle_timer(uint64_t key, uint8_t kind);
+  void schedule_session(typename sessions_t::iterator session);
+  // how bytes get back to the client and how we hang up on them, a subclass that talks to its clients
+  // some other way than the stream socket overrides these and its own serve
+  virtual bool reply(const zmq::message_t& requester, const zmq::message_t& message);
+  virtual bool disconnect(const zmq::message_t& requester);
+  void close_session(typename sessions_t::iterator session);
+  uint32_t next_request_id();
 
-  // contractual obligations for supplying your own request_info_t, the last 2 are strict for the
-  // purposes of allowing the server/proxy/worker to easily peak at the request id and time stamp
-  // without knowing the protocol
+  // contractual obligations for supplying your own request_info_t, the last ones are strict for the
+  // purposes of allowing the server/proxy/worker to easily peak at the request id, time stamp and
+  // deadline without knowing the protocol
   static_assert(std::is_trivial<request_info_t>::value, "request_info_t must be trivial");
   static_assert(std::is_same<decltype(request_info_t().id), uint32_t>::value,
                 "request_info_t::id must be uint32_t");
@@ -102,78 +212,294 @@ protected:
                 "request_info_t::id must be the first member");
   static_assert(offsetof(request_info_t, time_stamp) == sizeof(uint32_t),
                 "request_info_t::time_stamp must be the second member");
+  static_assert(std::is_same<decltype(request_info_t().deadline), uint32_t>::value,
+                "request_info_t::deadline must be uint32_t");
+  static_assert(offsetof(request_info_t, deadline) == 2 * sizeof(uint32_t),
+                "request_info_t::deadline must be the third member");
 
   zmq::socket_t client;
   zmq::socket_t proxy;
   zmq::socket_t loopback;
+  // publishes the id and time stamp of each interrupted request, they are also the topic, and takes
+  // in the subscriptions to them
   zmq::socket_t interrupt;
 
   bool log;
   size_t max_request_size;
   uint32_t request_timeout;
   uint32_t request_id;
+  uint32_t session_timeout;
+  uint32_t header_timeout;
+  size_t wakeup_budget;
+  // only find where requests start and end and leave the rest of the parsing to the workers
+  bool framing_only;
+  shard_t shard;
+  // pipelined responses go out in the order the requests came in, this caps how many bytes of them we
+  // will hold back for a session while waiting on an earlier one before giving up on the client
+  size_t max_reorder_size;
+  // request bodies larger than this are not buffered, the start of the request goes to a worker as
+  // soon as the headers are in and the rest of the body follows it there as it arrives. these bodies
+  // dont count against max_request_size since we only ever hold a piece of them
+  size_t stream_body_size;
+  // how many times poll woke us up and how many messages we handled, the ratio of the two tells
+  // you how well we are amortizing the polling
+  uint64_t wakeups;
+  uint64_t handled;
 
   // a record of what open connections we have
-  // TODO: keep time of last session activity and clear out stale sessions
-  std::unordered_map<zmq::message_t, request_container_t> sessions;
+  sessions_t sessions;
   // a record of what requests we have in progress
-  std::unordered_map<uint64_t, zmq::message_t> requests;
-  // order list of requests
-  std::list<request_info_t> request_history;
+  requests_t requests;
+  // millisecond timers for expiring requests and sessions
+  timer_wheel_t timers;
   // a matcher for determining whether a request is a health check or not
   std::function<bool(const request_container_t&)> health_check_matcher;
   // the response bytes to send when a health check request is received
   zmq::message_t health_check_response;
+  // a matcher for determining whether a request is a scrape of the metrics
+  std::function<bool(const request_container_t&)> metrics_matcher;
+  // what we report, these live in the registry for the life of the process
+  metrics::counter_t* requests_total;
+  metrics::counter_t* timeouts_total;
+  metrics::counter_t* interrupts_total;
+  metrics::gauge_t* requests_in_flight;
+  metrics::gauge_t* open_sessions;
+  metrics::histogram_t* request_seconds;
 };
 
-// proxy messages between layers of a backend load balancing in between
+// runs a server per thread, each accepting its own share of the connections on the same endpoint so
+// that client io, parsing and session bookkeeping can use more than one core. they all send work to
+// the same proxy and hand out request ids that dont collide. workers send their results to the one
+// result endpoint where we route them to the shard whose client they belong to, interrupts from all
+// the shards are published on the one interrupt endpoint. sharding needs a tcp client endpoint and
+// a platform with SO_REUSEPORT so the kernel can spread the connections out, with a single shard its
+// just a regular server
+template <class request_container_t, class request_info_t>
+class sharded_server_t {
+public:
+  using server_type = server_t<request_container_t, request_info_t>;
+  using health_check_matcher_t = typename server_type::health_check_matcher_t;
+
+  sharded_server_t(zmq::context_t& context,
+                   const std::string& client_endpoint,
+                   const std::string& proxy_endpoint,
+                   const std::string& result_endpoint,
+                   const std::string& interrupt_endpoint,
+                   size_t shards,
+                   bool log = false,
+                   size_t max_request_size = DEFAULT_MAX_REQUEST_SIZE,
+                   uint32_t request_timeout = DEFAULT_REQUEST_TIMEOUT,
+                   const health_check_matcher_t& health_check_matcher = {},
+                   const std::string& health_check_response = {},
+                   uint32_t session_timeout = DEFAULT_SESSION_TIMEOUT,
+                   uint32_t header_timeout = DEFAULT_HEADER_TIMEOUT,
+                   size_t wakeup_budget = DEFAULT_WAKEUP_BUDGET,
+                   bool framing_only = false,
+                   size_t max_reorder_size = DEFAULT_MAX_REORDER_SIZE,
+                   size_t stream_body_size = DEFAULT_STREAM_BODY_SIZE,
+                   const health_check_matcher_t& metrics_matcher = {});
+  sharded_server_t(sharded_server_t&&) = default;
+  virtual ~sharded_server_t();
+  // runs each shard on its own thread and routes results and interrupts on this one
+  void serve();
+
+protected:
+  std::vector<server_type> servers;
+  // results come in here and go out to the shards
+  zmq::socket_t results;
+  std::vector<zmq::socket_t> shard_results;
+  // interrupts come in from the shards and go out here
+  zmq::socket_t shard_interrupts;
+  zmq::socket_t interrupts;
+};
+
+// interrupted jobs kept until their requests are too old for anyone to still be holding them
+class interrupt_buckets_t;
+
+// proxy messages between layers of a backend load balancing in between. a job whose body is
+// streamed in comes as [info][job][""], the empty part on the end meaning more of it is on the way.
+// the rest of the body follows as [info][piece][""] and then [info][piece] for the last of it, all of
+// which go to the worker that got the job. with a batch size above one the proxy holds on to new jobs
+// until it has that many or the oldest has waited batch_wait microseconds and then sends them to the
+// same worker back to back, as many as that worker has credits for. idle workers advertise every
+// second and busy ones check in about as often, one we havent heard from for worker_expiry seconds
+// is dropped along with its jobs, its stats and its places on the ring until it comes back. if a job
+// cant be sent to a worker the job goes to the next worker instead. with a key function
+// jobs with the same key go to the same worker, their place on a consistent hash ring of all the
+// workers we know, so that workers keep their caches warm as others come and go. if that worker is
+// busy the job waits up to affinity_wait microseconds for it before going to the next one on the ring
+// and a proxy given the servers interrupt endpoint drops the jobs it is holding once their clients go
+// away or time out, so workers never see them
 class proxy_t {
 public:
   // allows you to favor a certain heartbeat/worker for a given job
   using choose_function_t = std::function<const zmq::message_t*(const std::list<zmq::message_t>&,
                                                                 const std::list<zmq::message_t>&)>;
+  // gets the key from the job that decides where it goes on the ring
+  using key_function_t = std::function<std::string(const std::list<zmq::message_t>&)>;
   proxy_t(zmq::context_t& context,
           const std::string& upstream_endpoint,
           const std::string& downstream_endpoint,
-          const choose_function_t& choose_function = {});
+          const choose_function_t& choose_function = {},
+          size_t batch_size = DEFAULT_BATCH_SIZE,
+          uint32_t batch_wait = DEFAULT_BATCH_WAIT,
+          uint32_t worker_expiry = DEFAULT_WORKER_EXPIRY,
+          schedule_t schedule = FIFO,
+          const key_function_t& key_function = {},
+          uint32_t affinity_wait = DEFAULT_AFFINITY_WAIT,
+          const std::string& interrupt_endpoint = "");
+  proxy_t(proxy_t&&) = default;
   virtual ~proxy_t();
   void forward();
 
 protected:
   virtual int expire();
+  // send a new job to a bored worker or the next piece of a body to the worker that has its job,
+  // false if there is no one to send it to yet. since is when it got here in microseconds
+  bool dispatch(zmq::multipart_t& messages, bool new_job, uint64_t since);
+  // send on whatever we had to hang on to that can go now
+  void unpark();
+  // whether weve held on to enough jobs or for long enough to send them on
+  bool batch_ready() const;
+  // stop sending jobs to this worker until it advertises again
+  void forget(const zmq::message_t* heart_beat);
+  // add a worker that just advertised to the available ones
+  std::list<zmq::message_t>::iterator available(zmq::message_t&& heart_beat);
+  // which worker gets the next job according to the schedule
+  const zmq::message_t* next_worker();
+  // a worker got its batch so let the schedule move on from it
+  void rotate(const zmq::message_t* heart_beat);
+  // a worker checked in so we know its still alive, and for each of the jobs it had from us that it
+  // finished we know how long that took
+  void serviced(const zmq::message_t& address, uint32_t finished = 0, uint32_t dropped = 0);
+  // take note of the interrupted jobs and drop the ones we are holding on to
+  void handle_interrupts();
+  // a worker is gone so stop sending it jobs, forget how it was doing and take it off the ring
+  void leave(const zmq::message_t& address);
+  // the available worker on the ring for this hash, null if its own worker is busy and it hasnt
+  // waited long enough to go to another one
+  const zmq::message_t* on_ring(uint64_t hash, uint64_t since);
 
   zmq::socket_t upstream;
   zmq::socket_t downstream;
+  zmq::socket_t interrupt;
   choose_function_t choose_function;
+  size_t batch_size;
+  uint32_t batch_wait;
+  uint64_t worker_expiry;
+  uint64_t next_expiry;
+  // how many jobs were dropped because they were past their deadline before they went out
+  uint64_t expired;
+  // the jobs that were interrupted and how many of them we dropped before they went out
+  std::shared_ptr<interrupt_buckets_t> interrupts;
+  uint64_t cancelled;
+  schedule_t schedule;
+  key_function_t key_function;
+  uint32_t affinity_wait;
+
+  // a worker that can take more jobs, where it is and how many more it can take
+  struct available_t {
+    zmq::message_t address;
+    uint32_t credits;
+    size_t index;
+  };
 
   // we want a fifo queue in the case that the proxy doesnt care what worker to send jobs to
   // having this constraint does also require that we store a bidirectional mapping between
   // worker addresses and their heartbeats. since heartbeats are application defined we only
-  // store them once (they could be larger) and opt for storing the worker addresses duplicated
+  // store them once (they could be larger) and opt for storing the worker addresses duplicated.
+  // a worker stays in the queue for as many jobs as it has credits, going to the back after each
   std::list<zmq::message_t> fifo;
   std::unordered_map<zmq::message_t, std::list<zmq::message_t>::iterator> workers;
-  std::unordered_map<const zmq::message_t*, zmq::message_t> heart_beats;
+  std::unordered_map<const zmq::message_t*, available_t> heart_beats;
+  // the same heartbeats indexed so a random one can be picked in constant time, each knows its index
+  std::vector<const zmq::message_t*> indexed;
+  // whose turn it is when round robin
+  std::list<zmq::message_t>::iterator turn;
+  std::mt19937 generator;
+  // how each worker has been doing, kept even while it has no credits. service time is how long in
+  // microseconds from when we send it a job until it says it finished it, smoothed over the jobs.
+  // this is every worker we know about so its also where we keep when in steady milliseconds we last
+  // heard from each one, busy or not
+  struct service_t {
+    double service_time;
+    uint64_t jobs;
+    uint64_t last_seen;
+    // when each job it still has went out to it
+    std::list<uint64_t> outstanding;
+    // what we report about it
+    metrics::gauge_t* service_microseconds;
+    metrics::counter_t* jobs_total;
+    metrics::gauge_t* outstanding_jobs;
+  };
+  std::unordered_map<zmq::message_t, service_t> services;
+  // each worker we know about has many places on the ring, pointing at its address in services
+  std::map<uint64_t, const zmq::message_t*> ring;
+  // the jobs whose bodies are still streaming in and the address of the worker that has each, which
+  // is empty until the job is handed out
+  std::unordered_map<uint64_t, zmq::message_t> streams;
+  // while bodies are streaming we cant leave things waiting on the upstream socket or the pieces of
+  // those bodies would be stuck behind them, so jobs with no worker to go to wait here instead. the
+  // flag says whether its a new job or a piece of a body
+  struct parked_t {
+    bool new_job;
+    uint64_t since;
+    zmq::multipart_t messages;
+  };
+  std::list<parked_t> parked;
+  // the worker whose batch we are filling and how many jobs it has gotten so far
+  const zmq::message_t* batching;
+  size_t batched;
+  // what we report, these live in the registry for the life of the process
+  std::string metric_labels;
+  metrics::counter_t* dispatched_total;
+  metrics::counter_t* expired_total;
+  metrics::counter_t* cancelled_total;
+  metrics::gauge_t* queued_jobs;
+  metrics::gauge_t* idle_workers;
+  metrics::histogram_t* wait_seconds;
 };
 
-// get work from a load balancer proxy letting it know when you are idle
+// get work from a load balancer proxy letting it know how many more jobs you can take. a worker with
+// more than one credit is sent jobs before it finishes the one its on and keeps them in a local queue
+// so it doesnt sit idle waiting on the proxy between jobs. the queued jobs are still interrupted.
+// a worker with a batch work function hands up to batch_size of its queued jobs to it at once. a
+// worker only subscribes to the interrupts for the jobs it has, so it doesnt hear about anyone elses
 class worker_t {
 public:
-  // TODO: refactor this to allow streaming response (transfer-encoding: chunked)
-  // might want to add another bool in here to signal that we need to call the work
-  // function again until it somehow signals that its sending the last chunk
+  // a final result can be streamed back to the client in pieces by setting more. the work function
+  // is then called again with the same job for the next piece until it returns one without more.
+  // each piece is forwarded to the client as soon as its ready so its up to the work function to
+  // remember where it left off and to frame the pieces, eg with http_response_t::chunk
   struct result_t {
     bool intermediate;
     std::list<std::string> messages;
     std::string heart_beat;
+    bool more = false;
   };
   // call this periodically in the work function to bail if the request is defunct. if this
   // is the case, it throws (but don't catch it) so the worker can bail. this happens if
-  // the client disconnects, the request times out or the process is shutting down
+  // the client disconnects, the request times out or the process is shutting down. interrupts are
+  // taken in on a thread of their own so this is cheap enough to call in a tight loop. its also how a
+  // worker on a long job checks in with the proxy, one that doesnt call it for longer than the proxys
+  // worker expiry is taken for dead
   using interrupt_function_t = std::function<void()>;
   // the work function is what receives the request, does the work and returns the result.
-  // the result could be final and return to the client or go on to the next pipeline stage
+  // the result could be final and return to the client or go on to the next pipeline stage.
+  // when the server streams the body of a request the job is followed in the list by the rest of
+  // the body in as many pieces as it took to arrive
   using work_function_t =
       std::function<result_t(const std::list<zmq::message_t>&, void*, interrupt_function_t&)>;
+  // a job in a batch is its messages and its request info
+  struct job_t {
+    std::list<zmq::message_t> messages;
+    void* request_info;
+  };
+  // the batch work function gets many jobs at once and returns one result per job in the same order.
+  // each result goes back on its own, but they cant be streamed so more is ignored. the interrupt
+  // function only throws once every job in the batch is defunct
+  using batch_work_function_t =
+      std::function<std::list<result_t>(std::list<job_t>&, interrupt_function_t&)>;
   // the cleanup function is called when the worker is done with the request. it is used to clean
   // up any ephemeral resources used by the worker
   using cleanup_function_t = std::function<void()>;
@@ -185,25 +511,85 @@ public:
            const std::string& interrupt_endpoint,
            const work_function_t& work_function,
            const cleanup_function_t& cleanup_function = {},
-           const std::string& heart_beat = "");
+           const std::string& heart_beat = "",
+           uint32_t credits = DEFAULT_WORKER_CREDITS);
+  // a worker whose credits are at least batch_size so the proxy can send it a whole batch
+  worker_t(zmq::context_t& context,
+           const std::string& upstream_proxy_endpoint,
+           const std::string& downstream_proxy_endpoint,
+           const std::string& result_endpoint,
+           const std::string& interrupt_endpoint,
+           const batch_work_function_t& batch_work_function,
+           size_t batch_size,
+           const cleanup_function_t& cleanup_function = {},
+           const std::string& heart_beat = "",
+           uint32_t credits = DEFAULT_WORKER_CREDITS);
+  worker_t(worker_t&&) = default;
   virtual ~worker_t();
   void work();
 
 protected:
-  void advertise();
+  // tell the proxy we are here, how many jobs we can hold and how many we finished or dropped, or
+  // when busy just that we are here
+  void advertise(bool busy = false);
   virtual void handle_interrupt(bool force_check);
+  // take whatever the proxy has sent us into the queue without waiting
+  void receive();
+  void handle_job(std::list<zmq::message_t>& messages, interrupt_function_t& bail);
+  void handle_batch(interrupt_function_t& bail);
+  // send a result on to the next proxy or back to the client
+  void send_result(const zmq::message_t& request_info, result_t& result);
+  // whether the job or every job in the batch has been interrupted or is past its deadline
+  bool interrupted() const;
+  // whether this particular job has been interrupted
+  bool interrupted(uint64_t key) const;
+  // let the listener know what we are working on now
+  void watch();
+  // have the listener start or stop listening for interrupts of this job
+  void subscribe(uint64_t key, bool subscribing);
+  // takes in interrupts on its own thread and flags the job once its defunct
+  void listen();
+  // wait for the rest of a streamed body to come in after the job
+  void receive_body(std::list<zmq::message_t>& messages);
+  // forget queued jobs that were interrupted or went past their deadline before we got to them
+  void drop_interrupted();
 
   zmq::socket_t upstream_proxy;
   zmq::socket_t downstream_proxy;
   zmq::socket_t loopback;
   zmq::socket_t interrupt;
+  // pokes the listener when the job changes so it can keep an eye on the new deadline and passes it
+  // the jobs whose interrupts to subscribe to, only its thread can touch the interrupt socket
+  zmq::socket_t wake;
+  zmq::socket_t woken;
 
   work_function_t work_function;
+  batch_work_function_t batch_work_function;
+  size_t batch_size;
   cleanup_function_t cleanup_function;
   std::string heart_beat;
+  uint32_t credits;
+  // jobs we finished or dropped since we last told the proxy
+  uint32_t finished;
+  uint32_t dropped;
   uint64_t job;
-  std::unordered_set<uint64_t> interrupts;
-  std::list<uint64_t> interrupt_history;
+  // when in milliseconds since the epoch nobody wants the job or the batch anymore, 0 if never
+  uint64_t job_deadline;
+  // the jobs in the batch we are working on
+  std::vector<uint64_t> batch;
+  // jobs we have but havent started, each still has its request info on the front
+  std::list<std::list<zmq::message_t>> queued;
+  // jobs whose streamed bodies are still coming in and where we are putting the pieces
+  std::unordered_map<uint64_t, std::list<zmq::message_t>*> incomplete;
+  // what the listener shares with the work thread, it lives on the heap so the worker can still move
+  struct listener_t;
+  std::shared_ptr<listener_t> listener;
+  // jobs we gave up on before their whole body came in, the rest of it still comes here to be dropped
+  std::unordered_set<uint64_t> abandoned;
+  // what we report, these live in the registry for the life of the process
+  metrics::counter_t* jobs_total;
+  metrics::counter_t* interrupted_total;
+  metrics::histogram_t* job_seconds;
 };
 
 // configures a daemon thread to listen for SIGTERM. upon receiving SIGTERM, this thread will wait
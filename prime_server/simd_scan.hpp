@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+namespace prime_server {
+namespace simd {
+
+// find the first occurrence of the byte in [begin, end) or end if its not there. this is what the
+// parsers use to hunt for delimiters so it is vectorized with sse2 or avx2 when the cpu has them.
+// which one is used is decided once at startup
+const char* find(const char* begin, const char* end, char byte);
+
+// the name of the implementation find is using: avx2, sse2 or scalar
+const char* implementation();
+
+// force a particular implementation, returns false if this cpu or build doesnt support it. this is
+// for testing and benchmarking and is not thread safe
+bool select(const std::string& implementation);
+
+} // namespace simd
+} // namespace prime_server
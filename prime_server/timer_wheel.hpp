@@ -0,0 +1,72 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace prime_server {
+
+// a hierarchical timing wheel (a la Varghese and Lauck) for keeping track of lots of timeouts. there
+// are 4 levels of 256 slots where each level spans 256 times as many ticks as the level below it, so
+// at millisecond ticks the wheel covers about 49 days before it has to clamp. scheduling and
+// cancelling are O(1) and firing is O(1) per timer plus the occasional cascade of a slot from a
+// higher level down into the lower ones. timers live in a pool so a steady state doesnt allocate
+class timer_wheel_t {
+public:
+  // opaque handle to a scheduled timer. cancelling a handle whose timer already fired or was
+  // already cancelled is a noop, even if its storage has since been reused for another timer
+  using handle_t = uint64_t;
+  static constexpr handle_t INVALID_HANDLE = 0;
+  // what gets called with the key and kind of each timer as it fires
+  using expire_function_t = std::function<void(uint64_t, uint8_t)>;
+
+  explicit timer_wheel_t(uint64_t now = 0);
+  // schedule a timer to fire at the deadline (in ticks) with some caller defined key and kind. a
+  // deadline that has already passed fires on the next tick
+  handle_t schedule(uint64_t deadline, uint64_t key, uint8_t kind = 0);
+  // stop a timer from firing and invalidate the handle
+  void cancel(handle_t& handle);
+  // fire every timer whose deadline is at or before now, returns how many fired. its safe to
+  // schedule and cancel timers from within the expire function
+  size_t advance(uint64_t now, const expire_function_t& expire);
+  // how many ticks we can wait before advancing again or -1 if there are no timers
+  int64_t next_expiry(uint64_t now) const;
+  // how many timers are scheduled
+  size_t size() const;
+
+protected:
+  static constexpr uint32_t NIL = 0xFFFFFFFF;
+  static constexpr size_t LEVELS = 4;
+  static constexpr size_t SLOT_BITS = 8;
+  static constexpr size_t SLOTS = 1 << SLOT_BITS;
+  static constexpr uint64_t SLOT_MASK = SLOTS - 1;
+
+  struct node_t {
+    uint64_t deadline;
+    uint64_t key;
+    uint32_t generation;
+    uint32_t prev;
+    uint32_t next;
+    uint16_t slot;
+    uint8_t kind;
+  };
+
+  void link(uint32_t index);
+  void unlink(uint32_t index);
+  void release(uint32_t index);
+  void cascade(size_t level, size_t slot);
+
+  // the tick we are about to process, everything before it has already fired
+  uint64_t current;
+  size_t count;
+  // timers are stored in a pool and linked into the slot lists by index
+  std::vector<node_t> nodes;
+  uint32_t free_list;
+  std::array<uint32_t, LEVELS * SLOTS> slots;
+  // which slots in the lowest level have timers in them so we can quickly find the next one
+  std::array<uint64_t, SLOTS / 64> occupied;
+};
+
+} // namespace prime_server
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include <prime_server/http_protocol.hpp>
+#include <prime_server/prime_server.hpp>
+
+struct io_uring_cqe;
+
+namespace prime_server {
+
+constexpr unsigned DEFAULT_RING_ENTRIES = 1024;      // submission queue slots
+constexpr unsigned DEFAULT_RECV_BUFFERS = 1024;      // registered receive buffers, a power of 2
+constexpr unsigned DEFAULT_RECV_BUFFER_SIZE = 16384; // bytes in each receive buffer
+constexpr size_t DEFAULT_ZERO_COPY_SIZE = 16384;     // responses at least this big are sent zero copy
+
+// a server that talks to its clients through io_uring rather than a ZMQ_STREAM socket. it accepts
+// and receives with multishot requests that read into a ring of receive buffers registered with the
+// kernel, so there is no identity frame per chunk and no copy through zmqs batching buffers. large
+// responses are sent zero copy straight out of the result message. the parsing, sessions, timeouts,
+// health checks and the proxy, result and interrupt endpoints are exactly those of server_t, only
+// the client endpoint must be tcp. this needs linux 6.0 or later and is only built when prime_server
+// is configured with io_uring support
+template <class request_container_t, class request_info_t>
+class uring_server_t : public server_t<request_container_t, request_info_t> {
+public:
+  using server_type = server_t<request_container_t, request_info_t>;
+  using health_check_matcher_t = typename server_type::health_check_matcher_t;
+
+  uring_server_t(zmq::context_t& context,
+                 const std::string& client_endpoint,
+                 const std::string& proxy_endpoint,
+                 const std::string& result_endpoint,
+                 const std::string& interrupt_endpoint,
+                 bool log = false,
+                 size_t max_request_size = DEFAULT_MAX_REQUEST_SIZE,
+                 uint32_t request_timeout = DEFAULT_REQUEST_TIMEOUT,
+                 const health_check_matcher_t& health_check_matcher = {},
+                 const std::string& health_check_response = {},
+                 uint32_t session_timeout = DEFAULT_SESSION_TIMEOUT,
+                 uint32_t header_timeout = DEFAULT_HEADER_TIMEOUT,
+                 size_t wakeup_budget = DEFAULT_WAKEUP_BUDGET,
+                 bool framing_only = false,
+                 size_t zero_copy_size = DEFAULT_ZERO_COPY_SIZE);
+  uring_server_t(uring_server_t&&) = default;
+  virtual ~uring_server_t();
+  virtual void serve() override;
+
+protected:
+  // what a submission was for, this and the connection id make up its user data
+  enum operation_t : uint8_t { ACCEPT, RECV, SEND, SEND_ZERO_COPY, RESULTS };
+
+  virtual bool reply(const zmq::message_t& requester, const zmq::message_t& message) override;
+  virtual bool disconnect(const zmq::message_t& requester) override;
+  void handle_completion(const io_uring_cqe& completion);
+  void handle_accept(int fd);
+  void handle_recv(uint32_t id, int result, uint32_t flags);
+  void handle_send(uint32_t id, int result, uint32_t flags, bool zero_copy, uint32_t sequence = 0);
+
+  // the ring, the receive buffers and the connections live in here so the header doesnt need
+  // liburing
+  struct ring_t;
+  std::shared_ptr<ring_t> ring;
+  size_t zero_copy_size;
+};
+
+using http_uring_server_t = uring_server_t<http_request_t, http_request_info_t>;
+
+} // namespace prime_server
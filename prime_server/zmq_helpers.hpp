@@ -1,12 +1,16 @@
 #pragma once
 
+#include <array>
 #include <cassert>
+#include <cstddef>
 #include <cstring>
 #include <functional>
+#include <iterator>
 #include <list>
 #include <memory>
 #include <string>
 #include <unordered_map>
+#include <vector>
 #include <zmq.h>
 
 namespace zmq {
@@ -19,6 +23,9 @@ protected:
   std::shared_ptr<void> ptr;
 };
 
+// a single message part. the zmq_msg_t lives inline so making, receiving and moving messages
+// doesnt allocate anything beyond what zmq itself needs for the bytes. they are move only, if you
+// really need another one that refers to the same bytes use copy()
 struct message_t {
   explicit message_t(
       void* data,
@@ -27,6 +34,14 @@ struct message_t {
         delete[] static_cast<unsigned char*>(p);
       });
   explicit message_t(size_t size = 0, const void* data = nullptr);
+  message_t(message_t&& other) noexcept;
+  message_t& operator=(message_t&& other) noexcept;
+  message_t(const message_t&) = delete;
+  message_t& operator=(const message_t&) = delete;
+  ~message_t();
+  // another message with the same bytes. large messages share their bytes by bumping a reference
+  // count in this message so it must not be copied from more than one thread at a time
+  message_t copy() const;
   operator zmq_msg_t*();
   void* data();
   const void* data() const;
@@ -36,7 +51,75 @@ struct message_t {
   bool operator!=(const message_t& other) const;
 
 protected:
-  std::shared_ptr<zmq_msg_t> ptr;
+  zmq_msg_t message;
+};
+
+// the parts of a multipart message. the first few parts are stored inline so receiving the usual 2
+// or 3 part messages passed between the server, proxy and workers doesnt allocate, any parts beyond
+// that spill over onto the heap
+class multipart_t {
+public:
+  static constexpr size_t INLINE_PARTS = 3;
+
+  template <class multipart_pointer_t, class part_t> class basic_iterator_t {
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = message_t;
+    using difference_type = std::ptrdiff_t;
+    using pointer = part_t*;
+    using reference = part_t&;
+    basic_iterator_t(multipart_pointer_t parts, size_t index) : parts(parts), index(index) {
+    }
+    reference operator*() const {
+      return (*parts)[index];
+    }
+    pointer operator->() const {
+      return &(*parts)[index];
+    }
+    basic_iterator_t& operator++() {
+      ++index;
+      return *this;
+    }
+    bool operator==(const basic_iterator_t& other) const {
+      return index == other.index;
+    }
+    bool operator!=(const basic_iterator_t& other) const {
+      return index != other.index;
+    }
+
+  protected:
+    multipart_pointer_t parts;
+    size_t index;
+  };
+  using iterator = basic_iterator_t<multipart_t*, message_t>;
+  using const_iterator = basic_iterator_t<const multipart_t*, const message_t>;
+
+  multipart_t();
+  size_t size() const;
+  bool empty() const;
+  message_t& operator[](size_t index);
+  const message_t& operator[](size_t index) const;
+  message_t& front();
+  const message_t& front() const;
+  message_t& back();
+  const message_t& back() const;
+  iterator begin();
+  iterator end();
+  const_iterator begin() const;
+  const_iterator end() const;
+  // add an empty part on the end and return it
+  message_t& emplace_back();
+  // remove the last part
+  void pop_back();
+  // remove the first part, the rest shift down to fill its place
+  void pop_front();
+  // remove all the parts
+  void clear();
+
+protected:
+  std::array<message_t, INLINE_PARTS> inline_parts;
+  std::vector<message_t> overflow_parts;
+  size_t count;
 };
 
 struct socket_t {
@@ -53,14 +136,24 @@ struct socket_t {
   bool recv(message_t& message, int flags);
   // read all of the messages on this socket
   std::list<message_t> recv_all(int flags);
+  // read all of the messages on this socket into the parts, returns false if there were none
+  bool recv_all(multipart_t& messages, int flags);
   // send some bytes
   bool send(const void* bytes, size_t count, int flags);
   // send a single message
   template <class container_t>
   bool send(const container_t& message, int flags);
+  // send a single message handing its bytes over to the socket without copying them, if it was sent
+  // the message is left empty
+  bool send(message_t&& message, int flags);
+  // send a single message sharing its bytes with the socket rather than copying them. this bumps a
+  // reference count in the message so it must not be sent from more than one thread at a time
+  bool send_shared(const message_t& message, int flags);
   // send all the messages over this socket
   template <class container_t>
   size_t send_all(const std::list<container_t>& messages, int flags);
+  // send all the messages over this socket handing their bytes over to the socket
+  size_t send_all(multipart_t&& messages, int flags);
   // for polling
   operator void*();
 
@@ -106,6 +199,54 @@ protected:
 using pollitem_t = zmq_pollitem_t;
 int poll(pollitem_t* items, int count, long timeout = -1);
 
+// waits on a set of sockets and runs a handler for each one that has messages waiting, it also runs
+// periodic timers. sockets are registered once rather than every time we wait. if libzmq was built
+// with the draft api this uses zmq_poller, which is epoll on linux, otherwise it keeps a persistent
+// array of pollitems for zmq_poll
+class reactor_t {
+public:
+  using handler_t = std::function<void()>;
+  using timer_handle_t = size_t;
+
+  reactor_t();
+  ~reactor_t();
+  reactor_t(const reactor_t&) = delete;
+  reactor_t& operator=(const reactor_t&) = delete;
+  // run the handler whenever the socket has messages waiting, handlers run in the order the sockets
+  // were added. the socket must outlive the reactor
+  void add(socket_t& socket, const handler_t& handler);
+  // stop or resume watching a socket, messages just queue up on it while its disabled
+  void enable(socket_t& socket, bool enabled);
+  // run the handler every interval milliseconds
+  timer_handle_t add_timer(long interval, const handler_t& handler);
+  void cancel_timer(timer_handle_t timer);
+  // wait at most timeout milliseconds (-1 is forever) for any sockets or timers to be ready and run
+  // their handlers, returns how many handlers ran
+  int poll(long timeout = -1);
+
+protected:
+  struct watched_t {
+    void* socket;
+    handler_t handler;
+    bool enabled;
+  };
+  struct periodic_t {
+    long interval;
+    uint64_t due;
+    handler_t handler;
+  };
+
+  std::vector<watched_t> watched;
+  std::vector<bool> ready;
+  std::list<periodic_t> timers;
+#ifdef ZMQ_HAVE_POLLER
+  void* poller;
+  std::vector<zmq_poller_event_t> events;
+#else
+  std::vector<zmq_pollitem_t> items;
+#endif
+};
+
 // get a random port in IANA suggested range
 uint16_t random_port();
 } // namespace zmq
@@ -1,8 +1,9 @@
 #include "http_protocol.hpp"
+#include "simd_scan.hpp"
 #include "logging/logging.hpp"
 
-#include <ctime>
-#include <curl/curl.h>
+#include <charconv>
+#include <cstring>
 
 using namespace prime_server;
 
@@ -13,22 +14,99 @@ namespace {
 const std::string CONTENT_LENGTH("\r\nContent-Length: ");
 const std::string DOUBLE_RETURN("\r\n\r\n");
 
+// the reserved characters that delimit the path and query are left alone so the target stays readable
+// and in the common case can be looked at in place without decoding it
+bool unescaped(char c) {
+  if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'))
+    return true;
+  switch (c) {
+    case '-':
+    case '.':
+    case '_':
+    case '~':
+    case '/':
+    case '?':
+    case '&':
+    case '=':
+    case ':':
+    case '@':
+    case '!':
+    case '$':
+    case '\'':
+    case '(':
+    case ')':
+    case '*':
+    case '+':
+    case ',':
+    case ';':
+      return true;
+    default:
+      return false;
+  }
+}
+
+// the time stamp is the whole second the request arrived in, cut from the same millisecond clock we
+// measure the deadline on so the milliseconds past it are exactly when the request arrived
+uint32_t to_time_stamp(uint64_t arrived) {
+  return static_cast<uint32_t>(arrived / 1000);
+}
+
+// the client can ask to be answered within some milliseconds of arriving which we carry as
+// milliseconds after the time stamp, anything thats not a number is ignored
+uint32_t to_deadline(uint64_t arrived, std::string_view timeout) {
+  uint64_t milliseconds = 0;
+  for (auto c : timeout) {
+    if (c < '0' || c > '9' || milliseconds > std::numeric_limits<uint32_t>::max())
+      return 0;
+    milliseconds = milliseconds * 10 + (c - '0');
+  }
+  auto deadline = arrived % 1000 + milliseconds;
+  return milliseconds == 0 || deadline > std::numeric_limits<uint32_t>::max()
+             ? 0
+             : static_cast<uint32_t>(deadline);
+}
+
+int hex_value(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
 std::string url_encode(const std::string& unencoded) {
-  char* encoded = curl_escape(unencoded.c_str(), static_cast<int>(unencoded.size()));
-  if (encoded == nullptr)
-    throw std::runtime_error("url encoding failed");
-  std::string encoded_str(encoded);
-  curl_free(encoded);
-  return encoded_str;
+  static const char hex[] = "0123456789ABCDEF";
+  std::string encoded;
+  encoded.reserve(unencoded.size());
+  for (auto c : unencoded) {
+    if (unescaped(c))
+      encoded.push_back(c);
+    else {
+      auto byte = static_cast<unsigned char>(c);
+      encoded.push_back('%');
+      encoded.push_back(hex[byte >> 4]);
+      encoded.push_back(hex[byte & 15]);
+    }
+  }
+  return encoded;
 }
 
-std::string url_decode(const std::string& encoded) {
-  char* decoded = curl_unescape(encoded.c_str(), static_cast<int>(encoded.size()));
-  if (decoded == nullptr)
-    throw std::runtime_error("url decoding failed");
-  std::string decoded_str(decoded);
-  curl_free(decoded);
-  return decoded_str;
+// decoding never makes it longer so decoded needs at most length bytes and can even be the same
+// memory as encoded. escapes that arent followed by 2 hex digits are left as is
+size_t url_decode(const char* encoded, size_t length, char* decoded) {
+  size_t size = 0;
+  for (size_t i = 0; i < length; ++i) {
+    int high, low;
+    if (encoded[i] == '%' && i + 2 < length &&
+        (high = hex_value(encoded[i + 1])) != -1 && (low = hex_value(encoded[i + 2])) != -1) {
+      decoded[size++] = static_cast<char>((high << 4) | low);
+      i += 2;
+    } else
+      decoded[size++] = encoded[i];
+  }
+  return size;
 }
 
 const headers_t::value_type CORS{"Access-Control-Allow-Origin", "*"};
@@ -60,6 +138,49 @@ size_t name_max(const std::unordered_map<std::string, T>& methods) {
 }
 const size_t METHOD_MAX_SIZE = name_max(prime_server::STRING_TO_METHOD) + 1;
 const size_t VERSION_MAX_SIZE = name_max(prime_server::SUPPORTED_VERSIONS) + 2;
+
+// a job is a request the server already parsed, laid out so a worker can look at it in place:
+//
+//   job_header_t | query spans | header spans | path ? query | header names and values | body
+//
+// every span is an offset from the start of the job and a length. there is a key span and a value
+// span for each query parameter and a name span and a value span for each header. the numbers are
+// in host byte order. the first byte is 0 so it can never be mistaken for an http request
+constexpr char JOB_MAGIC[4] = {'\0', 'P', 'S', 'H'};
+constexpr uint8_t JOB_FORMAT = 1;
+struct job_span_t {
+  uint32_t offset;
+  uint32_t length;
+};
+struct job_header_t {
+  char magic[4];
+  uint8_t format;
+  uint8_t method;
+  uint8_t version;
+  uint8_t spare;
+  uint32_t query_count;
+  uint32_t header_count;
+  job_span_t target;
+  uint32_t query_begin;
+  job_span_t body;
+};
+static_assert(sizeof(job_header_t) == 36, "job_header_t should not have any padding");
+const std::string_view JOB_VERSIONS[] = {"HTTP/1.0", "HTTP/1.1"};
+
+// whether the header line has this field name ignoring case
+bool is_field(const std::string& line, size_t field_end, const char* name) {
+  return std::strlen(name) == field_end &&
+         std::equal(line.begin(), line.begin() + field_end, name,
+                    [](char a, char b) { return ::tolower(a) == ::tolower(b); });
+}
+
+// copy bytes into the job and return the span they ended up in
+job_span_t write_span(char* job, size_t& offset, std::string_view bytes) {
+  job_span_t span{static_cast<uint32_t>(offset), static_cast<uint32_t>(bytes.size())};
+  std::memcpy(job + offset, bytes.data(), bytes.size());
+  offset += bytes.size();
+  return span;
+}
 } // namespace
 
 namespace prime_server {
@@ -206,17 +327,38 @@ bool http_entity_t::consume_until() {
     }
   }
 
-  // go until delimiter
-  while ((c = *(delimiter + partial_length)) != '\0' && current != end) {
+  // finish off a delimiter that started at the end of the last piece of the stream, if it doesnt
+  // pan out those bytes were just data and we look again from here
+  while (partial_length && (c = delimiter[partial_length]) != '\0' && current != end) {
     if (c != *current)
       partial_length = 0;
-    else
+    else {
       ++partial_length;
-    ++current;
+      ++current;
+    }
+  }
+
+  // go until delimiter, we jump to each candidate first byte and then check the rest of it
+  if (!partial_length && *delimiter != '\0') {
+    while ((current = simd::find(current, end, *delimiter)) != end) {
+      // see how much of it is here
+      const char* matched = current + 1;
+      while (delimiter[matched - current] != '\0' && matched != end &&
+             *matched == delimiter[matched - current])
+        ++matched;
+      // we found all of it or ran out of stream part way through it
+      if (delimiter[matched - current] == '\0' || matched == end) {
+        partial_length = matched - current;
+        current = matched;
+        break;
+      }
+      ++current;
+    }
   }
 
   // we found the delimiter
   size_t length = current - cursor;
+  c = delimiter[partial_length];
   if (c == '\0' && !body_length) {
     if (length < partial_length)
       partial_buffer.resize(partial_buffer.size() - (partial_length - length));
@@ -248,8 +390,11 @@ void http_entity_t::flush_stream(const state_t current_state) {
 http_request_t::~http_request_t() {
 }
 
-http_request_t::http_request_t() : http_entity_t("", headers_t{}, "") {
-  path = "";
+http_request_t::http_request_t() : http_request_t(false) {
+}
+
+http_request_t::http_request_t(bool framing_only)
+    : http_entity_t("", headers_t{}, ""), framing_only(framing_only) {
   flush_stream();
 }
 
@@ -259,13 +404,19 @@ http_request_t::http_request_t(const method_t& method,
                                const query_t& query,
                                const headers_t& headers,
                                const std::string& version)
-    : http_entity_t(version, headers, body), method(method), path(path), query(query) {
+    : http_entity_t(version, headers, body), method(method), path(path), query(query),
+      framing_only(false) {
 }
 
 http_request_info_t http_request_t::to_info(uint32_t id) const {
   auto connection_header = headers.find("Connection");
+  auto timeout_header = headers.find("X-Timeout-Ms");
+  auto arrived = epoch_ms();
   return http_request_info_t{id,
-                             static_cast<uint32_t>(difftime(time(nullptr), 0) + .5),
+                             to_time_stamp(arrived),
+                             timeout_header == headers.end()
+                                 ? 0
+                                 : to_deadline(arrived, timeout_header->second),
                              static_cast<uint16_t>(version == "HTTP/1.0" ? 0 : 1),
                              static_cast<uint16_t>(connection_header != headers.end() &&
                                                    connection_header->second == "Keep-Alive"),
@@ -279,6 +430,70 @@ std::string http_request_t::to_string() const {
   return to_string(method, path, body, query, headers, version);
 }
 
+zmq::message_t http_request_t::to_job() const {
+  // we didnt parse it so the worker has to
+  if (framing_only)
+    return zmq::message_t(raw.size(), raw.data());
+
+  // figure out how big it will be
+  uint32_t query_count = 0;
+  size_t size = sizeof(job_header_t) + path.size() + body.size();
+  for (const auto& kv : query) {
+    for (const auto& value : kv.second) {
+      size += 1 + kv.first.size() + 1 + value.size();
+      ++query_count;
+    }
+  }
+  for (const auto& header : headers)
+    size += header.first.size() + header.second.size();
+  size += (query_count + headers.size()) * 2 * sizeof(job_span_t);
+  if (size > std::numeric_limits<uint32_t>::max())
+    throw std::runtime_error("Request is too large to be a job");
+
+  // the path and then the query string which has the spans of the keys and values in it
+  zmq::message_t message(size);
+  auto* job = static_cast<char*>(message.data());
+  job_header_t header{{JOB_MAGIC[0], JOB_MAGIC[1], JOB_MAGIC[2], JOB_MAGIC[3]},
+                      JOB_FORMAT,
+                      static_cast<uint8_t>(method),
+                      static_cast<uint8_t>(version == "HTTP/1.0" ? 0 : 1),
+                      0,
+                      query_count,
+                      static_cast<uint32_t>(headers.size()),
+                      {},
+                      std::numeric_limits<uint32_t>::max(),
+                      {}};
+  size_t span_offset = sizeof(job_header_t);
+  size_t offset = span_offset + (query_count + headers.size()) * 2 * sizeof(job_span_t);
+  header.target = write_span(job, offset, path);
+  bool first = true;
+  for (const auto& kv : query) {
+    for (const auto& value : kv.second) {
+      if (first)
+        header.query_begin = static_cast<uint32_t>(offset - header.target.offset);
+      write_span(job, offset, first ? "?" : "&");
+      first = false;
+      job_span_t spans[2];
+      spans[0] = write_span(job, offset, kv.first);
+      write_span(job, offset, "=");
+      spans[1] = write_span(job, offset, value);
+      std::memcpy(job + span_offset, spans, sizeof(spans));
+      span_offset += sizeof(spans);
+    }
+  }
+  header.target.length = static_cast<uint32_t>(offset - header.target.offset);
+
+  // then the headers and the body
+  for (const auto& kv : headers) {
+    job_span_t spans[2]{write_span(job, offset, kv.first), write_span(job, offset, kv.second)};
+    std::memcpy(job + span_offset, spans, sizeof(spans));
+    span_offset += sizeof(spans);
+  }
+  header.body = write_span(job, offset, body);
+  std::memcpy(job, &header, sizeof(header));
+  return message;
+}
+
 std::string http_request_t::to_string(const method_t& method,
                                       const std::string& path,
                                       const std::string& body,
@@ -348,6 +563,20 @@ const zmq::message_t& http_request_t::timeout(http_request_info_t& info) {
 }
 
 http_request_t http_request_t::from_string(const char* start, size_t length) {
+  // the server already parsed it so we just copy out the pieces
+  if (http_request_view_t::is_job(start, length)) {
+    auto view = http_request_view_t::from_string(start, length);
+    http_request_t request(view.method, std::string(view.path()), std::string(view.body), {}, {},
+                           std::string(view.version));
+    view.visit_query([&request](std::string_view key, std::string_view value) {
+      request.query[std::string(key)].emplace_back(value);
+    });
+    view.visit_headers([&request](std::string_view name, std::string_view value) {
+      request.headers.emplace(std::string(name), std::string(value));
+    });
+    return request;
+  }
+
   http_request_t request;
   auto requests = request.from_stream(start, length);
   if (requests.size() == 0)
@@ -358,6 +587,8 @@ http_request_t http_request_t::from_string(const char* start, size_t length) {
 query_t http_request_t::split_path_query(std::string& path) {
   // check for a query bit
   auto query_begin = path.find("?");
+  if (query_begin == std::string::npos)
+    return {};
   auto key_start = path.begin() + query_begin + 1, value_start = path.end();
   query_t query;
   auto kv = query.end();
@@ -396,23 +627,33 @@ query_t http_request_t::split_path_query(std::string& path) {
       query[std::string(key_start, path.end())].emplace_back();
   }
   // truncate the path
-  if (query_begin != std::string::npos)
-    path.resize(query_begin);
+  path.resize(query_begin);
   return query;
 }
 
-std::list<http_request_t>
-http_request_t::from_stream(const char* start, size_t length, size_t max_size) {
+std::list<http_request_t> http_request_t::from_stream(const char* start,
+                                                      size_t length,
+                                                      size_t max_size,
+                                                      size_t stream_size) {
   std::list<http_request_t> requests;
   cursor = start;
   end = start + length;
+  // where the request we are working on started in this piece of the stream
+  const char* raw_begin = start;
+  // we never stream what we dont parse
+  if (framing_only)
+    stream_size = std::numeric_limits<size_t>::max();
   while (start != end) {
-    // bail if we've seen too much
-    if (consumed + partial_buffer.size() + body_length > max_size)
+    // bail if we've seen too much, a streamed body is never all here so only what we hold counts
+    if ((streaming ? partial_buffer.size() : consumed + partial_buffer.size() + body_length) >
+        max_size)
       throw RESPONSE_413;
 
     // grab up to the next delimiter
     if (!consume_until()) {
+      // send on what we have of a streamed body but not the start of the delimiter after a chunk
+      if (streaming && (state == BODY || state == CHUNK) && partial_buffer.size() > partial_length)
+        stream_piece(requests, BODY_PIECE, partial_buffer.size() - partial_length);
       // should we have seen a method by now?
       if (state == METHOD && partial_buffer.size() >= METHOD_MAX_SIZE)
         throw RESPONSE_400;
@@ -437,7 +678,10 @@ http_request_t::from_stream(const char* start, size_t length, size_t max_size) {
       }
       case PATH: {
         log_line += partial_buffer + delimiter;
-        path = url_decode(partial_buffer);
+        if (!framing_only)
+          partial_buffer.resize(
+              url_decode(partial_buffer.data(), partial_buffer.size(), &partial_buffer[0]));
+        path.swap(partial_buffer);
         delimiter = "\r\n";
         state = VERSION;
         break;
@@ -448,7 +692,11 @@ http_request_t::from_stream(const char* start, size_t length, size_t max_size) {
           throw RESPONSE_505;
         log_line += partial_buffer;
         version.swap(partial_buffer);
-        query = split_path_query(path);
+        // when framing we leave the path as is and dont bother with the query
+        if (framing_only)
+          path.resize(std::min(path.find('?'), path.size()));
+        else
+          query = split_path_query(path);
         state = HEADERS;
         break;
       }
@@ -466,7 +714,14 @@ http_request_t::from_stream(const char* start, size_t length, size_t max_size) {
           if ((value_begin = partial_buffer.find_first_not_of(' ', field_end + 1)) ==
               std::string::npos)
             value_begin = partial_buffer.size();
-          headers.insert({partial_buffer.substr(0, field_end), partial_buffer.substr(value_begin)});
+          // when framing we only keep what we need to find the end, to know about keep-alive and
+          // to know how long the client will wait
+          if (!framing_only || is_field(partial_buffer, field_end, "Content-Length") ||
+              is_field(partial_buffer, field_end, "Transfer-Encoding") ||
+              is_field(partial_buffer, field_end, "Connection") ||
+              is_field(partial_buffer, field_end, "X-Timeout-Ms"))
+            headers.insert(
+                {partial_buffer.substr(0, field_end), partial_buffer.substr(value_begin)});
         } // the end or body
         else {
           // standard length specified
@@ -477,24 +732,34 @@ http_request_t::from_stream(const char* start, size_t length, size_t max_size) {
             } catch (...) { throw RESPONSE_400; }
             delimiter = "";
             state = BODY;
+            // its too big to hang on to so the request goes now and the body follows it
+            if (body_length > stream_size)
+              start_streaming(requests);
           } // streaming chunks
           else if (state != TRAILER && (value = headers.find("Transfer-Encoding")) != headers.end() &&
                    value->second == "chunked") {
             state = CHUNK_LENGTH;
+          } // the end of a streamed chunked body
+          else if (streaming) {
+            stream_piece(requests, BODY_END, 0);
+            flush_stream();
           } // simple GET or end of TRAILER
           else {
-            requests.emplace_back(method, path, body, query, headers, version);
-            requests.back().log_line.swap(log_line);
-            flush_stream();
+            finish(requests, raw_begin);
           }
         }
         break;
       }
       case BODY: {
-        body.swap(partial_buffer);
-        requests.emplace_back(method, path, body, query, headers, version);
-        requests.back().log_line.swap(log_line);
-        flush_stream();
+        // the last piece of a streamed body
+        if (streaming) {
+          stream_piece(requests, BODY_END, partial_buffer.size());
+          flush_stream();
+          break;
+        }
+        if (!framing_only)
+          body.swap(partial_buffer);
+        finish(requests, raw_begin);
         break;
       }
       case CHUNK_LENGTH: {
@@ -507,7 +772,13 @@ http_request_t::from_stream(const char* start, size_t length, size_t max_size) {
       }
       case CHUNK: {
         // drop the CRLF part of the chunk
-        body.append(partial_buffer);
+        if (streaming)
+          stream_piece(requests, BODY_PIECE, partial_buffer.size());
+        else if (!framing_only)
+          body.append(partial_buffer);
+        // we dont know how big it will be so it goes once its too big to hang on to
+        if (!streaming && body.size() > stream_size)
+          start_streaming(requests);
         state = CHUNK_LENGTH;
         break;
       }
@@ -517,12 +788,50 @@ http_request_t::from_stream(const char* start, size_t length, size_t max_size) {
     partial_buffer.clear();
   }
 
+  // hang on to the start of the next request
+  if (framing_only)
+    raw.append(raw_begin, end);
   return requests;
 }
+
+void http_request_t::finish(std::list<http_request_t>& requests, const char*& raw_begin) {
+  requests.emplace_back(method, path, body, query, headers, version);
+  auto& request = requests.back();
+  request.log_line.swap(log_line);
+  // a framed request just keeps the bytes it came in
+  if (framing_only) {
+    raw.append(raw_begin, cursor);
+    request.raw.swap(raw);
+    request.framing_only = true;
+    raw_begin = cursor;
+  }
+  flush_stream();
+}
+
+void http_request_t::start_streaming(std::list<http_request_t>& requests) {
+  // the request goes with what we have of the body so far and the rest of it comes in pieces
+  requests.emplace_back(method, path, body, query, headers, version);
+  auto& request = requests.back();
+  request.part = REQUEST_START;
+  request.log_line.swap(log_line);
+  body.clear();
+  streaming = true;
+}
+
+void http_request_t::stream_piece(std::list<http_request_t>& requests, part_t part, size_t length) {
+  requests.emplace_back();
+  auto& request = requests.back();
+  request.part = part;
+  request.body.assign(partial_buffer, 0, length);
+  partial_buffer.erase(0, length);
+}
+
 void http_request_t::flush_stream() {
   http_entity_t::flush_stream(METHOD);
   path.clear();
   query.clear();
+  raw.clear();
+  streaming = false;
 }
 
 size_t http_request_t::size() const {
@@ -570,6 +879,248 @@ void http_request_info_t::log(size_t response_size) const {
   logging::log(line);
 }
 
+http_request_view_t::http_request_view_t()
+    : method(method_t::GET), query_begin(std::string_view::npos), escaped(false), job(nullptr),
+      query_count(0), header_count(0) {
+}
+
+http_request_view_t http_request_view_t::from_string(const char* start, size_t length) {
+  http_request_view_t view;
+  view.parse(start, length);
+  return view;
+}
+
+bool http_request_view_t::is_job(const char* start, size_t length) {
+  return length >= sizeof(JOB_MAGIC) && std::memcmp(start, JOB_MAGIC, sizeof(JOB_MAGIC)) == 0;
+}
+
+void http_request_view_t::parse(const char* start, size_t length) {
+  // the server already did the parsing
+  if (is_job(start, length)) {
+    parse_job(start, length);
+    return;
+  }
+  job = nullptr;
+  query_count = header_count = 0;
+  std::string_view request(start, length);
+
+  // the method, these are all short enough to not need any allocation to look up
+  auto space = request.find(' ');
+  if (space == std::string_view::npos)
+    throw std::runtime_error("Incomplete http request");
+  auto method_itr = STRING_TO_METHOD.find(std::string(request.substr(0, space)));
+  if (method_itr == STRING_TO_METHOD.end())
+    throw RESPONSE_501;
+  method = method_itr->second;
+
+  // the target
+  auto target_begin = space + 1;
+  if ((space = request.find(' ', target_begin)) == std::string_view::npos)
+    throw std::runtime_error("Incomplete http request");
+  target = request.substr(target_begin, space - target_begin);
+
+  // the version
+  auto version_begin = space + 1;
+  auto line_end = request.find("\r\n", version_begin);
+  if (line_end == std::string_view::npos)
+    throw std::runtime_error("Incomplete http request");
+  version = request.substr(version_begin, line_end - version_begin);
+  if (SUPPORTED_VERSIONS.find(std::string(version)) == SUPPORTED_VERSIONS.end())
+    throw RESPONSE_505;
+
+  // the headers go until a blank line
+  auto headers_begin = line_end + 2;
+  size_t headers_end;
+  if (request.compare(headers_begin, 2, "\r\n") == 0)
+    headers_end = headers_begin;
+  else if ((headers_end = request.find("\r\n\r\n", headers_begin)) != std::string_view::npos)
+    headers_end += 2;
+  else
+    throw std::runtime_error("Incomplete http request");
+  header_lines = request.substr(headers_begin, headers_end - headers_begin);
+
+  // the body is as long as they said it was or there isnt one
+  auto rest = request.substr(headers_end + 2);
+  body = {};
+  if (auto content_length = header("Content-Length")) {
+    size_t body_length = 0;
+    auto parsed = std::from_chars(content_length->data(),
+                                  content_length->data() + content_length->size(), body_length);
+    if (parsed.ec != std::errc() || parsed.ptr == content_length->data())
+      throw RESPONSE_400;
+    if (rest.size() < body_length)
+      throw std::runtime_error("Incomplete http request");
+    body = rest.substr(0, body_length);
+  } else if (header("Transfer-Encoding") == "chunked")
+    throw std::runtime_error("Chunked requests cannot be viewed in place");
+
+  // only bother decoding the target if it has escapes in it
+  escaped = target.find('%') != std::string_view::npos;
+  if (escaped) {
+    decoded.resize(target.size());
+    decoded.resize(url_decode(target.data(), target.size(), &decoded[0]));
+  } else
+    decoded.clear();
+  query_begin = decoded_target().find('?');
+}
+
+std::string_view http_request_view_t::path() const {
+  return decoded_target().substr(0, query_begin);
+}
+
+std::string_view http_request_view_t::query_string() const {
+  if (query_begin == std::string_view::npos)
+    return {};
+  return decoded_target().substr(query_begin + 1);
+}
+
+std::optional<std::string_view> http_request_view_t::header(std::string_view name) const {
+  position_t position{header_lines, 0};
+  std::string_view field, value;
+  while (next_header(position, field, value)) {
+    if (field.size() == name.size() &&
+        std::equal(field.begin(), field.end(), name.begin(),
+                   [](char a, char b) { return ::tolower(a) == ::tolower(b); }))
+      return value;
+  }
+  return std::nullopt;
+}
+
+std::optional<std::string_view> http_request_view_t::query(std::string_view key) const {
+  position_t position{query_string(), 0};
+  std::string_view k, value;
+  while (next_query(position, k, value)) {
+    if (k == key)
+      return value;
+  }
+  return std::nullopt;
+}
+
+http_request_info_t http_request_view_t::to_info(uint32_t id) const {
+  auto connection_header = header("Connection");
+  auto timeout_header = header("X-Timeout-Ms");
+  auto arrived = epoch_ms();
+  return http_request_info_t{id,
+                             to_time_stamp(arrived),
+                             timeout_header ? to_deadline(arrived, *timeout_header) : 0,
+                             static_cast<uint16_t>(version == "HTTP/1.0" ? 0 : 1),
+                             static_cast<uint16_t>(connection_header == "Keep-Alive"),
+                             static_cast<uint16_t>(connection_header == "Close"),
+                             0,
+                             0};
+}
+
+bool http_request_view_t::next_header(position_t& position,
+                                      std::string_view& name,
+                                      std::string_view& value) const {
+  // a job has a table of them
+  if (job) {
+    if (position.index == header_count)
+      return false;
+    auto index = (query_count + position.index++) * 2;
+    name = span(index);
+    value = span(index + 1);
+    return true;
+  }
+
+  auto& lines = position.rest;
+  while (!lines.empty()) {
+    // every line ends in \r\n because we stopped before the blank one
+    auto line_end = lines.find("\r\n");
+    auto line = lines.substr(0, line_end);
+    lines = line_end == std::string_view::npos ? std::string_view{} : lines.substr(line_end + 2);
+    // skip anything that isnt a header, the same as http_request_t we only trim spaces
+    auto field_end = line.find(':');
+    if (field_end == std::string_view::npos)
+      continue;
+    name = line.substr(0, field_end);
+    auto value_begin = line.find_first_not_of(' ', field_end + 1);
+    value = value_begin == std::string_view::npos ? std::string_view{} : line.substr(value_begin);
+    return true;
+  }
+  return false;
+}
+
+bool http_request_view_t::next_query(position_t& position,
+                                     std::string_view& key,
+                                     std::string_view& value) const {
+  // a job has a table of them, which is good because decoded keys and values could have & or = in
+  // them and those wouldnt split up properly
+  if (job) {
+    if (position.index == query_count)
+      return false;
+    auto index = position.index++ * 2;
+    key = span(index);
+    value = span(index + 1);
+    return true;
+  }
+
+  // an empty parameter counts if it had an & after it but not if its the last one, this matches
+  // what http_request_t::split_path_query does
+  auto& parameters = position.rest;
+  if (parameters.empty())
+    return false;
+  auto parameter_end = parameters.find('&');
+  auto parameter = parameters.substr(0, parameter_end);
+  parameters = parameter_end == std::string_view::npos ? std::string_view{}
+                                                        : parameters.substr(parameter_end + 1);
+  // a key without an = has an empty value
+  auto equals = parameter.find('=');
+  key = parameter.substr(0, equals);
+  value = equals == std::string_view::npos ? std::string_view{} : parameter.substr(equals + 1);
+  return true;
+}
+
+void http_request_view_t::parse_job(const char* start, size_t length) {
+  // check that everything in it is where it should be
+  job_header_t header;
+  if (length < sizeof(header))
+    throw std::runtime_error("Incomplete http job");
+  std::memcpy(&header, start, sizeof(header));
+  auto spans = (static_cast<uint64_t>(header.query_count) + header.header_count) * 2;
+  auto in_bounds = [length](const job_span_t& span) {
+    return static_cast<uint64_t>(span.offset) + span.length <= length;
+  };
+  if (header.format != JOB_FORMAT || header.method > method_t::CONNECT || header.version > 1 ||
+      sizeof(header) + spans * sizeof(job_span_t) > length || !in_bounds(header.target) ||
+      !in_bounds(header.body) ||
+      (header.query_begin != std::numeric_limits<uint32_t>::max() &&
+       header.query_begin >= header.target.length))
+    throw std::runtime_error("Malformed http job");
+  job = start;
+  query_count = header.query_count;
+  header_count = header.header_count;
+  for (uint32_t i = 0; i < spans; ++i) {
+    job_span_t span;
+    std::memcpy(&span, start + sizeof(header) + i * sizeof(span), sizeof(span));
+    if (!in_bounds(span)) {
+      job = nullptr;
+      throw std::runtime_error("Malformed http job");
+    }
+  }
+
+  // its already decoded so its all just views
+  method = static_cast<method_t>(header.method);
+  version = JOB_VERSIONS[header.version];
+  target = std::string_view(start + header.target.offset, header.target.length);
+  body = std::string_view(start + header.body.offset, header.body.length);
+  header_lines = {};
+  escaped = false;
+  decoded.clear();
+  query_begin = header.query_begin == std::numeric_limits<uint32_t>::max() ? std::string_view::npos
+                                                                           : header.query_begin;
+}
+
+std::string_view http_request_view_t::span(uint32_t index) const {
+  job_span_t span;
+  std::memcpy(&span, job + sizeof(job_header_t) + index * sizeof(span), sizeof(span));
+  return std::string_view(job + span.offset, span.length);
+}
+
+std::string_view http_request_view_t::decoded_target() const {
+  return escaped ? std::string_view(decoded) : target;
+}
+
 http_response_t::~http_response_t() {
 }
 
@@ -725,12 +1276,27 @@ std::string http_response_t::generic(uint16_t code,
   }
   // TODO: content length is optional
   // with 1.0 the end can be signaled by socket close
-  // with 1.1 you can omit it when using chunked encoding
-  response += "Content-Length: ";
-  response += std::to_string(body.size());
-  response += "\r\n\r\n";
+  // with 1.1 you omit it when using chunked encoding, the body is then whatever chunks you have so far
+  auto encoding = headers.find("Transfer-Encoding");
+  if (encoding == headers.cend() || !caseless_predicates_t()(encoding->second, "chunked")) {
+    response += "Content-Length: ";
+    response += std::to_string(body.size());
+    response += "\r\n";
+  }
+  response += "\r\n";
   response += body;
   return response;
 }
 
+std::string http_response_t::chunk(const std::string& bytes) {
+  // the length in hex, the bytes and a return. the empty chunk marks the end
+  char length[sizeof(size_t) * 2 + 1];
+  auto end = std::to_chars(length, length + sizeof(length), bytes.size(), 16).ptr;
+  std::string chunk(length, end);
+  chunk += "\r\n";
+  chunk += bytes;
+  chunk += "\r\n";
+  return chunk;
+}
+
 } // namespace prime_server
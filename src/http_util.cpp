@@ -41,10 +41,25 @@ worker_t::result_t disk_result(const http_request_t& request,
                                const std::string& root,
                                bool allow_listing,
                                size_t size_limit) {
+  return disk_result(request.path, request_info, root, allow_listing, size_limit);
+}
+
+worker_t::result_t disk_result(const http_request_view_t& request,
+                               http_request_info_t& request_info,
+                               const std::string& root,
+                               bool allow_listing,
+                               size_t size_limit) {
+  return disk_result(std::string(request.path()), request_info, root, allow_listing, size_limit);
+}
+
+worker_t::result_t disk_result(std::string path,
+                               http_request_info_t& request_info,
+                               const std::string& root,
+                               bool allow_listing,
+                               size_t size_limit) {
   namespace fs = std::filesystem;
   worker_t::result_t result{false, {}, {}};
   // get the canonical path
-  auto path = request.path;
   for (size_t p = path.size(), i = path.find('.', 0); i != std::string::npos;
        p = i, i = path.find('.', i + 1))
     if (p + 1 == i)
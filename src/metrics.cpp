@@ -0,0 +1,181 @@
+#include "metrics.hpp"
+
+#include <algorithm>
+#include <cstdio>
+
+namespace {
+
+// where the highest set bit is, value must not be 0
+size_t highest_bit(uint64_t value) {
+  size_t bit = 0;
+  for (size_t shift = 32; shift > 0; shift >>= 1) {
+    if (value >> shift) {
+      value >>= shift;
+      bit += shift;
+    }
+  }
+  return bit;
+}
+
+// microseconds as seconds
+std::string seconds(uint64_t microseconds) {
+  char buffer[32];
+  std::snprintf(buffer, sizeof(buffer), "%.6f", microseconds / 1e6);
+  return buffer;
+}
+
+// the labels with another one added on
+std::string with(const std::string& labels, const std::string& extra) {
+  if (labels.empty())
+    return "{" + extra + "}";
+  return "{" + labels + "," + extra + "}";
+}
+
+std::string braced(const std::string& labels) {
+  return labels.empty() ? labels : "{" + labels + "}";
+}
+
+constexpr double QUANTILES[] = {.5, .9, .99, .999};
+
+} // namespace
+
+namespace prime_server {
+namespace metrics {
+
+void histogram_t::record(uint64_t value) {
+  counts[index_of(value)].fetch_add(1, std::memory_order_relaxed);
+  total.fetch_add(1, std::memory_order_relaxed);
+  summed.fetch_add(value, std::memory_order_relaxed);
+}
+
+uint64_t histogram_t::count() const {
+  return total.load(std::memory_order_relaxed);
+}
+
+uint64_t histogram_t::sum() const {
+  return summed.load(std::memory_order_relaxed);
+}
+
+uint64_t histogram_t::quantile(double fraction) const {
+  // how many values we have to get past, at least the first one
+  auto wanted = static_cast<uint64_t>(std::clamp(fraction, 0., 1.) * count() + .5);
+  wanted = std::max(wanted, uint64_t(1));
+  uint64_t seen = 0;
+  size_t last = 0;
+  for (size_t i = 0; i < BUCKETS; ++i) {
+    auto in_bucket = counts[i].load(std::memory_order_relaxed);
+    if (in_bucket == 0)
+      continue;
+    last = i;
+    seen += in_bucket;
+    if (seen >= wanted)
+      return highest_of(i);
+  }
+  // the counts can run a bit behind the total while others are recording
+  return seen == 0 ? 0 : highest_of(last);
+}
+
+size_t histogram_t::index_of(uint64_t value) {
+  // small ones get their own bucket
+  if (value < SUB_BUCKETS)
+    return static_cast<size_t>(value);
+  // otherwise its which power of two and which sixteenth of it
+  auto shift = highest_bit(value) - SUB_BUCKET_BITS;
+  auto sub_bucket = static_cast<size_t>(value >> shift) - SUB_BUCKETS;
+  return (shift + 1) * SUB_BUCKETS + sub_bucket;
+}
+
+uint64_t histogram_t::highest_of(size_t index) {
+  if (index < SUB_BUCKETS)
+    return index;
+  auto shift = index / SUB_BUCKETS - 1;
+  auto lowest = static_cast<uint64_t>(SUB_BUCKETS + index % SUB_BUCKETS) << shift;
+  return lowest + ((uint64_t(1) << shift) - 1);
+}
+
+registry_t& registry_t::get() {
+  static registry_t registry;
+  return registry;
+}
+
+template <class metric_t>
+metric_t& registry_t::make(std::map<std::string, family_t<metric_t>>& families,
+                           const std::string& name,
+                           const std::string& help,
+                           const std::string& labels) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto& family = families[name];
+  if (family.help.empty())
+    family.help = help;
+  auto& metric = family.labeled[labels];
+  if (!metric)
+    metric.reset(new metric_t());
+  return *metric;
+}
+
+counter_t&
+registry_t::counter(const std::string& name, const std::string& help, const std::string& labels) {
+  return make(counters, name, help, labels);
+}
+
+gauge_t&
+registry_t::gauge(const std::string& name, const std::string& help, const std::string& labels) {
+  return make(gauges, name, help, labels);
+}
+
+histogram_t&
+registry_t::histogram(const std::string& name, const std::string& help, const std::string& labels) {
+  return make(histograms, name, help, labels);
+}
+
+std::string registry_t::scrape() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  std::string scraped;
+  for (const auto& family : counters) {
+    scraped += "# HELP " + family.first + " " + family.second.help + "\n";
+    scraped += "# TYPE " + family.first + " counter\n";
+    for (const auto& metric : family.second.labeled)
+      scraped += family.first + braced(metric.first) + " " +
+                 std::to_string(metric.second->get()) + "\n";
+  }
+  for (const auto& family : gauges) {
+    scraped += "# HELP " + family.first + " " + family.second.help + "\n";
+    scraped += "# TYPE " + family.first + " gauge\n";
+    for (const auto& metric : family.second.labeled)
+      scraped += family.first + braced(metric.first) + " " +
+                 std::to_string(metric.second->get()) + "\n";
+  }
+  for (const auto& family : histograms) {
+    scraped += "# HELP " + family.first + " " + family.second.help + "\n";
+    scraped += "# TYPE " + family.first + " summary\n";
+    for (const auto& metric : family.second.labeled) {
+      for (auto quantile : QUANTILES) {
+        char fraction[16];
+        std::snprintf(fraction, sizeof(fraction), "%g", quantile);
+        scraped += family.first + with(metric.first, "quantile=\"" + std::string(fraction) + "\"") +
+                   " " + seconds(metric.second->quantile(quantile)) + "\n";
+      }
+      scraped += family.first + "_sum" + braced(metric.first) + " " +
+                 seconds(metric.second->sum()) + "\n";
+      scraped += family.first + "_count" + braced(metric.first) + " " +
+                 std::to_string(metric.second->count()) + "\n";
+    }
+  }
+  return scraped;
+}
+
+std::string label(const std::string& name, const std::string& value) {
+  std::string escaped = name + "=\"";
+  for (auto c : value) {
+    if (c == '\\' || c == '"')
+      escaped.push_back('\\');
+    if (c == '\n')
+      escaped += "\\n";
+    else
+      escaped.push_back(c);
+  }
+  return escaped + "\"";
+}
+
+} // namespace metrics
+} // namespace prime_server
@@ -3,7 +3,6 @@
 
 #include <cctype>
 #include <cstdlib>
-#include <ctime>
 
 using namespace prime_server;
 
@@ -24,14 +23,23 @@ namespace prime_server {
 netstring_entity_t::netstring_entity_t() : body(), body_length(0) {
 }
 
+netstring_entity_t::netstring_entity_t(bool) : netstring_entity_t() {
+}
+
 netstring_request_info_t netstring_entity_t::to_info(uint32_t id) const {
-  return netstring_request_info_t{id, static_cast<uint32_t>(difftime(time(nullptr), 0) + .5)};
+  // the whole second it arrived in on the clock deadlines are measured on
+  return netstring_request_info_t{id, static_cast<uint32_t>(epoch_ms() / 1000), 0};
 }
 
 std::string netstring_entity_t::to_string() const {
   return std::to_string(body.size()) + ':' + body + ',';
 }
 
+zmq::message_t netstring_entity_t::to_job() const {
+  auto job = to_string();
+  return zmq::message_t(job.size(), job.data());
+}
+
 std::string netstring_entity_t::to_string(const std::string& body) {
   return std::to_string(body.size()) + ':' + body + ',';
 }
@@ -52,7 +60,7 @@ const zmq::message_t& netstring_entity_t::timeout(netstring_request_info_t&) {
 }
 
 std::list<netstring_entity_t>
-netstring_entity_t::from_stream(const char* start, size_t length, size_t max_size) {
+netstring_entity_t::from_stream(const char* start, size_t length, size_t max_size, size_t) {
   std::list<netstring_entity_t> requests;
   size_t i = 0;
   size_t remaining = 0;
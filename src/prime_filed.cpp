@@ -20,8 +20,8 @@ disk_work(const std::list<zmq::message_t>& job, void* request_info, worker_t::in
   worker_t::result_t result{false, {}, {}};
   try {
     // check the disk
-    auto request =
-        http_request_t::from_string(static_cast<const char*>(job.front().data()), job.front().size());
+    auto request = http_request_view_t::from_string(static_cast<const char*>(job.front().data()),
+                                                    job.front().size());
     return http::disk_result(request, *static_cast<http_request_info_t*>(request_info), root);
   } catch (const std::exception& e) {
     http_response_t response(400, "Bad Request", e.what());
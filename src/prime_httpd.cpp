@@ -13,7 +13,7 @@ int main(int argc, char** argv) {
   if (argc < 5) {
     logging::ERROR(
         "Usage: " + std::string(argv[0]) +
-        " [tcp|ipc]://server_listen_endpoint[:tcp_port] [tcp|ipc]://downstream_proxy_endpoint[:tcp_port] [tcp|ipc]://server_result_loopback[:tcp_port] [tcp|ipc]://server_request_interrupt[:tcp_port] [enable_logging] [max_request_size_bytes] [request_timeout_seconds] [drain_seconds] [/health_check_endpoint]");
+        " [tcp|ipc]://server_listen_endpoint[:tcp_port] [tcp|ipc]://downstream_proxy_endpoint[:tcp_port] [tcp|ipc]://server_result_loopback[:tcp_port] [tcp|ipc]://server_request_interrupt[:tcp_port] [enable_logging] [max_request_size_bytes] [request_timeout_seconds] [drain_seconds] [/health_check_endpoint] [session_timeout_seconds] [header_timeout_seconds] [framing_only] [shards] [/metrics_endpoint] [max_reorder_size_bytes] [stream_body_size_bytes]");
     return EXIT_FAILURE;
   }
 
@@ -62,11 +62,53 @@ int main(int argc, char** argv) {
     health_check_response = http_response_t{200, "OK"}.to_string();
   }
 
+  // default to hanging up on idle clients after a while and on clients that take too long to send
+  uint32_t session_timeout_seconds = DEFAULT_SESSION_TIMEOUT;
+  uint32_t header_timeout_seconds = DEFAULT_HEADER_TIMEOUT;
+  try {
+    if (argc > 10)
+      session_timeout_seconds = std::stoul(argv[10]);
+    if (argc > 11)
+      header_timeout_seconds = std::stoul(argv[11]);
+  } catch (...) {}
+
+  // default to fully parsing requests, if the server thread is your bottleneck you can have it just
+  // find where requests begin and end and leave the rest of the parsing to your workers
+  if (argc > 12)
+    std::transform(argv[12], argv[12] + std::strlen(argv[12]), argv[12], ::tolower);
+  bool framing_only = argc > 12 && std::strcmp(argv[12], "true") == 0;
+
+  // default to a single server thread, with more the listening port is shared between them
+  size_t shards = 1;
+  try {
+    if (argc > 13)
+      shards = std::stoul(argv[13]);
+  } catch (...) {}
+
+  // default to no metrics, if a path is provided we answer it with a scrape of the metrics
+  http_server_t::health_check_matcher_t metrics_matcher{};
+  if (argc > 14)
+    metrics_matcher = [&argv](const http_request_t& r) -> bool { return r.path == argv[14]; };
+
+  // default to holding back up to 64mb of pipelined responses per session and to buffering whole
+  // request bodies, with a stream size bodies larger than that follow their request as they arrive
+  size_t max_reorder_size_bytes = DEFAULT_MAX_REORDER_SIZE;
+  size_t stream_body_size_bytes = DEFAULT_STREAM_BODY_SIZE;
+  try {
+    if (argc > 15)
+      max_reorder_size_bytes = std::stoul(argv[15]);
+    if (argc > 16)
+      stream_body_size_bytes = std::stoul(argv[16]);
+  } catch (...) {}
+
   // start it up
   zmq::context_t context;
-  http_server_t server(context, server_endpoint, proxy_endpoint, server_result_loopback,
-                       server_request_interrupt, log, max_request_size_bytes, request_timeout_seconds,
-                       health_check_matcher, health_check_response);
+  http_sharded_server_t server(context, server_endpoint, proxy_endpoint, server_result_loopback,
+                               server_request_interrupt, shards, log, max_request_size_bytes,
+                               request_timeout_seconds, health_check_matcher, health_check_response,
+                               session_timeout_seconds, header_timeout_seconds,
+                               DEFAULT_WAKEUP_BUDGET, framing_only, max_reorder_size_bytes,
+                               stream_body_size_bytes, metrics_matcher);
 
   server.serve();
   return EXIT_SUCCESS;
@@ -9,7 +9,8 @@ int main(int argc, char** argv) {
   if (argc < 3) {
     logging::ERROR(
         "Usage: " + std::string(argv[0]) +
-        " [tcp|ipc]://upstream_endpoint[:tcp_port] [tcp|ipc]://downstream_endpoint[:tcp_port] [drain_seconds]");
+        " [tcp|ipc]://upstream_endpoint[:tcp_port] [tcp|ipc]://downstream_endpoint[:tcp_port] [drain_seconds]"
+        " [[tcp|ipc]://interrupt_endpoint[:tcp_port]]");
     return EXIT_FAILURE;
   }
 
@@ -20,13 +21,18 @@ int main(int argc, char** argv) {
     logging::ERROR("bad upstream endpoint");
   if (downstream_endpoint.find("://") != 3)
     logging::ERROR("bad downstream endpoint");
+  std::string interrupt_endpoint(argc > 4 ? argv[4] : "");
+  if (!interrupt_endpoint.empty() && interrupt_endpoint.find("://") != 3)
+    logging::ERROR("bad interrupt endpoint");
 
   // setup the signal handler to gracefully shutdown when requested with sigterm
   quiesce(argc > 3 ? std::stoul(argv[3]) : 28);
 
   // start it up
   zmq::context_t context;
-  proxy_t proxy(context, upstream_endpoint, downstream_endpoint);
+  proxy_t proxy(context, upstream_endpoint, downstream_endpoint, {}, DEFAULT_BATCH_SIZE,
+                DEFAULT_BATCH_WAIT, DEFAULT_WORKER_EXPIRY, FIFO, {}, DEFAULT_AFFINITY_WAIT,
+                interrupt_endpoint);
 
   proxy.forward();
   return EXIT_SUCCESS;
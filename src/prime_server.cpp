@@ -1,13 +1,19 @@
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <chrono>
 #include <csignal>
+#include <cstring>
+#include <mutex>
 #include <stdexcept>
 #include <thread>
 #include <unordered_set>
 
 #ifdef _WIN32
 #include <windows.h>
-#include <chrono>
 #else
+#include <netdb.h>
+#include <sys/socket.h>
 #include <unistd.h>
 #endif
 
@@ -25,6 +31,80 @@ struct interrupt_t : public std::runtime_error {
   }
 };
 constexpr uint32_t INTERRUPT_AGE_CUTOFF = 600; // request age in seconds
+constexpr uint32_t INTERRUPT_BUCKET_WIDTH = 60; // seconds of request age per bucket of interrupts
+constexpr double SERVICE_TIME_WEIGHT = .2;     // how much the newest job counts towards service time
+constexpr uint64_t RING_REPLICAS = 64;         // places each worker gets on the hash ring
+
+// what a worker tells the proxy when it checks in, how many jobs it can hold at once and how many of
+// the ones it had it finished or dropped since the last time
+struct advertisement_t {
+  uint32_t credits;
+  uint32_t finished;
+  uint32_t dropped;
+};
+static_assert(std::is_trivially_copyable<advertisement_t>::value, "advertisements go out as bytes");
+
+// milliseconds on a clock that doesnt jump around when the wall clock gets adjusted
+uint64_t steady_ms() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// fnv-1a, its only used to spread things around the hash ring so it doesnt need to be any better
+uint64_t hash(const void* bytes, size_t size, uint64_t seed = 0) {
+  uint64_t hashed = 14695981039346656037ULL ^ seed;
+  for (size_t i = 0; i < size; ++i) {
+    hashed ^= static_cast<const unsigned char*>(bytes)[i];
+    hashed *= 1099511628211ULL;
+  }
+  return hashed;
+}
+
+// workers addresses are just bytes so we print them in hex
+std::string to_hex(const zmq::message_t& message) {
+  static const char hex[] = "0123456789ABCDEF";
+  std::string encoded;
+  for (size_t i = 0; i < message.size(); ++i) {
+    auto byte = static_cast<const unsigned char*>(message.data())[i];
+    encoded.push_back(hex[byte >> 4]);
+    encoded.push_back(hex[byte & 15]);
+  }
+  return encoded;
+}
+
+// when in milliseconds since the epoch the job has to be done by, 0 if it doesnt have to be. every
+// request info starts with the id, the time stamp and the deadline
+uint64_t deadline_of(const zmq::message_t& request_info) {
+  uint32_t stamps[3];
+  if (request_info.size() < sizeof(stamps))
+    return 0;
+  std::memcpy(stamps, request_info.data(), sizeof(stamps));
+  return stamps[2] == 0 ? 0 : static_cast<uint64_t>(stamps[1]) * 1000 + stamps[2];
+}
+
+// the id and time stamp every request info starts with, its what a job is known by everywhere. the
+// bytes neednt be aligned so we copy them out, an info too short to have them gets a key no job has
+uint64_t key_of(const zmq::message_t& request_info) {
+  uint64_t key = std::numeric_limits<uint64_t>::max();
+  if (request_info.size() >= sizeof(key))
+    std::memcpy(&key, request_info.data(), sizeof(key));
+  return key;
+}
+
+// same but finer for things that wait less than a millisecond
+uint64_t steady_us() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// when a timeout given in seconds should fire, infinite timeouts never fire
+uint64_t deadline(uint32_t seconds) {
+  if (seconds == std::numeric_limits<uint32_t>::max())
+    return std::numeric_limits<uint64_t>::max();
+  return steady_ms() + static_cast<uint64_t>(seconds) * 1000;
+}
 
 #ifndef _WIN32
 struct quiescable final {
@@ -93,10 +173,56 @@ struct quiescable final {
 };
 unsigned int quiescable::drain_seconds = 0;
 #endif
+
+// a scrape goes back framed in whatever protocol the server speaks
+zmq::message_t metrics_response(const prime_server::http_request_t&, const std::string& scraped) {
+  auto response = prime_server::http_response_t{200, "OK", scraped,
+                                                {{"Content-Type", "text/plain; version=0.0.4"}}}
+                      .to_string();
+  return zmq::message_t(response.size(), response.data());
+}
+zmq::message_t metrics_response(const prime_server::netstring_entity_t&,
+                                const std::string& scraped) {
+  auto response = prime_server::netstring_entity_t::to_string(scraped);
+  return zmq::message_t(response.size(), response.data());
+}
+
 } // namespace
 
 namespace prime_server {
 
+// interrupted jobs bucketed by when their requests came in, the time stamp being the top half of the
+// key. a bucket is reused for a newer stretch of time once its old enough that nobody cares about its
+// jobs anymore, so the old ones age out a bucket at a time without any bookkeeping per job
+class interrupt_buckets_t {
+public:
+  void insert(uint64_t key, uint32_t now) {
+    auto age = bucket_of(key);
+    // its so old that its request is long gone
+    if (age + buckets.size() <= now / INTERRUPT_BUCKET_WIDTH)
+      return;
+    auto& bucket = buckets[age % buckets.size()];
+    if (bucket.first != age) {
+      bucket.first = age;
+      bucket.second.clear();
+    }
+    bucket.second.insert(key);
+  }
+  bool contains(uint64_t key) const {
+    auto age = bucket_of(key);
+    const auto& bucket = buckets[age % buckets.size()];
+    return bucket.first == age && bucket.second.find(key) != bucket.second.cend();
+  }
+
+protected:
+  static uint32_t bucket_of(uint64_t key) {
+    return static_cast<uint32_t>(key >> 32) / INTERRUPT_BUCKET_WIDTH;
+  }
+  std::array<std::pair<uint32_t, std::unordered_set<uint64_t>>,
+             INTERRUPT_AGE_CUTOFF / INTERRUPT_BUCKET_WIDTH + 1>
+      buckets;
+};
+
 client_t::client_t(zmq::context_t& context,
                    const std::string& server_endpoint,
                    const request_function_t& request_function,
@@ -125,6 +251,7 @@ void client_t::batch() {
   server.getsockopt(ZMQ_IDENTITY, identity, &identity_size);
 
   bool more;
+  zmq::multipart_t messages;
   do {
     // request some
     size_t current_batch = 0;
@@ -150,9 +277,8 @@ void client_t::batch() {
     while (current_batch < batch_size) {
       try {
         // see if we are still waiting for stuff
-        auto messages = server.recv_all(0);
-        messages.pop_front();
-        current_batch += stream_responses(messages.front().data(), messages.front().size(), more);
+        server.recv_all(messages, 0);
+        current_batch += stream_responses(messages.back().data(), messages.back().size(), more);
       } catch (const std::exception& e) {
         logging::ERROR(std::string(__FILE__) + ":" + std::to_string(__LINE__) +
                        " client_t: " + e.what());
@@ -175,16 +301,56 @@ server_t<request_container_t, request_info_t>::server_t(
     size_t max_request_size,
     uint32_t request_timeout,
     const health_check_matcher_t& health_check_matcher,
-    const std::string& health_check_response)
+    const std::string& health_check_response,
+    uint32_t session_timeout,
+    uint32_t header_timeout,
+    size_t wakeup_budget,
+    bool framing_only,
+    const shard_t& shard,
+    size_t max_reorder_size,
+    size_t stream_body_size,
+    const health_check_matcher_t& metrics_matcher)
     : client(context, ZMQ_STREAM), proxy(context, ZMQ_DEALER), loopback(context, ZMQ_PULL),
-      interrupt(context, ZMQ_PUB), log(log), max_request_size(max_request_size),
-      request_timeout(request_timeout), request_id(0), health_check_matcher(health_check_matcher),
-      health_check_response(health_check_response.size(), health_check_response.data()) {
+      interrupt(context, ZMQ_XPUB), log(log), max_request_size(max_request_size),
+      request_timeout(request_timeout), request_id(shard.index), session_timeout(session_timeout),
+      header_timeout(header_timeout), wakeup_budget(std::max(wakeup_budget, size_t(1))),
+      framing_only(framing_only), shard(shard), max_reorder_size(max_reorder_size),
+      stream_body_size(stream_body_size), wakeups(0), handled(0), timers(steady_ms()),
+      health_check_matcher(health_check_matcher),
+      health_check_response(health_check_response.size(), health_check_response.data()),
+      metrics_matcher(metrics_matcher) {
+
+  // each shard of each server reports on its own
+  auto& registry = metrics::registry_t::get();
+  auto labels = metrics::label("server", client_endpoint) + "," +
+                metrics::label("shard", std::to_string(shard.index));
+  requests_total =
+      &registry.counter("prime_server_requests_total", "Requests taken in from clients", labels);
+  timeouts_total =
+      &registry.counter("prime_server_timeouts_total", "Requests that ran out of time", labels);
+  interrupts_total = &registry.counter(
+      "prime_server_interrupts_total",
+      "Interrupts published because the client went away or the request timed out", labels);
+  requests_in_flight = &registry.gauge("prime_server_requests_in_flight",
+                                       "Requests taken in that have yet to be answered", labels);
+  open_sessions = &registry.gauge("prime_server_sessions", "Open client connections", labels);
+  request_seconds = &registry.histogram("prime_server_request_seconds",
+                                        "Time from taking in a request to answering it", labels);
 
   int disabled = 0;
   client.setsockopt(ZMQ_SNDHWM, &disabled, sizeof(disabled));
   client.setsockopt(ZMQ_RCVHWM, &disabled, sizeof(disabled));
-  client.bind(client_endpoint.c_str());
+  // accept on a socket someone else already set up, this is how shards share a port
+  if (shard.listen_fd != -1) {
+#ifdef ZMQ_USE_FD
+    client.setsockopt(ZMQ_USE_FD, &shard.listen_fd, sizeof(shard.listen_fd));
+#else
+    throw std::runtime_error("Sharding needs a libzmq with ZMQ_USE_FD");
+#endif
+  }
+  // subclasses that accept clients themselves dont give us an endpoint
+  if (!client_endpoint.empty())
+    client.bind(client_endpoint.c_str());
 
   proxy.setsockopt(ZMQ_RCVHWM, &disabled, sizeof(disabled));
   proxy.setsockopt(ZMQ_SNDHWM, &disabled, sizeof(disabled));
@@ -206,57 +372,212 @@ server_t<request_container_t, request_info_t>::~server_t() {
 
 template <class request_container_t, class request_info_t>
 void server_t<request_container_t, request_info_t>::serve() {
+  // the reactor just tells us which sockets are ready, we drain them ourselves below
+  bool got_result = false, got_request = false;
+  zmq::reactor_t reactor;
+  reactor.add(loopback, [&got_result]() { got_result = true; });
+  reactor.add(client, [&got_request]() { got_request = true; });
+  reactor.add(interrupt, [this]() { handle_subscriptions(); });
+  zmq::multipart_t messages;
+
   while (!shutting_down()) {
-    // check for activity on the client socket and the result socket
-    zmq::pollitem_t items[] = {{loopback, 0, ZMQ_POLLIN, 0}, {client, 0, ZMQ_POLLIN, 0}};
-    zmq::poll(items, 2, POLL_TIMEOUT);
+    // check for activity on the client socket and the result socket but dont sleep past the next
+    // timer that needs to fire
+    auto next_timer = timers.next_expiry(steady_ms());
+    got_result = got_request = false;
+    reactor.poll(next_timer < 0 || next_timer > POLL_TIMEOUT ? POLL_TIMEOUT
+                                                             : static_cast<long>(next_timer));
 
-    // got a new result
-    if (items[0].revents & ZMQ_POLLIN) {
-      try {
-        // reply to client and cleanup request or session
-        auto messages = loopback.recv_all(ZMQ_DONTWAIT);
-        dequeue(*static_cast<const request_info_t*>(messages.front().data()), messages.back());
-      } catch (const std::exception& e) {
-        logging::ERROR(std::string(__FILE__) + ":" + std::to_string(__LINE__) +
-                       " server_t: " + e.what());
+    // rather than going back to poll after every message we drain whatever is ready up to a budget,
+    // taking turns between the sockets so a busy one cant starve the other. results go first since
+    // they free up resources
+    ++wakeups;
+    for (size_t i = 0; i < wakeup_budget && (got_result || got_request); ++i) {
+      // got a new result
+      if (got_result) {
+        try {
+          // reply to client and cleanup request or session
+          if ((got_result = loopback.recv_all(messages, ZMQ_DONTWAIT))) {
+            handle_result(messages);
+            ++handled;
+          }
+        } catch (const std::exception& e) {
+          logging::ERROR(std::string(__FILE__) + ":" + std::to_string(__LINE__) +
+                         " server_t: " + e.what());
+        }
       }
-    }
 
-    // got a new request
-    if (items[1].revents & ZMQ_POLLIN) {
-      try {
-        // parse the request and possible forward the work on
-        auto messages = client.recv_all(ZMQ_DONTWAIT);
-        handle_request(messages);
-      } catch (const std::exception& e) {
-        logging::ERROR(std::string(__FILE__) + ":" + std::to_string(__LINE__) +
-                       " server_t: " + e.what());
+      // got a new request
+      if (got_request) {
+        try {
+          // parse the request and possible forward the work on
+          if ((got_request = client.recv_all(messages, ZMQ_DONTWAIT))) {
+            handle_request(messages);
+            ++handled;
+          }
+        } catch (const std::exception& e) {
+          logging::ERROR(std::string(__FILE__) + ":" + std::to_string(__LINE__) +
+                         " server_t: " + e.what());
+        }
       }
     }
 
     // check the age of a few things
     handle_timeouts();
   }
+
+  logging::INFO("Server handled " + std::to_string(handled) + " messages in " +
+                std::to_string(wakeups) + " wakeups");
 }
 
 template <class request_container_t, class request_info_t>
 void server_t<request_container_t, request_info_t>::handle_timeouts() {
-  // kill timed out requests
-  auto drop_dead = static_cast<int64_t>(difftime(time(nullptr), 0) + .5) - request_timeout;
-  while (drop_dead > 0 && request_history.size() && request_history.front().time_stamp < drop_dead) {
-    interrupt.send(static_cast<void*>(&request_history.front()),
-                   sizeof(typename decltype(requests)::key_type), ZMQ_DONTWAIT);
-    dequeue(request_history.front(), request_container_t::timeout(request_history.front()));
-    request_history.pop_front();
+  // fire whatever timers are due
+  timers.advance(steady_ms(), [this](uint64_t key, uint8_t kind) { handle_timer(key, kind); });
+  // and keep the levels up to date for the next scrape
+  requests_in_flight->set(static_cast<int64_t>(requests.size()));
+  open_sessions->set(static_cast<int64_t>(sessions.size()));
+}
+
+template <class request_container_t, class request_info_t>
+void server_t<request_container_t, request_info_t>::handle_subscriptions() {
+  // a worker subscribes to a job when it gets it, which can be after we published its interrupt. so
+  // once a subscription shows up, which means its in place, we publish again for the requests of ours
+  // that are gone. a duplicate is harmless to a worker that did hear the first one
+  zmq::multipart_t messages;
+  while (interrupt.recv_all(messages, ZMQ_DONTWAIT)) {
+    for (const auto& message : messages) {
+      // a one means subscribe and the rest is the topic, everything else we dont care about
+      uint64_t key;
+      const auto* subscription = static_cast<const char*>(message.data());
+      if (message.size() != 1 + sizeof(key) || subscription[0] != 1)
+        continue;
+      std::memcpy(&key, subscription + 1, sizeof(key));
+      // with shards everyone sees every subscription but only the shard that handed out the id knows
+      if ((key & 0xFFFFFFFF) % shard.count != shard.index || requests.find(key) != requests.cend())
+        continue;
+      interrupt.send(static_cast<void*>(&key), sizeof(key), ZMQ_DONTWAIT);
+    }
+  }
+}
+
+template <class request_container_t, class request_info_t>
+void server_t<request_container_t, request_info_t>::handle_timer(uint64_t key, uint8_t kind) {
+  // the request took too long so we interrupt it and let the client know
+  if (kind == REQUEST_TIMEOUT) {
+    auto request = requests.find(key);
+    if (request == requests.end())
+      return;
+    request->second.timer = timer_wheel_t::INVALID_HANDLE;
+    interrupt.send(static_cast<void*>(&key), sizeof(key), ZMQ_DONTWAIT);
+    timeouts_total->increment();
+    interrupts_total->increment();
+    // if the client already has part of the response we cant send them a timeout, we hang up instead
+    if (request->second.started) {
+      auto session = sessions.find(request->second.requester);
+      if (session == sessions.end())
+        requests.erase(request);
+      else if (disconnect(session->first))
+        close_session(session);
+      else
+        logging::ERROR("Server failed to disconnect client whose streamed response timed out");
+      return;
+    }
+    auto info = request->second.info;
+    dequeue(info, request_container_t::timeout(info));
+    return;
   }
 
-  // TODO: kill stale sessions
+  // the session was idle or too slow sending its request so we hang up, the key is the address of
+  // the session in the map which is stable until we erase it, and erasing it cancels this timer
+  auto* expired = reinterpret_cast<typename sessions_t::value_type*>(static_cast<uintptr_t>(key));
+  auto session = sessions.find(expired->first);
+  session->second.timer = timer_wheel_t::INVALID_HANDLE;
+  if (!disconnect(session->first))
+    logging::ERROR("Server failed to disconnect expired session");
+  close_session(session);
 }
 
 template <class request_container_t, class request_info_t>
-void server_t<request_container_t, request_info_t>::handle_request(
-    std::list<zmq::message_t>& messages) {
+void server_t<request_container_t, request_info_t>::schedule_session(
+    typename sessions_t::iterator session) {
+  auto& state = session->second;
+  auto key = static_cast<uint64_t>(reinterpret_cast<uintptr_t>(&*session));
+  // the client is in the middle of sending a request so they get a fixed amount of time to finish
+  // it. we dont move the deadline when more bytes show up so they cant trickle them in forever
+  if (state.request.size() && !state.request.streaming) {
+    if (state.timer_kind != HEADER_TIMEOUT || state.timer == timer_wheel_t::INVALID_HANDLE) {
+      timers.cancel(state.timer);
+      state.timer_kind = HEADER_TIMEOUT;
+      if (header_timeout != std::numeric_limits<uint32_t>::max())
+        state.timer = timers.schedule(deadline(header_timeout), key, HEADER_TIMEOUT);
+    }
+  } // the client is waiting on responses or streaming a body, those requests have their own timeouts
+  // and a streamed one gets a fresh one with each piece so a long upload isnt cut off part way
+  else if (state.request.streaming || state.request.enqueued.size()) {
+    timers.cancel(state.timer);
+  } // the client is idle so it gets some time to send something else before we hang up
+  else {
+    timers.cancel(state.timer);
+    state.timer_kind = SESSION_TIMEOUT;
+    if (session_timeout != std::numeric_limits<uint32_t>::max())
+      state.timer = timers.schedule(deadline(session_timeout), key, SESSION_TIMEOUT);
+  }
+}
+
+template <class request_container_t, class request_info_t>
+bool server_t<request_container_t, request_info_t>::reply(const zmq::message_t& requester,
+                                                          const zmq::message_t& message) {
+  // if sending the identity frame fails we cannot send the message or it will hang the entire socket
+  // and we share the bytes rather than copying them since results can be quite large
+  return client.send(requester, ZMQ_SNDMORE | ZMQ_DONTWAIT) &&
+         client.send_shared(message, ZMQ_DONTWAIT);
+}
+
+template <class request_container_t, class request_info_t>
+bool server_t<request_container_t, request_info_t>::disconnect(const zmq::message_t& requester) {
+  // if sending the identity frame fails we cannot send the disconnect or it will hang the entire
+  // socket
+  return client.send(requester, ZMQ_SNDMORE | ZMQ_DONTWAIT) &&
+         client.send(static_cast<const void*>(""), 0, ZMQ_DONTWAIT);
+}
+
+template <class request_container_t, class request_info_t>
+void server_t<request_container_t, request_info_t>::close_session(
+    typename sessions_t::iterator session) {
+  // the worker with a job whose body was still coming in needs to know it isnt getting the rest
+  if (session->second.request.streaming &&
+      !forward_body(session->second.request.streamed, "", true))
+    logging::ERROR("Server failed to end a streamed body");
+  // interrupt all of the outstanding requests
+  for (auto id_time_stamp : session->second.request.enqueued) {
+    interrupt.send(static_cast<void*>(&id_time_stamp), sizeof(id_time_stamp), ZMQ_DONTWAIT);
+    interrupts_total->increment();
+    auto request = requests.find(id_time_stamp);
+    if (request != requests.end()) {
+      timers.cancel(request->second.timer);
+      requests.erase(request);
+    }
+  }
+  // and forget about the client
+  timers.cancel(session->second.timer);
+  sessions.erase(session);
+}
+
+template <class request_container_t, class request_info_t>
+uint32_t server_t<request_container_t, request_info_t>::next_request_id() {
+  // when they wrap around we start over at our first one so ids still tell you which shard they
+  // came from
+  auto id = request_id;
+  if (request_id > std::numeric_limits<uint32_t>::max() - shard.count)
+    request_id = shard.index;
+  else
+    request_id += shard.count;
+  return id;
+}
+
+template <class request_container_t, class request_info_t>
+void server_t<request_container_t, request_info_t>::handle_request(zmq::multipart_t& messages) {
   // must be an identity frame and a message frame if a request larger than
   // zmq::in_batch_size (8192) is sent over a stream socket it will be broken
   // up into multiple messages, however each piece will come with an identity
@@ -280,34 +601,32 @@ void server_t<request_container_t, request_info_t>::handle_request(
   auto session = sessions.find(requester);
 
   // open or close connection
-  const auto& body = *std::next(messages.begin());
+  const auto& body = messages.back();
   if (body.size() == 0) {
     // connecting makes space for a streaming request
     if (session == sessions.end()) {
-      sessions.emplace(std::move(requester), request_container_t{});
+      session = sessions.emplace(std::move(requester),
+                                 session_t{request_container_t(framing_only),
+                                           timer_wheel_t::INVALID_HANDLE, SESSION_TIMEOUT, 0})
+                    .first;
+      schedule_session(session);
     } // disconnecting interrupts all of the outstanding requests
     else {
-      for (auto id_time_stamp : session->second.enqueued) {
-        interrupt.send(static_cast<void*>(&id_time_stamp), sizeof(id_time_stamp), ZMQ_DONTWAIT);
-        requests.erase(id_time_stamp);
-      }
-      sessions.erase(session);
+      close_session(session);
     }
   } // actual request data
   else {
     if (session != sessions.end()) {
       // attempt to proxy any whole bits onward and if it failed (malformed or large request) close
       // the session
-      if (!enqueue(session->first, body, session->second)) {
-        // if sending the identity frame (session->first) fails we cannot send the disconnect or it
-        // will hang the entire socket
-        if (client.send(session->first, ZMQ_SNDMORE | ZMQ_DONTWAIT) &&
-            client.send(static_cast<const void*>(""), 0, ZMQ_DONTWAIT)) {
-          for (auto id_time_stamp : session->second.enqueued)
-            interrupt.send(static_cast<void*>(&id_time_stamp), sizeof(id_time_stamp), ZMQ_DONTWAIT);
-          sessions.erase(session);
-        } else
+      if (!enqueue(session->first, body, session->second.request)) {
+        if (disconnect(session->first))
+          close_session(session);
+        else
           logging::ERROR("Server failed to disconnect client after rejecting request");
+      } // a response may have already closed the session so we look it up again
+      else if ((session = sessions.find(requester)) != sessions.end()) {
+        schedule_session(session);
       }
     } else
       logging::WARN("Ignoring request: unknown client");
@@ -322,47 +641,105 @@ bool server_t<request_container_t, request_info_t>::enqueue(const zmq::message_t
   std::list<request_container_t> parsed_requests;
   try {
     parsed_requests = request.from_stream(static_cast<const char*>(message.data()), message.size(),
-                                          max_request_size);
+                                          max_request_size, stream_body_size);
   } // something went wrong, either in parsing or size limitation
   catch (const typename request_container_t::request_exception_t& e) {
-    // if sending the identify frame fails (requester) we cannot send the error response or it will
-    // hang the entire socket
-    if (!client.send(requester, ZMQ_SNDMORE | ZMQ_DONTWAIT) || !client.send(e.response, ZMQ_DONTWAIT))
+    if (!reply(requester, zmq::message_t(e.response.size(), e.response.data())))
       logging::ERROR("Server failed to send rejection response");
     else if (log) {
       request.log(request_id);
       e.log(request_id);
     }
-    ++request_id;
+    next_request_id();
     return false;
   }
 
   // send on each request
   for (const auto& parsed_request : parsed_requests) {
+    // the rest of a streamed body goes after the start of its request
+    if (parsed_request.part == BODY_PIECE || parsed_request.part == BODY_END) {
+      if (!forward_body(request.streamed, parsed_request.body, parsed_request.part == BODY_END)) {
+        logging::ERROR("Server failed to enqueue a piece of a streamed body");
+        return false;
+      }
+      continue;
+    }
+
     // figure out if we are expecting to close this request or not
-    auto info = parsed_request.to_info(request_id++);
+    auto info = parsed_request.to_info(next_request_id());
 
-    // if its enabled, see if its a health check
-    bool health_check = health_check_matcher && health_check_matcher(parsed_request);
+    // if its enabled, see if its a health check, those dont get to stream their bodies
+    bool streaming = parsed_request.part == REQUEST_START;
 
-    // send on the request if its not a health check
-    if (!health_check &&
+    // how long we give it, the client could ask for less and the job carries it along
+    auto timeout = request_timeout == std::numeric_limits<uint32_t>::max()
+                       ? std::numeric_limits<uint64_t>::max()
+                       : request_timeout * uint64_t(1000);
+    if (streaming) {
+      info.deadline = 0;
+    } else {
+      auto now = epoch_ms(), stamped = info.time_stamp * uint64_t(1000);
+      auto since = now > stamped ? now - stamped : 0;
+      if (info.deadline != 0)
+        timeout = std::min(timeout, info.deadline > since ? info.deadline - since : 0);
+      info.deadline = timeout == std::numeric_limits<uint64_t>::max() ||
+                              since + timeout > std::numeric_limits<uint32_t>::max()
+                          ? 0
+                          : static_cast<uint32_t>(since + timeout);
+    }
+    bool health_check = !streaming && health_check_matcher && health_check_matcher(parsed_request);
+    bool scrape = !streaming && !health_check && metrics_matcher && metrics_matcher(parsed_request);
+    requests_total->increment();
+
+    // send on the request if its not answered here, an empty part on the end says more is coming
+    if (!health_check && !scrape &&
         (!proxy.send(static_cast<const void*>(&info), sizeof(info), ZMQ_DONTWAIT | ZMQ_SNDMORE) ||
-         !proxy.send(parsed_request.to_string(), ZMQ_DONTWAIT))) {
+         !proxy.send(parsed_request.to_job(), ZMQ_DONTWAIT | (streaming ? ZMQ_SNDMORE : 0)) ||
+         (streaming && !proxy.send(static_cast<const void*>(""), 0, ZMQ_DONTWAIT)))) {
       logging::ERROR("Server failed to enqueue request");
       return false;
     }
     if (log)
       parsed_request.log(info.id);
 
-    // remember we are working on it
-    request.enqueued.emplace_back(static_cast<typename decltype(requests)::key_type>(info));
-    requests.emplace(request.enqueued.back(), requester);
-    request_history.emplace_back(std::move(info));
+    // remember we are working on it and when to give up on it
+    auto key = static_cast<typename decltype(requests)::key_type>(info);
+    request.enqueued.emplace_back(key);
+    if (streaming)
+      request.streamed = key;
+    auto timer = timeout == std::numeric_limits<uint64_t>::max()
+                     ? timer_wheel_t::INVALID_HANDLE
+                     : timers.schedule(steady_ms() + timeout, key, REQUEST_TIMEOUT);
+    requests.emplace(key, pending_t{requester.copy(), info, timer, {}, false, false, steady_us()});
 
-    // if it was a health check we reply immediately
+    // if it was a health check or a scrape we reply immediately
     if (health_check)
-      dequeue(request_history.back(), health_check_response);
+      dequeue(info, health_check_response);
+    else if (scrape)
+      dequeue(info, metrics_response(parsed_request, metrics::registry_t::get().scrape()));
+  }
+  return true;
+}
+
+template <class request_container_t, class request_info_t>
+bool server_t<request_container_t, request_info_t>::forward_body(uint64_t key,
+                                                                 const std::string& piece,
+                                                                 bool last) {
+  // the request may already be answered but the worker still has to see the end of the body, so we
+  // send the pieces along regardless and they only need the id and time stamp to find their job
+  request_info_t info{};
+  info.id = static_cast<uint32_t>(key);
+  info.time_stamp = static_cast<uint32_t>(key >> 32);
+  if (!proxy.send(static_cast<const void*>(&info), sizeof(info), ZMQ_DONTWAIT | ZMQ_SNDMORE) ||
+      !proxy.send(piece, ZMQ_DONTWAIT | (last ? 0 : ZMQ_SNDMORE)) ||
+      (!last && !proxy.send(static_cast<const void*>(""), 0, ZMQ_DONTWAIT)))
+    return false;
+
+  // the client is making progress so the request gets a fresh timeout
+  auto request = requests.find(key);
+  if (request != requests.end() && request->second.timer != timer_wheel_t::INVALID_HANDLE) {
+    timers.cancel(request->second.timer);
+    request->second.timer = timers.schedule(deadline(request_timeout), key, REQUEST_TIMEOUT);
   }
   return true;
 }
@@ -374,33 +751,273 @@ bool server_t<request_container_t, request_info_t>::dequeue(const request_info_t
   auto request = requests.find(static_cast<typename decltype(requests)::key_type>(info));
   if (request == requests.cend())
     return false;
-  // reply to the client with the response or an error however, if sending the identity frame failed
-  // we cannot send the response/error because it will hang the entire socket
-  if (!client.send(request->second, ZMQ_SNDMORE | ZMQ_DONTWAIT) ||
-      !client.send(response, ZMQ_DONTWAIT))
+  // its done so it cant time out anymore
+  timers.cancel(request->second.timer);
+  request->second.timer = timer_wheel_t::INVALID_HANDLE;
+
+  // pipelined responses have to go back in the order their requests came in so if an earlier one
+  // isnt done yet we hold on to this one
+  auto session = sessions.find(request->second.requester);
+  if (session != sessions.end() && !session->second.request.enqueued.empty() &&
+      session->second.request.enqueued.front() != request->first) {
+    request->second.info = info;
+    request->second.done = true;
+    hold(request, response, session);
+    return true;
+  }
+
+  // send this one and then any of the ones after it that were waiting on it
+  if (!respond(request, info, response, session))
+    return true;
+  while (session != sessions.end() && !session->second.request.enqueued.empty()) {
+    auto next = requests.find(session->second.request.enqueued.front());
+    if (next == requests.end())
+      break;
+    // whatever it streamed so far can go now and the rest of it will go as it shows up
+    auto& pending = next->second;
+    while (pending.held.size() > (pending.done ? 1 : 0)) {
+      session->second.reordered -= pending.held.front().size();
+      if (!reply(pending.requester, pending.held.front()))
+        logging::ERROR("Server failed to send a piece of a response");
+      pending.held.pop_front();
+      pending.started = true;
+    }
+    if (!pending.done)
+      break;
+    session->second.reordered -= pending.held.front().size();
+    auto last = std::move(pending.held.front());
+    if (!respond(next, pending.info, last, session))
+      break;
+  }
+  return true;
+}
+
+template <class request_container_t, class request_info_t>
+void server_t<request_container_t, request_info_t>::handle_result(zmq::multipart_t& messages) {
+  const auto& info = *static_cast<const request_info_t*>(messages.front().data());
+  if (messages.size() > 2)
+    stream(info, messages[1]);
+  else
+    dequeue(info, messages.back());
+}
+
+template <class request_container_t, class request_info_t>
+bool server_t<request_container_t, request_info_t>::stream(const request_info_t& info,
+                                                           const zmq::message_t& piece) {
+  // find the request
+  auto request = requests.find(static_cast<typename decltype(requests)::key_type>(info));
+  if (request == requests.cend())
+    return false;
+  // its making progress so it gets a fresh timeout for the next piece
+  if (request->second.timer != timer_wheel_t::INVALID_HANDLE) {
+    timers.cancel(request->second.timer);
+    request->second.timer =
+        timers.schedule(deadline(request_timeout), request->first, REQUEST_TIMEOUT);
+  }
+
+  // it has to wait its turn if an earlier pipelined request isnt done yet
+  auto session = sessions.find(request->second.requester);
+  if (session != sessions.end() && !session->second.request.enqueued.empty() &&
+      session->second.request.enqueued.front() != request->first) {
+    hold(request, piece, session);
+    return true;
+  }
+
+  // otherwise it goes straight out
+  if (!reply(request->second.requester, piece))
+    logging::ERROR("Server failed to send a piece of a response");
+  request->second.started = true;
+  return true;
+}
+
+template <class request_container_t, class request_info_t>
+void server_t<request_container_t, request_info_t>::hold(typename requests_t::iterator request,
+                                                         const zmq::message_t& response,
+                                                         typename sessions_t::iterator session) {
+  // the earlier one still has its own timeout so it cant hold us up forever, but if the client has
+  // too much waiting on it we give up on the client
+  session->second.reordered += response.size();
+  if (session->second.reordered > max_reorder_size) {
+    logging::WARN("Server disconnecting client with too many pipelined responses held back");
+    if (disconnect(session->first))
+      close_session(session);
+    else
+      logging::ERROR("Server failed to disconnect client with too many held back responses");
+    return;
+  }
+  request->second.held.emplace_back(response.copy());
+}
+
+template <class request_container_t, class request_info_t>
+bool server_t<request_container_t, request_info_t>::respond(typename requests_t::iterator request,
+                                                            const request_info_t& info,
+                                                            const zmq::message_t& response,
+                                                            typename sessions_t::iterator session) {
+  // reply to the client with the response or an error
+  const auto& requester = request->second.requester;
+  if (!reply(requester, response))
     logging::ERROR("Server failed to dequeue request");
   else if (log)
     info.log(response.size());
+  request_seconds->record(steady_us() - request->second.since);
   // cleanup and if its not keep alive close the session
-  // if sending the identity frame fails, we cannot send the disconnect message or it will hang the
-  // entire socket
-  if (!info.keep_alive() && client.send(request->second, ZMQ_DONTWAIT | ZMQ_SNDMORE) &&
-      client.send(static_cast<const void*>(""), 0, ZMQ_DONTWAIT)) {
-    auto session = sessions.find(request->second);
-    for (auto id_time_stamp : session->second.enqueued)
-      interrupt.send(static_cast<void*>(&id_time_stamp), sizeof(id_time_stamp), ZMQ_DONTWAIT);
-    sessions.erase(session);
+  bool open = true;
+  if (session != sessions.end()) {
+    session->second.request.enqueued.remove(request->first);
+    if (!info.keep_alive() && disconnect(requester)) {
+      close_session(session);
+      open = false;
+    } else
+      schedule_session(session);
   }
   requests.erase(request);
-  return true;
+  return open;
+}
+
+template <class request_container_t, class request_info_t>
+sharded_server_t<request_container_t, request_info_t>::sharded_server_t(
+    zmq::context_t& context,
+    const std::string& client_endpoint,
+    const std::string& proxy_endpoint,
+    const std::string& result_endpoint,
+    const std::string& interrupt_endpoint,
+    size_t shards,
+    bool log,
+    size_t max_request_size,
+    uint32_t request_timeout,
+    const health_check_matcher_t& health_check_matcher,
+    const std::string& health_check_response,
+    uint32_t session_timeout,
+    uint32_t header_timeout,
+    size_t wakeup_budget,
+    bool framing_only,
+    size_t max_reorder_size,
+    size_t stream_body_size,
+    const health_check_matcher_t& metrics_matcher)
+    : results(context, ZMQ_PULL), shard_interrupts(context, ZMQ_XSUB),
+      interrupts(context, ZMQ_XPUB) {
+  // with just one there is nothing to route
+  if (shards < 2) {
+    servers.emplace_back(context, client_endpoint, proxy_endpoint, result_endpoint,
+                         interrupt_endpoint, log, max_request_size, request_timeout,
+                         health_check_matcher, health_check_response, session_timeout,
+                         header_timeout, wakeup_budget, framing_only, shard_t{0, 1, -1},
+                         max_reorder_size, stream_body_size, metrics_matcher);
+    return;
+  }
+  if (client_endpoint.find("tcp://") != 0)
+    throw std::runtime_error("Sharding needs a tcp client endpoint");
+
+  // each shard gets its own listening socket on the same port and its own private result and
+  // interrupt endpoints
+  static std::atomic<size_t> instances{0};
+  auto prefix = "inproc://sharded_server_" + std::to_string(instances++) + "_";
+  int disabled = 0;
+  servers.reserve(shards);
+  for (size_t i = 0; i < shards; ++i) {
+    auto shard = std::to_string(i);
+    servers.emplace_back(context, client_endpoint, proxy_endpoint, prefix + "results_" + shard,
+                         prefix + "interrupts_" + shard, log, max_request_size, request_timeout,
+                         health_check_matcher, health_check_response, session_timeout,
+                         header_timeout, wakeup_budget, framing_only,
+                         shard_t{static_cast<uint32_t>(i), static_cast<uint32_t>(shards),
+                                 reuseport_listener(client_endpoint)},
+                         max_reorder_size, stream_body_size, metrics_matcher);
+    shard_results.emplace_back(context, ZMQ_PUSH);
+    shard_results.back().setsockopt(ZMQ_SNDHWM, &disabled, sizeof(disabled));
+    shard_results.back().connect((prefix + "results_" + shard).c_str());
+    shard_interrupts.connect((prefix + "interrupts_" + shard).c_str());
+  }
+
+  // where the workers send results and listen for interrupts
+  results.setsockopt(ZMQ_RCVHWM, &disabled, sizeof(disabled));
+  results.bind(result_endpoint.c_str());
+  shard_interrupts.setsockopt(ZMQ_RCVHWM, &disabled, sizeof(disabled));
+  interrupts.setsockopt(ZMQ_SNDHWM, &disabled, sizeof(disabled));
+  interrupts.bind(interrupt_endpoint.c_str());
+}
+
+template <class request_container_t, class request_info_t>
+sharded_server_t<request_container_t, request_info_t>::~sharded_server_t() {
+}
+
+template <class request_container_t, class request_info_t>
+void sharded_server_t<request_container_t, request_info_t>::serve() {
+  if (servers.size() == 1) {
+    servers.front().serve();
+    return;
+  }
+
+  // every shard gets its own thread
+  std::vector<std::thread> threads;
+  for (auto& server : servers)
+    threads.emplace_back(&server_type::serve, &server);
+
+  // results go back to the shard that handed out the request id, the id is the first thing in the
+  // request info
+  zmq::multipart_t messages;
+  zmq::reactor_t reactor;
+  reactor.add(results, [this, &messages]() {
+    while (results.recv_all(messages, ZMQ_DONTWAIT)) {
+      if (messages.size() < 2 || messages.front().size() < sizeof(uint32_t)) {
+        logging::WARN("Ignoring result: missing request info");
+        continue;
+      }
+      uint32_t id;
+      std::memcpy(&id, messages.front().data(), sizeof(id));
+      shard_results[id % shard_results.size()].send_all(std::move(messages), ZMQ_DONTWAIT);
+    }
+  });
+  // interrupts go out to the workers and their subscriptions go back to the shards
+  reactor.add(shard_interrupts, [this, &messages]() {
+    while (shard_interrupts.recv_all(messages, ZMQ_DONTWAIT))
+      interrupts.send_all(std::move(messages), ZMQ_DONTWAIT);
+  });
+  reactor.add(interrupts, [this, &messages]() {
+    while (interrupts.recv_all(messages, ZMQ_DONTWAIT))
+      shard_interrupts.send_all(std::move(messages), ZMQ_DONTWAIT);
+  });
+  while (!shutting_down())
+    reactor.poll(POLL_TIMEOUT);
+
+  for (auto& thread : threads)
+    thread.join();
 }
 
 proxy_t::proxy_t(zmq::context_t& context,
                  const std::string& upstream_endpoint,
                  const std::string& downstream_endpoint,
-                 const choose_function_t& choose_function)
-    : upstream(context, ZMQ_ROUTER), downstream(context, ZMQ_ROUTER),
-      choose_function(choose_function) {
+                 const choose_function_t& choose_function,
+                 size_t batch_size,
+                 uint32_t batch_wait,
+                 uint32_t worker_expiry,
+                 schedule_t schedule,
+                 const key_function_t& key_function,
+                 uint32_t affinity_wait,
+                 const std::string& interrupt_endpoint)
+    : upstream(context, ZMQ_ROUTER), downstream(context, ZMQ_ROUTER), interrupt(context, ZMQ_SUB),
+      choose_function(choose_function), batch_size(std::max(batch_size, size_t(1))),
+      batch_wait(batch_wait), worker_expiry(static_cast<uint64_t>(worker_expiry) * 1000),
+      next_expiry(0), expired(0), interrupts(std::make_shared<interrupt_buckets_t>()), cancelled(0),
+      schedule(schedule), key_function(key_function), affinity_wait(affinity_wait),
+      turn(fifo.end()), generator(std::random_device{}()),
+      batching(nullptr), batched(0) {
+
+  // each proxy reports on its own
+  auto& registry = metrics::registry_t::get();
+  auto labels = metric_labels = metrics::label("proxy", upstream_endpoint);
+  dispatched_total =
+      &registry.counter("prime_server_proxy_dispatched_total", "Jobs sent on to workers", labels);
+  expired_total = &registry.counter("prime_server_proxy_expired_total",
+                                    "Jobs dropped because they were past their deadline", labels);
+  cancelled_total = &registry.counter("prime_server_proxy_cancelled_total",
+                                      "Jobs dropped because they were interrupted", labels);
+  queued_jobs = &registry.gauge("prime_server_proxy_queued",
+                                "Jobs held waiting for a worker or for their batch", labels);
+  idle_workers =
+      &registry.gauge("prime_server_proxy_idle_workers", "Workers that can take more jobs", labels);
+  wait_seconds = &registry.histogram("prime_server_proxy_wait_seconds",
+                                     "Time from a job coming in to it going out to a worker", labels);
 
   int disabled = 0;
 
@@ -410,83 +1027,523 @@ proxy_t::proxy_t(zmq::context_t& context,
 
   downstream.setsockopt(ZMQ_RCVHWM, &disabled, sizeof(disabled));
   downstream.setsockopt(ZMQ_SNDHWM, &disabled, sizeof(disabled));
+  // fail sends to workers that went away so we can give the job to someone else
+  int enabled = 1;
+  downstream.setsockopt(ZMQ_ROUTER_MANDATORY, &enabled, sizeof(enabled));
   downstream.bind(downstream_endpoint.c_str());
+
+  // we only hear about interrupts if we were told where
+  if (!interrupt_endpoint.empty()) {
+    interrupt.setsockopt(ZMQ_RCVHWM, &disabled, sizeof(disabled));
+    interrupt.setsockopt(ZMQ_SUBSCRIBE, "", 0);
+    interrupt.connect(interrupt_endpoint.c_str());
+  }
 }
 proxy_t::~proxy_t() {
 }
 int proxy_t::expire() {
-  // TODO: expire any workers who don't advertise for a while, simply store a pair
-  // in the heartbeat fifo where the second item is the time it was added. then we
-  // just get the time and iterate from the beginning popping off stale ones
+  // workers check in every second so its enough to look for ones that went quiet now and then. that
+  // includes the ones that are out of credits and holding jobs from us, dead ones wont be back
+  auto now = steady_ms();
+  if (now >= next_expiry) {
+    next_expiry = now + POLL_TIMEOUT;
+    for (auto service = services.begin(); service != services.end();) {
+      const auto& address = service->first;
+      auto last_seen = service++->second.last_seen;
+      if (now - last_seen > worker_expiry)
+        leave(address);
+    }
+  }
   return static_cast<bool>(fifo.size()) + 1;
 }
 void proxy_t::forward() {
+  zmq::multipart_t messages;
+  zmq::reactor_t reactor;
+  // we could have been moved since construction which doesnt keep the end of the list the same
+  turn = fifo.begin();
+
+  // this worker is bored
+  reactor.add(downstream, [this, &messages]() {
+    try {
+      // how many jobs it can hold and what it finished comes after the heartbeat
+      downstream.recv_all(messages, ZMQ_DONTWAIT);
+      // an empty part after that means its busy and only letting us know its still alive
+      if (messages.size() > 3) {
+        serviced(messages.front());
+        return;
+      }
+      // a worker that only says how many it can take doesnt say what it finished, one that says
+      // nothing takes a job at a time and is done with the last one
+      advertisement_t advertisement{1, 1, 0};
+      if (messages.size() > 2) {
+        if (messages.back().size() == sizeof(advertisement)) {
+          std::memcpy(&advertisement, messages.back().data(), sizeof(advertisement));
+        } else if (messages.back().size() == sizeof(advertisement.credits)) {
+          std::memcpy(&advertisement.credits, messages.back().data(),
+                      sizeof(advertisement.credits));
+          advertisement.finished = 0;
+        }
+        messages.pop_back();
+      }
+      serviced(messages.front(), advertisement.finished, advertisement.dropped);
+      // the jobs we sent it that it hasnt finished or dropped count against what it can hold, even
+      // the ones still on their way to it
+      auto outstanding = services.find(messages.front())->second.outstanding.size();
+      uint32_t credits = advertisement.credits > outstanding
+                             ? advertisement.credits - static_cast<uint32_t>(outstanding)
+                             : 0;
+      // its a new worker or one that had run out of credits
+      auto worker = workers.find(messages.front());
+      if (worker == workers.cend()) {
+        if (credits > 0) {
+          // take ownership of heartbeat and remember this workers address
+          auto heart_beat = available(std::move(messages.back()));
+          worker = workers.emplace_hint(worker, std::move(messages.front()), heart_beat);
+          // remember which worker owns this heartbeat
+          heart_beats.emplace(&*heart_beat,
+                              available_t{worker->first.copy(), credits, indexed.size()});
+          indexed.push_back(&*heart_beat);
+        }
+      } // not new but update heartbeat just in case and how much it can take now
+      else {
+        *worker->second = std::move(messages.back());
+        auto& available = heart_beats.find(&*worker->second)->second;
+        available.credits = credits;
+        if (credits == 0)
+          forget(&*worker->second);
+      }
+      // maybe it can take something we were holding on to
+      if (!parked.empty() && batch_ready())
+        unpark();
+    } catch (const std::exception& e) {
+      logging::ERROR(std::string(__FILE__) + ":" + std::to_string(__LINE__) +
+                     " proxy_t: " + e.what());
+    }
+  });
+
+  // request for work
+  reactor.add(upstream, [this, &messages]() {
+    try {
+      // get the request
+      upstream.recv_all(messages, ZMQ_DONTWAIT);
+      // strip the from address (previous hop)
+      messages.pop_front();
+      // without a request info in front there is no job to speak of
+      if (messages.empty() || messages.front().size() < sizeof(uint64_t)) {
+        logging::ERROR("Proxy dropped a job without a request info");
+        return;
+      }
+      // its a piece of a body if we already know about the job its for
+      auto key = key_of(messages.front());
+      bool new_job = streams.find(key) == streams.cend();
+      // the start of a streamed body, the pieces of it will have to go where this goes
+      if (new_job && messages.size() > 2 && messages.back().size() == 0)
+        streams.emplace(key, zmq::message_t());
+      // new jobs have to wait their turn behind the ones we are already holding on to and when we
+      // are batching they wait for the rest of their batch
+      auto now = steady_us();
+      if ((new_job && (!parked.empty() || batch_size > 1)) || !dispatch(messages, new_job, now))
+        parked.emplace_back(parked_t{new_job, now, std::move(messages)});
+    } catch (const std::exception& e) {
+      logging::ERROR(std::string(__FILE__) + ":" + std::to_string(__LINE__) +
+                     " proxy_t: " + e.what());
+    }
+  });
+
+  // some clients went away or timed out
+  reactor.add(interrupt, [this]() {
+    try {
+      handle_interrupts();
+    } catch (const std::exception& e) {
+      logging::ERROR(std::string(__FILE__) + ":" + std::to_string(__LINE__) +
+                     " proxy_t: " + e.what());
+    }
+  });
+
   // keep forwarding messages
   while (!shutting_down()) {
     // check for activity on either of the sockets, but if we have no workers just let requests sit on
-    // the upstream socket
-    zmq::pollitem_t items[] = {{downstream, 0, ZMQ_POLLIN, 0}, {upstream, 0, ZMQ_POLLIN, 0}};
-    zmq::poll(items, expire(), POLL_TIMEOUT);
+    // the upstream socket. unless a body is streaming in, then we need to see its pieces
+    reactor.enable(upstream, expire() > 1 || !streams.empty());
+    // if we are holding on to a batch or jobs waiting for their own worker dont sleep past when
+    // they have to go
+    bool holding = (batch_size > 1 || key_function) && !parked.empty() && !fifo.empty();
+    long timeout = POLL_TIMEOUT;
+    if (holding) {
+      uint64_t wait = key_function && (batch_size == 1 || affinity_wait < batch_wait) ? affinity_wait
+                                                                                       : batch_wait;
+      auto waited = steady_us() - parked.front().since;
+      timeout = waited >= wait ? 0 : std::min<long>((wait - waited + 999) / 1000, timeout);
+    }
+    reactor.poll(timeout);
+    // let the batch go once its full or its waited long enough and see if the jobs that are waiting
+    // for their own worker can go
+    if (holding && batch_ready())
+      unpark();
+    // keep the levels up to date for the next scrape
+    queued_jobs->set(static_cast<int64_t>(parked.size()));
+    idle_workers->set(static_cast<int64_t>(heart_beats.size()));
+  }
 
-    // this worker is bored
-    if (items[0].revents & ZMQ_POLLIN) {
-      try {
-        // its a new worker
-        auto messages = downstream.recv_all(ZMQ_DONTWAIT);
-        auto worker = workers.find(messages.front());
-        if (worker == workers.cend()) {
-          // take ownership of heartbeat
-          fifo.emplace_back(std::move(*std::next(messages.begin())));
-          // remember this workers address
-          worker = workers.emplace_hint(worker, std::move(messages.front()), std::prev(fifo.end()));
-          // remember which worker owns this heartbeat
-          heart_beats.emplace(&fifo.back(), worker->first);
-        } // not new but update heartbeat just in case
-        else
-          *worker->second = std::move(*std::next(messages.begin()));
-      } catch (const std::exception& e) {
-        logging::ERROR(std::string(__FILE__) + ":" + std::to_string(__LINE__) +
-                       " proxy_t: " + e.what());
-      }
+  logging::INFO("Proxy dropped " + std::to_string(expired) + " expired jobs and " +
+                std::to_string(cancelled) + " interrupted jobs");
+}
+
+bool proxy_t::dispatch(zmq::multipart_t& messages, bool new_job, uint64_t since) {
+  // without a request info in front there is no job to speak of
+  if (messages.empty() || messages.front().size() < sizeof(uint64_t)) {
+    logging::ERROR("Proxy dropped a job without a request info");
+    return true;
+  }
+  auto key = key_of(messages.front());
+  bool more = messages.size() > 2 && messages.back().size() == 0;
+  auto stream = streams.find(key);
+
+  // a piece of a body goes to the worker that has its job, if its job went out yet. if that worker
+  // went away theres no one else to give it to, the job will time out
+  if (!new_job) {
+    if (stream->second.size() == 0)
+      return false;
+    try {
+      // if the worker cant take it right now it waits with the jobs we are holding on to, once the
+      // first part is in zmq takes the rest so it either all goes or none of it does
+      if (!downstream.send(stream->second, ZMQ_DONTWAIT | ZMQ_SNDMORE))
+        return false;
+      if (downstream.send_all(std::move(messages), ZMQ_DONTWAIT) == 0)
+        logging::ERROR("Failed to forward a piece of a body to worker");
+    } catch (const std::exception& e) {
+      logging::ERROR(std::string("Failed to forward a piece of a body to worker: ") + e.what());
     }
+    if (!more)
+      streams.erase(stream);
+    return true;
+  }
 
-    // request for work
-    if (items[1].revents & ZMQ_POLLIN) {
-      try {
-        // get the request
-        auto messages = upstream.recv_all(ZMQ_DONTWAIT);
-        // strip the from address (previous hop)
-        messages.pop_front();
-        // figure out what worker you want, ignore the request info
-        auto info = std::move(messages.front());
-        messages.pop_front();
-        const auto* heart_beat = choose_function ? choose_function(fifo, messages) : nullptr;
-        messages.emplace_front(std::move(info));
-        // either you didnt want to choose or you sent back garbage
-        auto hb_itr = heart_beats.find(heart_beat);
-        if (heart_beat == nullptr || hb_itr == heart_beats.cend()) {
-          heart_beat = &fifo.front();
-          hb_itr = heart_beats.find(heart_beat);
-        }
-        // send it on to the first bored worker
-        // TODO: if sending fails we need to try the next worker
-        if (!downstream.send(hb_itr->second, ZMQ_DONTWAIT | ZMQ_SNDMORE) ||
-            !downstream.send_all(messages, ZMQ_DONTWAIT))
-          logging::ERROR("Failed to forward job to worker");
-        // they are dead to us until they report back
-        auto worker_itr = workers.find(hb_itr->second);
-        fifo.erase(worker_itr->second);
-        workers.erase(worker_itr);
-        heart_beats.erase(hb_itr);
-      } catch (const std::exception& e) {
-        // TODO: recover from a worker dying just before you sent it work
-        logging::ERROR(std::string(__FILE__) + ":" + std::to_string(__LINE__) +
-                       " proxy_t: " + e.what());
+  // nobody is waiting for it anymore so dont waste a worker on it
+  auto deadline = deadline_of(messages.front());
+  if (deadline != 0 && epoch_ms() >= deadline) {
+    ++expired;
+    expired_total->increment();
+    return true;
+  }
+  // a job whose body is still coming has to go out anyway so the rest of its body has somewhere to
+  // go, the worker will drop it when it sees the interrupt
+  if (stream == streams.end() && interrupts->contains(key)) {
+    ++cancelled;
+    cancelled_total->increment();
+    return true;
+  }
+
+  // figure out what worker you want, ignore the request info. the choose function wants a list so
+  // we give it one whose parts share their bytes with the ones we are forwarding
+  std::list<zmq::message_t> job;
+  if (choose_function || key_function) {
+    for (auto part = std::next(messages.begin()); part != messages.end(); ++part)
+      job.emplace_back(part->copy());
+  }
+  // where it goes on the ring
+  uint64_t hashed = 0;
+  if (key_function) {
+    auto job_key = key_function(job);
+    hashed = hash(job_key.data(), job_key.size());
+  }
+
+  // keep trying until someone takes it or nobody is free to take it
+  while (!fifo.empty()) {
+    const zmq::message_t* heart_beat = choose_function ? choose_function(fifo, job) : nullptr;
+    // either you didnt want to choose or you sent back garbage
+    auto hb_itr = heart_beats.find(heart_beat);
+    if (heart_beat == nullptr || hb_itr == heart_beats.cend()) {
+      heart_beat = key_function ? on_ring(hashed, since) : next_worker();
+      if (heart_beat == nullptr)
+        return false;
+      hb_itr = heart_beats.find(heart_beat);
+    }
+    // send it on to the bored worker, if it went away we forget about it and try the next one and if
+    // it cant take it right now we stop sending it jobs until it says it can. once the first part is
+    // in zmq takes the rest so the job either all goes or we still have all of it
+    auto& available = hb_itr->second;
+    try {
+      if (!downstream.send(available.address, ZMQ_DONTWAIT | ZMQ_SNDMORE)) {
+        logging::WARN("Worker cant take a job right now, trying the next one");
+        forget(heart_beat);
+        continue;
+      }
+      if (downstream.send_all(std::move(messages), ZMQ_DONTWAIT) == 0) {
+        logging::ERROR("Failed to forward job to worker");
+        return true;
       }
+    } catch (const std::exception& e) {
+      logging::WARN(std::string("Worker went away, trying the next one: ") + e.what());
+      leave(available.address);
+      continue;
+    }
+    auto now = steady_us();
+    auto& stats = services.find(available.address)->second;
+    stats.outstanding.push_back(now);
+    stats.outstanding_jobs->set(static_cast<int64_t>(stats.outstanding.size()));
+    dispatched_total->increment();
+    wait_seconds->record(now - since);
+    // the rest of its body goes to the same worker
+    if (stream != streams.end())
+      stream->second = available.address.copy();
+    // once they are out of credits they are dead to us until they report back, until then they
+    // keep getting jobs until their batch is full and then the schedule moves on
+    batched = batching == heart_beat ? batched + 1 : 1;
+    batching = heart_beat;
+    if (--available.credits == 0) {
+      forget(heart_beat);
+    } else if (batched >= batch_size) {
+      rotate(heart_beat);
+      batching = nullptr;
+    }
+    return true;
+  }
+  return false;
+}
+
+void proxy_t::forget(const zmq::message_t* heart_beat) {
+  auto hb_itr = heart_beats.find(heart_beat);
+  auto worker_itr = workers.find(hb_itr->second.address);
+  if (batching == heart_beat)
+    batching = nullptr;
+  // the last one takes its place in the index
+  auto index = hb_itr->second.index;
+  indexed[index] = indexed.back();
+  heart_beats.find(indexed[index])->second.index = index;
+  indexed.pop_back();
+  heart_beats.erase(hb_itr);
+  // if it was its turn its the next ones turn
+  if (turn == worker_itr->second)
+    ++turn;
+  fifo.erase(worker_itr->second);
+  if (turn == fifo.end())
+    turn = fifo.begin();
+  workers.erase(worker_itr);
+}
+
+std::list<zmq::message_t>::iterator proxy_t::available(zmq::message_t&& heart_beat) {
+  // new ones go last in the turn order
+  if (schedule == ROUND_ROBIN) {
+    auto worker = fifo.emplace(turn, std::move(heart_beat));
+    if (turn == fifo.end())
+      turn = worker;
+    return worker;
+  }
+  // otherwise they just go to the back of the line
+  fifo.emplace_back(std::move(heart_beat));
+  return std::prev(fifo.end());
+}
+
+const zmq::message_t* proxy_t::next_worker() {
+  // keep filling the batch we started
+  if (batching != nullptr)
+    return batching;
+  switch (schedule) {
+    case LIFO:
+      return &fifo.back();
+    case ROUND_ROBIN:
+      return &*turn;
+    case RANDOM:
+      return indexed[std::uniform_int_distribution<size_t>(0, indexed.size() - 1)(generator)];
+    case BEST_OF_TWO: {
+      // pick two different ones and go with the one thats been faster, one we know nothing about
+      // yet looks fastest so that we find out
+      if (indexed.size() == 1)
+        return indexed.front();
+      auto first = std::uniform_int_distribution<size_t>(0, indexed.size() - 1)(generator);
+      auto second = std::uniform_int_distribution<size_t>(0, indexed.size() - 2)(generator);
+      second += second >= first;
+      const auto& a = services.find(heart_beats.find(indexed[first])->second.address)->second;
+      const auto& b = services.find(heart_beats.find(indexed[second])->second.address)->second;
+      return indexed[a.service_time <= b.service_time ? first : second];
+    }
+    case FIFO:
+    default:
+      return &fifo.front();
+  }
+}
+
+void proxy_t::serviced(const zmq::message_t& address, uint32_t finished, uint32_t dropped) {
+  // first time weve heard from it, it reports under its address for as long as the process lives
+  auto now = steady_ms();
+  auto service = services.find(address);
+  if (service == services.end()) {
+    auto& registry = metrics::registry_t::get();
+    auto labels = metric_labels + "," + metrics::label("worker", to_hex(address));
+    service =
+        services
+            .emplace(address.copy(),
+                     service_t{0, 0, now, {},
+                               &registry.gauge("prime_server_proxy_worker_service_microseconds",
+                                               "Smoothed time a worker takes to finish a job",
+                                               labels),
+                               &registry.counter("prime_server_proxy_worker_jobs_total",
+                                                 "Jobs a worker said it finished", labels),
+                               &registry.gauge("prime_server_proxy_worker_outstanding",
+                                               "Jobs a worker has that it hasnt finished", labels)})
+            .first;
+    // and it gets its places on the ring
+    if (key_function) {
+      for (uint64_t i = 0; i < RING_REPLICAS; ++i)
+        ring.emplace(hash(address.data(), address.size(), i), &service->first);
+    }
+    return;
+  }
+  // it works through its jobs in the order we sent them so the ones it finished are the oldest, the
+  // ones it dropped were waiting behind those
+  auto& stats = service->second;
+  stats.last_seen = now;
+  auto done_at = steady_us();
+  for (; finished > 0 && !stats.outstanding.empty(); --finished) {
+    double took = done_at - stats.outstanding.front();
+    stats.outstanding.pop_front();
+    stats.service_time =
+        stats.jobs++ == 0
+            ? took
+            : SERVICE_TIME_WEIGHT * took + (1 - SERVICE_TIME_WEIGHT) * stats.service_time;
+    stats.jobs_total->increment();
+  }
+  for (; dropped > 0 && !stats.outstanding.empty(); --dropped)
+    stats.outstanding.pop_front();
+  stats.service_microseconds->set(static_cast<int64_t>(stats.service_time));
+  stats.outstanding_jobs->set(static_cast<int64_t>(stats.outstanding.size()));
+}
+
+void proxy_t::handle_interrupts() {
+  // remember which ones were interrupted in case we havent seen them yet
+  zmq::multipart_t messages;
+  auto now = static_cast<uint32_t>(difftime(time(nullptr), 0) + .5);
+  while (interrupt.recv_all(messages, ZMQ_DONTWAIT)) {
+    for (const auto& message : messages) {
+      uint64_t key;
+      if (message.size() < sizeof(key))
+        continue;
+      std::memcpy(&key, message.data(), sizeof(key));
+      interrupts->insert(key, now);
+    }
+  }
+
+  // and drop the ones we are holding on to
+  for (auto parked_itr = parked.begin(); parked_itr != parked.end();) {
+    const auto& info = parked_itr->messages.front();
+    uint64_t key = 0;
+    if (info.size() >= sizeof(key))
+      std::memcpy(&key, info.data(), sizeof(key));
+    if (parked_itr->new_job && info.size() >= sizeof(key) && streams.find(key) == streams.cend() &&
+        interrupts->contains(key)) {
+      ++cancelled;
+      cancelled_total->increment();
+      parked_itr = parked.erase(parked_itr);
+    } else
+      ++parked_itr;
+  }
+}
+
+void proxy_t::leave(const zmq::message_t& address) {
+  // the address could be one of the ones we are about to erase
+  auto gone = address.copy();
+  auto service = services.find(gone);
+  if (service != services.end()) {
+    // the places it had on the ring go to whoever is next along
+    for (uint64_t i = 0; i < RING_REPLICAS && key_function; ++i) {
+      auto node = ring.find(hash(gone.data(), gone.size(), i));
+      if (node != ring.end() && node->second == &service->first)
+        ring.erase(node);
     }
+    service->second.outstanding_jobs->set(0);
+    services.erase(service);
+  }
+  // and if it was waiting for jobs it wont get any
+  auto worker = workers.find(gone);
+  if (worker != workers.end())
+    forget(&*worker->second);
+}
+
+const zmq::message_t* proxy_t::on_ring(uint64_t hashed, uint64_t since) {
+  // the first one along the ring is where it belongs, we only go on to the next ones if it has
+  // waited long enough for that one to be available
+  bool waited = steady_us() - since >= affinity_wait;
+  auto node = ring.lower_bound(hashed);
+  for (size_t i = 0; i < ring.size(); ++i, ++node) {
+    if (node == ring.end())
+      node = ring.begin();
+    auto worker = workers.find(*node->second);
+    if (worker != workers.end())
+      return &*worker->second;
+    if (!waited)
+      return nullptr;
   }
+  return nullptr;
 }
 
+void proxy_t::rotate(const zmq::message_t* heart_beat) {
+  switch (schedule) {
+    // the back of the line
+    case FIFO: {
+      auto worker = workers.find(heart_beats.find(heart_beat)->second.address);
+      fifo.splice(fifo.end(), fifo, worker->second);
+      break;
+    }
+    // the next ones turn
+    case ROUND_ROBIN:
+      if (&*turn == heart_beat && ++turn == fifo.end())
+        turn = fifo.begin();
+      break;
+    // lifo keeps going with the same one and random doesnt care
+    default:
+      break;
+  }
+}
+
+void proxy_t::unpark() {
+  // the pieces of a body come after their job so theyll go right after it, and when we run out of
+  // workers the new jobs stay put and in order
+  for (auto parked_itr = parked.begin(); parked_itr != parked.end();) {
+    if (dispatch(parked_itr->messages, parked_itr->new_job, parked_itr->since))
+      parked_itr = parked.erase(parked_itr);
+    else
+      ++parked_itr;
+  }
+  // whoever got a partial batch is still done for now
+  if (batching != nullptr) {
+    rotate(batching);
+    batching = nullptr;
+  }
+}
+bool proxy_t::batch_ready() const {
+  // pieces of bodies count towards the batch too but they are rare enough not to matter
+  return batch_size == 1 || parked.size() >= batch_size ||
+         steady_us() - parked.front().since >= batch_wait;
+}
+
+struct worker_t::listener_t {
+  std::mutex mutex;
+  interrupt_buckets_t interrupts;
+  // copies of what the work thread is on so the listener can tell when its defunct
+  uint64_t job = std::numeric_limits<uint64_t>::max();
+  std::vector<uint64_t> batch;
+  uint64_t deadline = 0;
+  // the job that was found to be defunct, checking it is all the work thread has to do
+  std::atomic<uint64_t> interrupted{std::numeric_limits<uint64_t>::max()};
+  // set every so often while the work thread is on a job so it checks in with the proxy
+  std::atomic<bool> remind{false};
+  uint64_t reminded = 0;
+  std::atomic<bool> done{false};
+
+  bool defunct(uint64_t now) const {
+    if (job == std::numeric_limits<uint64_t>::max())
+      return false;
+    if (deadline != 0 && now >= deadline)
+      return true;
+    // a batch is only interrupted once all of it is
+    if (batch.empty())
+      return interrupts.contains(job);
+    return std::all_of(batch.cbegin(), batch.cend(),
+                       [this](uint64_t key) { return interrupts.contains(key); });
+  }
+};
+
 worker_t::worker_t(zmq::context_t& context,
                    const std::string& upstream_proxy_endpoint,
                    const std::string& downstream_proxy_endpoint,
@@ -494,11 +1551,15 @@ worker_t::worker_t(zmq::context_t& context,
                    const std::string& interrupt_endpoint,
                    const work_function_t& work_function,
                    const cleanup_function_t& cleanup_function,
-                   const std::string& heart_beat)
+                   const std::string& heart_beat,
+                   uint32_t credits)
     : upstream_proxy(context, ZMQ_DEALER), downstream_proxy(context, ZMQ_DEALER),
-      loopback(context, ZMQ_PUSH), interrupt(context, ZMQ_SUB), work_function(work_function),
+      loopback(context, ZMQ_PUSH), interrupt(context, ZMQ_SUB), wake(context, ZMQ_PAIR),
+      woken(context, ZMQ_PAIR), work_function(work_function), batch_size(1),
       cleanup_function(cleanup_function), heart_beat(heart_beat),
-      job(std::numeric_limits<decltype(job)>::max()) {
+      credits(std::max(credits, uint32_t(1))), finished(0), dropped(0),
+      job(std::numeric_limits<decltype(job)>::max()),
+      job_deadline(0), listener(std::make_shared<listener_t>()) {
 
   int disabled = 0;
 
@@ -513,108 +1574,371 @@ worker_t::worker_t(zmq::context_t& context,
   loopback.setsockopt(ZMQ_SNDHWM, &disabled, sizeof(disabled));
   loopback.connect(result_endpoint.c_str());
 
+  // we subscribe to each job as we get it
   interrupt.setsockopt(ZMQ_RCVHWM, &disabled, sizeof(disabled));
-  interrupt.setsockopt(ZMQ_SUBSCRIBE, "", 0);
   interrupt.connect(interrupt_endpoint.c_str());
+
+  // every worker gets its own private line to its listener, the listener drains it every time it
+  // wakes up so sends on it never have to wait
+  static std::atomic<size_t> instances{0};
+  auto instance = std::to_string(instances++);
+  auto wake_endpoint = "inproc://worker_wake_" + instance;
+  wake.setsockopt(ZMQ_SNDHWM, &disabled, sizeof(disabled));
+  wake.bind(wake_endpoint.c_str());
+  woken.setsockopt(ZMQ_RCVHWM, &disabled, sizeof(disabled));
+  woken.connect(wake_endpoint.c_str());
+
+  // and reports on its own
+  auto& registry = metrics::registry_t::get();
+  auto labels =
+      metrics::label("proxy", upstream_proxy_endpoint) + "," + metrics::label("worker", instance);
+  jobs_total =
+      &registry.counter("prime_server_worker_jobs_total", "Jobs taken from the proxy", labels);
+  interrupted_total = &registry.counter("prime_server_worker_interrupted_total",
+                                        "Jobs given up on because they were interrupted", labels);
+  job_seconds = &registry.histogram("prime_server_worker_job_seconds",
+                                    "Time spent working on a job or a batch of them", labels);
+}
+worker_t::worker_t(zmq::context_t& context,
+                   const std::string& upstream_proxy_endpoint,
+                   const std::string& downstream_proxy_endpoint,
+                   const std::string& result_endpoint,
+                   const std::string& interrupt_endpoint,
+                   const batch_work_function_t& batch_work_function,
+                   size_t batch_size,
+                   const cleanup_function_t& cleanup_function,
+                   const std::string& heart_beat,
+                   uint32_t credits)
+    : worker_t(context,
+               upstream_proxy_endpoint,
+               downstream_proxy_endpoint,
+               result_endpoint,
+               interrupt_endpoint,
+               work_function_t{},
+               cleanup_function,
+               heart_beat,
+               static_cast<uint32_t>(std::max(static_cast<size_t>(credits), batch_size))) {
+  this->batch_work_function = batch_work_function;
+  this->batch_size = std::max(batch_size, size_t(1));
 }
 worker_t::~worker_t() {
 }
 void worker_t::work() {
+  // interrupts come in on their own thread so the work function can check for them cheaply
+  listener->done = false;
+  std::thread listening(&worker_t::listen, this);
   // give us something to do
   advertise();
   // give client code a way to abort
   interrupt_function_t bail = std::bind(&worker_t::handle_interrupt, this, false);
+  zmq::reactor_t reactor;
+
+  // got some work to do
+  reactor.add(upstream_proxy, [this, &bail]() {
+    // take what the proxy sent us and work through it, it can keep sending while we do
+    receive();
+    while (!queued.empty() && !shutting_down()) {
+      if (batch_work_function) {
+        handle_batch(bail);
+      } else {
+        auto messages = std::move(queued.front());
+        queued.pop_front();
+        handle_job(messages, bail);
+      }
+      // see what else came in and let the proxy know how much more we can take, unless we are
+      // shutting down
+      receive();
+      drop_interrupted();
+      if (!shutting_down())
+        advertise();
+    }
+  });
+
+  // while idle we keep reminding the proxy that we are here
+  reactor.add_timer(POLL_TIMEOUT, [this]() {
+    if (shutting_down())
+      return;
+    advertise();
+    // and forget the bodies we were waiting to see the end of once they are old enough
+    auto drop_dead = static_cast<uint32_t>(difftime(time(nullptr), 0) + .5) - INTERRUPT_AGE_CUTOFF;
+    for (auto abandoned_itr = abandoned.begin(); abandoned_itr != abandoned.end();) {
+      if ((*abandoned_itr >> 32) < drop_dead)
+        abandoned_itr = abandoned.erase(abandoned_itr);
+      else
+        ++abandoned_itr;
+    }
+  });
 
   // keep forwarding messages
-  while (!shutting_down()) {
-    // check for activity on the in bound socket, timeout after heart_beat interval
-    zmq::pollitem_t items[] = {{upstream_proxy, 0, ZMQ_POLLIN, 0}, {interrupt, 0, ZMQ_POLLIN, 0}};
-    zmq::poll(items, 2, POLL_TIMEOUT);
+  while (!shutting_down())
+    reactor.poll(POLL_TIMEOUT);
 
-    // got some work to do
-    if (items[0].revents & ZMQ_POLLIN) {
-      try {
-        // strip off the request info
-        auto messages = upstream_proxy.recv_all(0);
-        auto request_info = std::move(messages.front());
-        messages.pop_front();
-        // check if this request_info is one we should abort
-        job = *static_cast<const uint64_t*>(request_info.data());
+  // tell the listener we are done and wait for it
+  listener->done = true;
+  wake.send(static_cast<const void*>(""), 0, 0);
+  listening.join();
+}
+void worker_t::advertise(bool busy) {
+  try {
+    // heart beat, we're alive, how many jobs we can hold at once and how many we finished or
+    // dropped since we last said. the proxy knows how many it sent us so it works out how many more
+    // we can take, we cant since some could still be on their way. when busy an empty part on the
+    // end says thats all it is and the proxy doesnt look at the rest so we keep the counts for later
+    advertisement_t advertisement{credits, finished, dropped};
+    upstream_proxy.send(static_cast<const void*>(heart_beat.c_str()), heart_beat.size(),
+                        ZMQ_SNDMORE);
+    upstream_proxy.send(static_cast<const void*>(&advertisement), sizeof(advertisement),
+                        busy ? ZMQ_SNDMORE : 0);
+    if (busy)
+      upstream_proxy.send(static_cast<const void*>(""), 0, 0);
+    else
+      finished = dropped = 0;
+  } catch (const std::exception& e) {
+    logging::ERROR(std::string(__FILE__) + ":" + std::to_string(__LINE__) + " worker_t: " + e.what());
+  }
+}
+void worker_t::receive() {
+  std::list<zmq::message_t> messages;
+  while (!(messages = upstream_proxy.recv_all(ZMQ_DONTWAIT)).empty()) {
+    // without a request info in front there is no job to speak of
+    if (messages.size() < 2 || messages.front().size() < sizeof(uint64_t)) {
+      logging::ERROR("Worker dropped a job without a request info");
+      continue;
+    }
+    // an empty part on the end means more of the body is on its way
+    auto key = key_of(messages.front());
+    bool more = messages.size() > 2 && messages.back().size() == 0;
+    if (more)
+      messages.pop_back();
+    // its the rest of the body of a job we already gave up on
+    if (abandoned.find(key) != abandoned.cend()) {
+      if (!more)
+        abandoned.erase(key);
+      continue;
+    }
+    // its a piece of a body so it goes on the end of its job
+    auto body = incomplete.find(key);
+    if (body != incomplete.end()) {
+      body->second->emplace_back(std::move(*std::next(messages.begin())));
+      if (!more)
+        incomplete.erase(body);
+      continue;
+    }
+    // its a new job
+    subscribe(key, true);
+    queued.emplace_back(std::move(messages));
+    if (more)
+      incomplete.emplace(key, &queued.back());
+  }
+}
+void worker_t::handle_job(std::list<zmq::message_t>& messages, interrupt_function_t& bail) {
+  auto started = steady_us();
+  jobs_total->increment();
+  try {
+    // strip off the request info
+    auto request_info = std::move(messages.front());
+    messages.pop_front();
+    // check if this request_info is one we should abort
+    job = key_of(request_info);
+    job_deadline = deadline_of(request_info);
+    watch();
+    handle_interrupt(true);
+    // the rest of a streamed body could still be on its way
+    receive_body(messages);
+    // do the work, a streamed result means we keep at it until we get the last piece
+    bool more = false;
+    do {
+      auto result = work_function(messages, request_info.data(), bail);
+      // we'll keep advertising with this heartbeat
+      heart_beat = std::move(result.heart_beat);
+      more = result.more && !result.intermediate;
+      send_result(request_info, result);
+      // bail between pieces if the client went away or it timed out, once the response is on its way
+      // the server gives it more time with each piece so the deadline no longer applies
+      if (more) {
+        job_deadline = 0;
+        watch();
         handle_interrupt(true);
-        // do the work
-        auto result = work_function(messages, request_info.data(), bail);
-        // we'll keep advertising with this heartbeat
-        heart_beat = std::move(result.heart_beat);
-        // should we send this on to the next proxy
-        if (result.intermediate) {
-          // TODO: retry?
-          if (!downstream_proxy.send(request_info, ZMQ_SNDMORE) ||
-              !downstream_proxy.send_all(result.messages, 0))
-            logging::ERROR("Worker failed to forward intermediate result");
-        } // or are we done
-        else if (result.messages.size() != 0) {
-          if (result.messages.size() > 1) {
-            logging::WARN(
-                "Sending more than one result message over the loopback will result in additional parts being dropped");
-            result.messages.resize(1);
-          }
-          if (result.messages.back().empty())
-            logging::WARN("Sending empty messages will disconnect the client");
-          // TODO: retry
-          if (!loopback.send(request_info, ZMQ_SNDMORE) || !loopback.send_all(result.messages, 0))
-            logging::ERROR("Worker failed to forward final result");
-        } // an empty result is no good
-        else {
-          logging::ERROR("At least one result message is required for the loopback");
-        }
-      } // either interrupted or something unknown TODO: catch everything to avoid crashing?
-      catch (const interrupt_t& i) {
-        logging::WARN(i.what());
-      } catch (const std::exception& e) {
-        logging::ERROR(std::string(__FILE__) + ":" + std::to_string(__LINE__) +
-                       " worker_t: " + e.what());
       }
+    } while (more);
+  } // either interrupted or something unknown TODO: catch everything to avoid crashing?
+  catch (const interrupt_t& i) {
+    logging::WARN(i.what());
+    interrupted_total->increment();
+  } catch (const std::exception& e) {
+    logging::ERROR(std::string(__FILE__) + ":" + std::to_string(__LINE__) +
+                   " worker_t: " + e.what());
+  }
+  job_seconds->record(steady_us() - started);
+  ++finished;
 
-      // reset the job
-      job = std::numeric_limits<decltype(job)>::max();
+  // if we gave up before its whole body came in we drop the rest of it when it does
+  if (incomplete.erase(job))
+    abandoned.insert(job);
 
-      // do some cleanup
-      try {
-        if (cleanup_function)
-          cleanup_function();
-      } catch (const std::exception& e) {
-        logging::ERROR(std::string(__FILE__) + ":" + std::to_string(__LINE__) +
-                       " worker_t: " + e.what());
-      }
+  // reset the job
+  subscribe(job, false);
+  job = std::numeric_limits<decltype(job)>::max();
+  job_deadline = 0;
+  watch();
+
+  // do some cleanup
+  try {
+    if (cleanup_function)
+      cleanup_function();
+  } catch (const std::exception& e) {
+    logging::ERROR(std::string(__FILE__) + ":" + std::to_string(__LINE__) +
+                   " worker_t: " + e.what());
+  }
+}
+void worker_t::send_result(const zmq::message_t& request_info, result_t& result) {
+  bool more = result.more && !result.intermediate;
+  // should we send this on to the next proxy
+  if (result.intermediate) {
+    // TODO: retry?
+    if (!downstream_proxy.send(request_info, ZMQ_SNDMORE) ||
+        !downstream_proxy.send_all(result.messages, 0))
+      logging::ERROR("Worker failed to forward intermediate result");
+  } // or are we done
+  else if (result.messages.size() != 0) {
+    if (result.messages.size() > 1) {
+      logging::WARN(
+          "Sending more than one result message over the loopback will result in additional parts being dropped");
+      result.messages.resize(1);
     }
+    if (result.messages.back().empty())
+      logging::WARN("Sending empty messages will disconnect the client");
+    // a piece of the response has an extra empty part to let the server know more is coming
+    // TODO: retry
+    if (!loopback.send(request_info, ZMQ_SNDMORE) ||
+        !loopback.send_all(result.messages, more ? ZMQ_SNDMORE : 0) ||
+        (more && !loopback.send(static_cast<const void*>(""), 0, 0)))
+      logging::ERROR("Worker failed to forward final result");
+  } // an empty result is no good
+  else {
+    logging::ERROR("At least one result message is required for the loopback");
+  }
+}
+void worker_t::handle_batch(interrupt_function_t& bail) {
+  // dont bother with the ones that were interrupted while they waited
+  drop_interrupted();
+  if (queued.empty())
+    return;
 
-    // if we are shutting down, interrupts and advertising are pointless
-    if (shutting_down())
-      return;
+  // take as many as we can, but a job still waiting on the rest of its body goes by itself. we keep
+  // the request infos where they wont move so the pointers to them stay good
+  std::list<job_t> jobs;
+  std::list<zmq::message_t> request_infos;
+  do {
+    auto key = key_of(queued.front().front());
+    bool whole = incomplete.find(key) == incomplete.cend();
+    if (!whole && !jobs.empty())
+      break;
+    request_infos.emplace_back(std::move(queued.front().front()));
+    queued.front().pop_front();
+    jobs.push_back(job_t{std::move(queued.front()), request_infos.back().data()});
+    queued.pop_front();
+    // the batch is wanted until the last of its jobs isnt
+    auto deadline = deadline_of(request_infos.back());
+    job_deadline = batch.empty() || (job_deadline != 0 && deadline != 0)
+                       ? std::max(job_deadline, deadline)
+                       : 0;
+    batch.push_back(key);
+    if (!whole)
+      break;
+  } while (jobs.size() < batch_size && !queued.empty());
 
-    // got interrupt(s)
-    if (items[1].revents & ZMQ_POLLIN) {
-      handle_interrupt(false);
-      // cull off the old ones, but also note that the list is loosely ordered
-      // this means we can hold on to some older ones longer than we would have liked
-      // but it doesnt really matter because time is more expensive than memory
-      auto drop_dead = static_cast<uint32_t>(difftime(time(nullptr), 0) + .5) - INTERRUPT_AGE_CUTOFF;
-      while (interrupt_history.size() && (interrupt_history.front() >> 32) < drop_dead) {
-        interrupts.erase(interrupt_history.front());
-        interrupt_history.pop_front();
-      }
+  auto started = steady_us();
+  jobs_total->increment(jobs.size());
+  try {
+    // the first job stands in for the batch when we have to wait on a body
+    job = batch.front();
+    watch();
+    receive_body(jobs.front().messages);
+    // do the work
+    auto results = batch_work_function(jobs, bail);
+    if (results.size() != jobs.size())
+      logging::ERROR("Batch work function returned " + std::to_string(results.size()) +
+                     " results for " + std::to_string(jobs.size()) + " jobs");
+    // we'll keep advertising with this heartbeat
+    if (!results.empty())
+      heart_beat = std::move(results.back().heart_beat);
+    // each one goes back on its own unless its client went away or it timed out
+    auto key = batch.cbegin();
+    auto request_info = request_infos.cbegin();
+    for (auto result = results.begin(); result != results.end() && key != batch.cend();
+         ++result, ++key, ++request_info) {
+      if (interrupted(*key))
+        continue;
+      result->more = false;
+      send_result(*request_info, *result);
     }
-
-    // we want something more to do
-    advertise();
+  } // either interrupted or something unknown
+  catch (const interrupt_t& i) {
+    logging::WARN(i.what());
+    interrupted_total->increment(jobs.size());
+  } catch (const std::exception& e) {
+    logging::ERROR(std::string(__FILE__) + ":" + std::to_string(__LINE__) +
+                   " worker_t: " + e.what());
   }
-}
-void worker_t::advertise() {
+  job_seconds->record(steady_us() - started);
+  finished += static_cast<uint32_t>(jobs.size());
+
+  // if we gave up before its whole body came in we drop the rest of it when it does
+  if (incomplete.erase(job))
+    abandoned.insert(job);
+
+  // reset the batch
+  for (auto key : batch)
+    subscribe(key, false);
+  job = std::numeric_limits<decltype(job)>::max();
+  job_deadline = 0;
+  batch.clear();
+  watch();
+
+  // do some cleanup
   try {
-    // heart beat, we're alive
-    upstream_proxy.send(static_cast<const void*>(heart_beat.c_str()), heart_beat.size(), 0);
+    if (cleanup_function)
+      cleanup_function();
   } catch (const std::exception& e) {
-    logging::ERROR(std::string(__FILE__) + ":" + std::to_string(__LINE__) + " worker_t: " + e.what());
+    logging::ERROR(std::string(__FILE__) + ":" + std::to_string(__LINE__) +
+                   " worker_t: " + e.what());
+  }
+}
+void worker_t::receive_body(std::list<zmq::message_t>& messages) {
+  // its all here already
+  auto body = incomplete.find(job);
+  if (body == incomplete.end())
+    return;
+  // the job moved out of the queue so the pieces go here now
+  body->second = &messages;
+  zmq::pollitem_t items[]{{upstream_proxy, 0, ZMQ_POLLIN, 0}};
+  while (incomplete.find(job) != incomplete.cend()) {
+    // wait for some but give up if the client went away or it timed out in the mean time
+    zmq::poll(items, 1, POLL_TIMEOUT);
+    handle_interrupt(false);
+    receive();
+  }
+}
+void worker_t::drop_interrupted() {
+  // throw out whatever was interrupted while we were busy along with the ones nobody is waiting for
+  // anymore
+  auto now = epoch_ms();
+  std::lock_guard<std::mutex> lock(listener->mutex);
+  for (auto queued_job = queued.begin(); queued_job != queued.end();) {
+    auto key = key_of(queued_job->front());
+    auto deadline = deadline_of(queued_job->front());
+    if (!listener->interrupts.contains(key) && (deadline == 0 || now < deadline)) {
+      ++queued_job;
+      continue;
+    }
+    // if its body was still coming in we drop the rest of it when it does
+    if (incomplete.erase(key))
+      abandoned.insert(key);
+    subscribe(key, false);
+    interrupted_total->increment();
+    ++dropped;
+    queued_job = queued.erase(queued_job);
   }
 }
 void worker_t::handle_interrupt(bool force_check) {
@@ -622,16 +1946,97 @@ void worker_t::handle_interrupt(bool force_check) {
   if (shutting_down())
     throw interrupt_t(job & 0xFFFFFFFF);
 
-  // is there anything there right now
-  auto messages = interrupt.recv_all(ZMQ_DONTWAIT);
-  for (const auto& message : messages) {
-    auto inserted = interrupts.insert(*static_cast<const decltype(job)*>(message.data()));
-    interrupt_history.push_back(*inserted.first);
-  }
+  // the listener already flagged it, this is all a work function pays for in its inner loop
+  if (listener->interrupted.load(std::memory_order_relaxed) == job)
+    throw interrupt_t(job & 0xFFFFFFFF);
 
-  // either we just got more or we need to check the backlog
-  if ((force_check || messages.size()) && interrupts.find(job) != interrupts.cend())
+  // or we need to check the backlog ourselves because the job just started
+  if (force_check && interrupted())
     throw interrupt_t(job & 0xFFFFFFFF);
+
+  // a long job could have the proxy thinking we are dead
+  if (listener->remind.load(std::memory_order_relaxed)) {
+    listener->remind.store(false, std::memory_order_relaxed);
+    advertise(true);
+  }
+}
+bool worker_t::interrupted() const {
+  std::lock_guard<std::mutex> lock(listener->mutex);
+  return listener->defunct(epoch_ms());
+}
+bool worker_t::interrupted(uint64_t key) const {
+  std::lock_guard<std::mutex> lock(listener->mutex);
+  return listener->interrupts.contains(key);
+}
+void worker_t::watch() {
+  {
+    std::lock_guard<std::mutex> lock(listener->mutex);
+    listener->job = job;
+    listener->batch = batch;
+    listener->deadline = job_deadline;
+    listener->reminded = steady_ms();
+  }
+  // the listener could be asleep past the new deadline
+  if (job_deadline != 0)
+    wake.send(static_cast<const void*>(""), 0, 0);
+}
+void worker_t::subscribe(uint64_t key, bool subscribing) {
+  // the first byte says which way, the rest is the topic
+  char subscription[1 + sizeof(key)] = {subscribing ? '+' : '-'};
+  std::memcpy(subscription + 1, &key, sizeof(key));
+  // losing one would mean missing the jobs interrupt or never letting go of its topic
+  wake.send(static_cast<const void*>(subscription), sizeof(subscription), 0);
+}
+void worker_t::listen() {
+  zmq::pollitem_t items[]{{interrupt, 0, ZMQ_POLLIN, 0}, {woken, 0, ZMQ_POLLIN, 0}};
+  zmq::multipart_t messages;
+  long timeout = POLL_TIMEOUT;
+  while (!listener->done) {
+    try {
+      // wait for interrupts, the job to change or its deadline to come
+      zmq::poll(items, 2, timeout);
+      // being woken up can come with subscriptions to change
+      while (woken.recv_all(messages, ZMQ_DONTWAIT)) {
+        for (const auto& message : messages) {
+          if (message.size() != 1 + sizeof(uint64_t))
+            continue;
+          const auto* subscription = static_cast<const char*>(message.data());
+          interrupt.setsockopt(subscription[0] == '+' ? ZMQ_SUBSCRIBE : ZMQ_UNSUBSCRIBE,
+                               subscription + 1, sizeof(uint64_t));
+        }
+      }
+      auto now = static_cast<uint32_t>(difftime(time(nullptr), 0) + .5);
+      std::lock_guard<std::mutex> lock(listener->mutex);
+      while (interrupt.recv_all(messages, ZMQ_DONTWAIT)) {
+        for (const auto& message : messages) {
+          uint64_t key;
+          if (message.size() < sizeof(key))
+            continue;
+          std::memcpy(&key, message.data(), sizeof(key));
+          listener->interrupts.insert(key, now);
+        }
+      }
+      // remind the work thread to check in with the proxy while its on a job
+      auto steady = steady_ms();
+      if (listener->job != std::numeric_limits<uint64_t>::max() &&
+          steady - listener->reminded >= POLL_TIMEOUT) {
+        listener->remind.store(true, std::memory_order_relaxed);
+        listener->reminded = steady;
+      }
+      // let the work thread know if its job is defunct, otherwise wake up in time for its deadline
+      auto now_ms = epoch_ms();
+      timeout = POLL_TIMEOUT;
+      if (listener->interrupted.load(std::memory_order_relaxed) == listener->job)
+        continue;
+      if (listener->defunct(now_ms))
+        listener->interrupted.store(listener->job, std::memory_order_relaxed);
+      else if (listener->deadline != 0)
+        timeout = std::min(timeout, static_cast<long>(listener->deadline - now_ms));
+    } catch (const std::exception& e) {
+      logging::ERROR(std::string(__FILE__) + ":" + std::to_string(__LINE__) +
+                     " worker_t: " + e.what());
+    }
+  }
 }
 
 void quiesce(unsigned int drain_seconds, unsigned int) {
@@ -640,12 +2045,57 @@ void quiesce(unsigned int drain_seconds, unsigned int) {
 bool draining() {
   return quiescable::get().draining;
 }
+uint64_t epoch_ms() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
 bool shutting_down() {
   return quiescable::get().shutting_down;
 }
 
+int reuseport_listener(const std::string& endpoint) {
+#if !defined(_WIN32) && defined(SO_REUSEPORT)
+  auto address = endpoint.substr(6);
+  auto colon = address.rfind(':');
+  if (colon == std::string::npos)
+    throw std::runtime_error("Missing port in endpoint: " + endpoint);
+  auto host = address.substr(0, colon);
+  auto port = address.substr(colon + 1);
+  if (host.size() > 1 && host.front() == '[' && host.back() == ']')
+    host = host.substr(1, host.size() - 2);
+
+  addrinfo hints{}, *found = nullptr;
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  if (getaddrinfo(host == "*" ? nullptr : host.c_str(), port.c_str(), &hints, &found) != 0 ||
+      found == nullptr)
+    throw std::runtime_error("Could not resolve endpoint: " + endpoint);
+
+  int fd = socket(found->ai_family, found->ai_socktype, found->ai_protocol);
+  int enabled = 1;
+  if (fd == -1 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enabled, sizeof(enabled)) != 0 ||
+      setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &enabled, sizeof(enabled)) != 0 ||
+      bind(fd, found->ai_addr, found->ai_addrlen) != 0 || listen(fd, SOMAXCONN) != 0) {
+    auto error = std::string(strerror(errno));
+    if (fd != -1)
+      close(fd);
+    freeaddrinfo(found);
+    throw std::runtime_error("Could not listen on " + endpoint + ": " + error);
+  }
+  freeaddrinfo(found);
+  return fd;
+#else
+  throw std::runtime_error("SO_REUSEPORT is not supported on this platform");
+#endif
+}
+
 // explicit instantiation for netstring and http
 template class server_t<netstring_entity_t, netstring_request_info_t>;
 template class server_t<http_request_t, http_request_info_t>;
+template class sharded_server_t<netstring_entity_t, netstring_request_info_t>;
+template class sharded_server_t<http_request_t, http_request_info_t>;
 
 } // namespace prime_server
@@ -6,6 +6,7 @@
 #include <unordered_set>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <thread>
 
 // netstrings are far easier to work with but http is a more interesting use-case
@@ -93,26 +94,28 @@ int main(int argc, char** argv) {
               // request should look like
               /// is_prime?possible_prime=SOME_NUMBER
               try {
-                auto request =
-                    http_request_t::from_string(static_cast<const char*>(job.front().data()),
-                                                job.front().size());
-                query_t::const_iterator prime_str;
+                auto request = http_request_view_t::from_string(
+                    static_cast<const char*>(job.front().data()), job.front().size());
                 size_t possible_prime;
                 // get
                 if (request.method == method_t::GET) {
-                  if (request.path != "/is_prime" ||
-                      (prime_str = request.query.find("possible_prime")) == request.query.cend() ||
-                      prime_str->second.size() != 1)
+                  // there should be exactly one of them
+                  std::string_view prime_str;
+                  size_t count = 0;
+                  request.visit_query([&](std::string_view key, std::string_view value) {
+                    if (key == "possible_prime" && count++ == 0)
+                      prime_str = value;
+                  });
+                  if (request.path() != "/is_prime" || count != 1)
                     throw std::runtime_error(
                         "GET requests should look like: 'is_prime?possible_prime=SOME_NUMBER'");
-                  else
-                    possible_prime = std::stoul(prime_str->second.front());
+                  possible_prime = std::stoul(std::string(prime_str));
                 } // post
                 else if (request.method == method_t::POST) {
                   try {
                     if (request.body.empty())
                       throw;
-                    possible_prime = std::stoul(request.body);
+                    possible_prime = std::stoul(std::string(request.body));
                   } catch (...) {
                     throw std::runtime_error(
                         "POST requests should have a path of 'is_prime' and a body with 'SOME_NUMBER'");
@@ -137,10 +140,14 @@ int main(int argc, char** argv) {
             })));
   }
 
-  // load balancer for prime computation
+  // load balancer for prime computation, these can take a while so we dont hand out the ones whose
+  // clients have already gone away
   std::thread compute_proxy(
-      std::bind(&proxy_t::forward, proxy_t(context, compute_proxy_endpoint + "_upstream",
-                                           compute_proxy_endpoint + "_downstream")));
+      std::bind(&proxy_t::forward,
+                proxy_t(context, compute_proxy_endpoint + "_upstream",
+                        compute_proxy_endpoint + "_downstream", {}, DEFAULT_BATCH_SIZE,
+                        DEFAULT_BATCH_WAIT, DEFAULT_WORKER_EXPIRY, FIFO, {}, DEFAULT_AFFINITY_WAIT,
+                        request_interrupt)));
 
   // prime computers
   std::list<std::thread> compute_worker_threads;
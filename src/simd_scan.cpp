@@ -0,0 +1,133 @@
+#include "simd_scan.hpp"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#include <immintrin.h>
+// sse2 is only there when the compiler targets it, which 32 bit builds dont have to
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PRIME_SERVER_SSE2
+#endif
+#if defined(__GNUC__) || defined(__clang__)
+#define PRIME_SERVER_AVX2
+#endif
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace {
+
+using find_function_t = const char* (*)(const char*, const char*, char);
+
+const char* find_scalar(const char* begin, const char* end, char byte) {
+  while (begin != end && *begin != byte)
+    ++begin;
+  return begin;
+}
+
+#if defined(PRIME_SERVER_SSE2) || defined(PRIME_SERVER_AVX2)
+// index of the lowest set bit, mask must not be 0
+inline unsigned first_bit(unsigned mask) {
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanForward(&index, mask);
+  return static_cast<unsigned>(index);
+#else
+  return static_cast<unsigned>(__builtin_ctz(mask));
+#endif
+}
+#endif
+
+#ifdef PRIME_SERVER_SSE2
+const char* find_sse2(const char* begin, const char* end, char byte) {
+  // compare 16 bytes at a time and use the mask of matches to find the first one
+  const __m128i needle = _mm_set1_epi8(byte);
+  while (end - begin >= 16) {
+    auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+    auto mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle)));
+    if (mask)
+      return begin + first_bit(mask);
+    begin += 16;
+  }
+  return find_scalar(begin, end, byte);
+}
+#endif
+
+#ifdef PRIME_SERVER_AVX2
+__attribute__((target("avx2"))) const char* find_avx2(const char* begin, const char* end, char byte) {
+  // same as above but 32 bytes at a time
+  const __m256i needle = _mm256_set1_epi8(byte);
+  while (end - begin >= 32) {
+    auto chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin));
+    auto mask = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle)));
+    if (mask)
+      return begin + first_bit(mask);
+    begin += 32;
+  }
+#ifdef PRIME_SERVER_SSE2
+  return find_sse2(begin, end, byte);
+#else
+  return find_scalar(begin, end, byte);
+#endif
+}
+#endif
+
+struct dispatch_t {
+  find_function_t find;
+  const char* name;
+};
+
+// pick the widest thing the cpu supports
+dispatch_t detect() {
+#ifdef PRIME_SERVER_AVX2
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return {find_avx2, "avx2"};
+#endif
+#ifdef PRIME_SERVER_SSE2
+  return {find_sse2, "sse2"};
+#else
+  return {find_scalar, "scalar"};
+#endif
+}
+
+dispatch_t& dispatch() {
+  static dispatch_t dispatch = detect();
+  return dispatch;
+}
+
+} // namespace
+
+namespace prime_server {
+namespace simd {
+
+const char* find(const char* begin, const char* end, char byte) {
+  return dispatch().find(begin, end, byte);
+}
+
+const char* implementation() {
+  return dispatch().name;
+}
+
+bool select(const std::string& implementation) {
+  if (implementation == "scalar") {
+    dispatch() = {find_scalar, "scalar"};
+    return true;
+  }
+#ifdef PRIME_SERVER_SSE2
+  if (implementation == "sse2") {
+    dispatch() = {find_sse2, "sse2"};
+    return true;
+  }
+#endif
+#ifdef PRIME_SERVER_AVX2
+  if (implementation == "avx2" && __builtin_cpu_supports("avx2")) {
+    dispatch() = {find_avx2, "avx2"};
+    return true;
+  }
+#endif
+  return false;
+}
+
+} // namespace simd
+} // namespace prime_server
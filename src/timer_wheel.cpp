@@ -0,0 +1,184 @@
+#include "timer_wheel.hpp"
+
+#include <algorithm>
+
+namespace {
+constexpr uint16_t UNLINKED = 0xFFFF;
+}
+
+namespace prime_server {
+
+timer_wheel_t::timer_wheel_t(uint64_t now) : current(now), count(0), free_list(NIL) {
+  slots.fill(NIL);
+  occupied.fill(0);
+}
+
+timer_wheel_t::handle_t timer_wheel_t::schedule(uint64_t deadline, uint64_t key, uint8_t kind) {
+  // reuse a node if we have one or make a new one
+  uint32_t index = free_list;
+  if (index != NIL)
+    free_list = nodes[index].next;
+  else {
+    index = static_cast<uint32_t>(nodes.size());
+    nodes.emplace_back(node_t{0, 0, 0, NIL, NIL, UNLINKED, 0});
+  }
+
+  // fill it out and put it in the right slot
+  auto& node = nodes[index];
+  node.deadline = deadline;
+  node.key = key;
+  node.kind = kind;
+  link(index);
+  ++count;
+  return (static_cast<uint64_t>(node.generation) << 32) | (static_cast<uint64_t>(index) + 1);
+}
+
+void timer_wheel_t::cancel(handle_t& handle) {
+  if (handle == INVALID_HANDLE)
+    return;
+  // only unlink it if its still the same timer we handed out
+  auto index = static_cast<uint32_t>((handle & 0xFFFFFFFF) - 1);
+  if (index < nodes.size() && nodes[index].slot != UNLINKED &&
+      nodes[index].generation == static_cast<uint32_t>(handle >> 32)) {
+    unlink(index);
+    release(index);
+  }
+  handle = INVALID_HANDLE;
+}
+
+size_t timer_wheel_t::advance(uint64_t now, const expire_function_t& expire) {
+  size_t fired = 0;
+  while (current <= now) {
+    // nothing to do so skip ahead
+    if (count == 0) {
+      current = now + 1;
+      break;
+    }
+
+    // at the top of a lap we pull the next slot of the level above down into the lower levels
+    // and if that level is also at the top of its lap we do the same for the one above it
+    auto index = static_cast<size_t>(current & SLOT_MASK);
+    if (index == 0) {
+      for (size_t level = 1; level < LEVELS; ++level) {
+        auto slot = static_cast<size_t>((current >> (level * SLOT_BITS)) & SLOT_MASK);
+        cascade(level, slot);
+        if (slot != 0)
+          break;
+      }
+    }
+
+    // fire everything in this slot, we dont iterate because the expire function can add to it
+    while (slots[index] != NIL) {
+      auto i = slots[index];
+      unlink(i);
+      // clamped timers can cascade into the lowest level before they are actually due
+      if (nodes[i].deadline > current) {
+        link(i);
+        continue;
+      }
+      auto key = nodes[i].key;
+      auto kind = nodes[i].kind;
+      release(i);
+      ++fired;
+      expire(key, kind);
+    }
+
+    // if the lowest level is empty we can skip to the end of its lap
+    bool empty = true;
+    for (auto bits : occupied)
+      empty = empty && bits == 0;
+    if (empty && index != SLOT_MASK)
+      current = std::min(current | SLOT_MASK, now);
+    ++current;
+  }
+  return fired;
+}
+
+int64_t timer_wheel_t::next_expiry(uint64_t now) const {
+  if (count == 0)
+    return -1;
+  // the next time timers in the higher levels can cascade down is the top of the next lap, unless
+  // we are at the top of one right now and havent cascaded yet
+  uint64_t next = (current & SLOT_MASK) == 0 ? current : (current | SLOT_MASK) + 1;
+  // but something in the lowest level may be due sooner
+  for (size_t k = 0; k < SLOTS && current + k < next;) {
+    auto slot = static_cast<size_t>((current + k) & SLOT_MASK);
+    auto bits = occupied[slot >> 6] >> (slot & 63);
+    if (bits == 0) {
+      k += 64 - (slot & 63);
+      continue;
+    }
+    while (!(bits & 1)) {
+      bits >>= 1;
+      ++k;
+    }
+    next = std::min(next, current + k);
+    break;
+  }
+  return next > now ? static_cast<int64_t>(next - now) : 0;
+}
+
+size_t timer_wheel_t::size() const {
+  return count;
+}
+
+void timer_wheel_t::link(uint32_t index) {
+  auto& node = nodes[index];
+  // things in the past go in the current slot, things too far in the future get clamped
+  uint64_t deadline = node.deadline < current ? current : node.deadline;
+  uint64_t delta = deadline - current;
+  constexpr uint64_t max_delta = (uint64_t(1) << (LEVELS * SLOT_BITS)) - 1;
+  if (delta > max_delta)
+    deadline = current + max_delta;
+  // find the lowest level whose lap can hold this deadline
+  size_t level = 0;
+  while (level + 1 < LEVELS && delta >= (uint64_t(1) << ((level + 1) * SLOT_BITS)))
+    ++level;
+  auto slot = static_cast<size_t>((deadline >> (level * SLOT_BITS)) & SLOT_MASK);
+  // put it at the front of the list
+  auto& head = slots[level * SLOTS + slot];
+  node.slot = static_cast<uint16_t>(level * SLOTS + slot);
+  node.prev = NIL;
+  node.next = head;
+  if (head != NIL)
+    nodes[head].prev = index;
+  head = index;
+  if (level == 0)
+    occupied[slot >> 6] |= uint64_t(1) << (slot & 63);
+}
+
+void timer_wheel_t::unlink(uint32_t index) {
+  auto& node = nodes[index];
+  auto& head = slots[node.slot];
+  if (node.prev != NIL)
+    nodes[node.prev].next = node.next;
+  else
+    head = node.next;
+  if (node.next != NIL)
+    nodes[node.next].prev = node.prev;
+  // keep track of whether this slot is empty
+  if (head == NIL && node.slot < SLOTS)
+    occupied[node.slot >> 6] &= ~(uint64_t(1) << (node.slot & 63));
+  node.prev = node.next = NIL;
+  node.slot = UNLINKED;
+}
+
+void timer_wheel_t::release(uint32_t index) {
+  auto& node = nodes[index];
+  ++node.generation;
+  node.next = free_list;
+  free_list = index;
+  --count;
+}
+
+void timer_wheel_t::cascade(size_t level, size_t slot) {
+  // relink everything so it moves down to a lower level
+  auto& head = slots[level * SLOTS + slot];
+  while (head != NIL) {
+    auto index = head;
+    unlink(index);
+    link(index);
+  }
+}
+
+} // namespace prime_server
@@ -0,0 +1,521 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <limits>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+#include <liburing.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "logging/logging.hpp"
+#include "netstring_protocol.hpp"
+#include "uring_server.hpp"
+
+namespace {
+constexpr int POLL_TIMEOUT = 1000;
+constexpr int BUFFER_GROUP = 0;
+constexpr unsigned MAX_COMPLETIONS = 256;
+
+uint64_t steady_ms() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// what we give the kernel with each submission so we know what it was when it completes. zero copy
+// sends also say which one they were so we know whose bytes the kernel is done with
+constexpr uint32_t SEQUENCE_MASK = 0xFFFFFF;
+uint64_t user_data(uint8_t operation, uint32_t id, uint32_t sequence = 0) {
+  return (static_cast<uint64_t>(sequence & SEQUENCE_MASK) << 40) |
+         (static_cast<uint64_t>(operation) << 32) | id;
+}
+
+// the server keys its sessions by the identity of the client, for us thats the connection id
+zmq::message_t requester(uint32_t id) {
+  return zmq::message_t(sizeof(id), &id);
+}
+} // namespace
+
+namespace prime_server {
+
+template <class request_container_t, class request_info_t>
+struct uring_server_t<request_container_t, request_info_t>::ring_t {
+  // a client connection
+  struct connection_t {
+    explicit connection_t(int fd)
+        : fd(fd), sent(0), sending(false), sequence(0), pending(0), receiving(false),
+          closing(false), hung_up(false) {
+    }
+    // give back the bytes of a zero copy send. a failed one can be done before the ones ahead of it
+    // so we cant just take the oldest
+    void give_back(uint32_t which) {
+      auto found = std::find_if(lent.begin(), lent.end(),
+                                [which](const auto& bytes) { return bytes.first == which; });
+      if (found != lent.end())
+        lent.erase(found);
+    }
+    int fd;
+    // responses waiting to go out, the front one is being sent and this many bytes of it are gone
+    std::deque<zmq::message_t> outbox;
+    size_t sent;
+    bool sending;
+    // the bytes of zero copy sends that the kernel may still be reading from and which send it was
+    std::deque<std::pair<uint32_t, zmq::message_t>> lent;
+    uint32_t sequence;
+    // how many submissions we havent heard back about, we cant forget the connection until its 0
+    uint32_t pending;
+    bool receiving;
+    // whether we hung up or will once the outbox is empty
+    bool closing;
+    // the client is gone, whats left in the outbox goes once the kernel is done with the front
+    bool hung_up;
+  };
+  using connections_t = std::unordered_map<uint32_t, connection_t>;
+
+  explicit ring_t(const std::string& endpoint)
+      : buffer_ring(nullptr),
+        buffers(static_cast<size_t>(DEFAULT_RECV_BUFFERS) * DEFAULT_RECV_BUFFER_SIZE),
+        listener(reuseport_listener(endpoint)), results_fd(-1), next_id(0) {
+    // we are the only thread using the ring so the kernel can wait to do its work until we ask
+    io_uring_params params{};
+    params.flags = IORING_SETUP_COOP_TASKRUN;
+    auto error = io_uring_queue_init_params(DEFAULT_RING_ENTRIES, &uring, &params);
+    if (error < 0) {
+      close(listener);
+      throw std::runtime_error("Could not set up io_uring: " + std::string(strerror(-error)));
+    }
+
+    // the kernel picks one of these to receive into and tells us which one it was
+    buffer_ring =
+        io_uring_setup_buf_ring(&uring, DEFAULT_RECV_BUFFERS, BUFFER_GROUP, 0, &error);
+    if (buffer_ring == nullptr) {
+      io_uring_queue_exit(&uring);
+      close(listener);
+      throw std::runtime_error("Could not register receive buffers: " +
+                               std::string(strerror(-error)));
+    }
+    for (unsigned i = 0; i < DEFAULT_RECV_BUFFERS; ++i)
+      io_uring_buf_ring_add(buffer_ring, buffer(i), DEFAULT_RECV_BUFFER_SIZE, i,
+                            io_uring_buf_ring_mask(DEFAULT_RECV_BUFFERS), i);
+    io_uring_buf_ring_advance(buffer_ring, DEFAULT_RECV_BUFFERS);
+  }
+
+  ~ring_t() {
+    for (auto& connection : connections)
+      close(connection.second.fd);
+    io_uring_free_buf_ring(&uring, buffer_ring, DEFAULT_RECV_BUFFERS, BUFFER_GROUP);
+    io_uring_queue_exit(&uring);
+    close(listener);
+  }
+
+  // a free submission, if the queue is full we hand what we have to the kernel to make room
+  io_uring_sqe* next() {
+    auto* submission = io_uring_get_sqe(&uring);
+    if (submission == nullptr) {
+      io_uring_submit(&uring);
+      submission = io_uring_get_sqe(&uring);
+    }
+    if (submission == nullptr)
+      throw std::runtime_error("io_uring submission queue is full");
+    return submission;
+  }
+
+  // keep accepting new clients until it stops
+  void accept() {
+    auto* submission = next();
+    io_uring_prep_multishot_accept(submission, listener, nullptr, nullptr, 0);
+    io_uring_sqe_set_data64(submission, user_data(ACCEPT, 0));
+  }
+
+  // tell us every time zmq says there may be results
+  void poll_results() {
+    auto* submission = next();
+    io_uring_prep_poll_multishot(submission, results_fd, POLLIN);
+    io_uring_sqe_set_data64(submission, user_data(RESULTS, 0));
+  }
+
+  // keep receiving bytes from the client into whatever buffer is free until it stops
+  void receive(uint32_t id, connection_t& connection) {
+    auto* submission = next();
+    io_uring_prep_recv_multishot(submission, connection.fd, nullptr, 0, 0);
+    submission->flags |= IOSQE_BUFFER_SELECT;
+    submission->buf_group = BUFFER_GROUP;
+    io_uring_sqe_set_data64(submission, user_data(RECV, id));
+    connection.receiving = true;
+    ++connection.pending;
+  }
+
+  // send the rest of the response at the front of the outbox. large ones are sent zero copy which
+  // means we have to keep its bytes around until the kernel says its done with them
+  void send(uint32_t id, connection_t& connection, size_t zero_copy_size) {
+    const auto& message = connection.outbox.front();
+    auto* submission = next();
+    if (message.size() >= zero_copy_size) {
+      auto sequence = connection.sequence++ & SEQUENCE_MASK;
+      connection.lent.emplace_back(sequence, message.copy());
+      io_uring_prep_send_zc(submission, connection.fd,
+                            static_cast<const char*>(connection.lent.back().second.data()) +
+                                connection.sent,
+                            message.size() - connection.sent, MSG_NOSIGNAL, 0);
+      io_uring_sqe_set_data64(submission, user_data(SEND_ZERO_COPY, id, sequence));
+    } else {
+      io_uring_prep_send(submission, connection.fd,
+                         static_cast<const char*>(message.data()) + connection.sent,
+                         message.size() - connection.sent, MSG_NOSIGNAL);
+      io_uring_sqe_set_data64(submission, user_data(SEND, id));
+    }
+    connection.sending = true;
+    ++connection.pending;
+  }
+
+  // once we have hung up and heard back about everything we submitted for it we can forget it
+  void release(typename connections_t::iterator connection) {
+    if (connection->second.closing && connection->second.pending == 0) {
+      close(connection->second.fd);
+      connections.erase(connection);
+    }
+  }
+
+  char* buffer(uint16_t index) {
+    return buffers.data() + static_cast<size_t>(index) * DEFAULT_RECV_BUFFER_SIZE;
+  }
+
+  // give a receive buffer back to the kernel
+  void recycle(uint16_t index) {
+    io_uring_buf_ring_add(buffer_ring, buffer(index), DEFAULT_RECV_BUFFER_SIZE, index,
+                          io_uring_buf_ring_mask(DEFAULT_RECV_BUFFERS), 0);
+    io_uring_buf_ring_advance(buffer_ring, 1);
+  }
+
+  io_uring uring;
+  io_uring_buf_ring* buffer_ring;
+  std::vector<char> buffers;
+  int listener;
+  int results_fd;
+  uint32_t next_id;
+  connections_t connections;
+};
+
+template <class request_container_t, class request_info_t>
+uring_server_t<request_container_t, request_info_t>::uring_server_t(
+    zmq::context_t& context,
+    const std::string& client_endpoint,
+    const std::string& proxy_endpoint,
+    const std::string& result_endpoint,
+    const std::string& interrupt_endpoint,
+    bool log,
+    size_t max_request_size,
+    uint32_t request_timeout,
+    const health_check_matcher_t& health_check_matcher,
+    const std::string& health_check_response,
+    uint32_t session_timeout,
+    uint32_t header_timeout,
+    size_t wakeup_budget,
+    bool framing_only,
+    size_t zero_copy_size)
+    : server_type(context,
+                  "",
+                  proxy_endpoint,
+                  result_endpoint,
+                  interrupt_endpoint,
+                  log,
+                  max_request_size,
+                  request_timeout,
+                  health_check_matcher,
+                  health_check_response,
+                  session_timeout,
+                  header_timeout,
+                  wakeup_budget,
+                  framing_only),
+      zero_copy_size(zero_copy_size) {
+  if (client_endpoint.find("tcp://") != 0)
+    throw std::runtime_error("The io_uring server needs a tcp client endpoint");
+  ring = std::make_shared<ring_t>(client_endpoint);
+}
+
+template <class request_container_t, class request_info_t>
+uring_server_t<request_container_t, request_info_t>::~uring_server_t() {
+}
+
+template <class request_container_t, class request_info_t>
+void uring_server_t<request_container_t, request_info_t>::serve() {
+  // zmq tells us through a file descriptor when results may have shown up
+  size_t fd_size = sizeof(ring->results_fd);
+  this->loopback.getsockopt(ZMQ_FD, &ring->results_fd, &fd_size);
+  ring->accept();
+  ring->poll_results();
+
+  zmq::multipart_t messages;
+  io_uring_cqe* completions[MAX_COMPLETIONS];
+  while (!shutting_down()) {
+    // results go first since they free up resources. zmq only signals when new ones show up so we
+    // take all we can and ask it whether there are more before we go to sleep
+    for (size_t i = 0; i < this->wakeup_budget; ++i) {
+      try {
+        if (!this->loopback.recv_all(messages, ZMQ_DONTWAIT))
+          break;
+        this->handle_result(messages);
+        ++this->handled;
+      } catch (const std::exception& e) {
+        logging::ERROR(std::string(__FILE__) + ":" + std::to_string(__LINE__) +
+                       " uring_server_t: " + e.what());
+      }
+    }
+    int events = 0;
+    size_t events_size = sizeof(events);
+    this->loopback.getsockopt(ZMQ_EVENTS, &events, &events_size);
+
+    // submit everything we queued up and wait for something to complete but dont sleep past the
+    // next timer that needs to fire or at all if there are still results waiting
+    auto next_timer = this->timers.next_expiry(steady_ms());
+    long timeout = (events & ZMQ_POLLIN) ? 0
+                   : next_timer < 0 || next_timer > POLL_TIMEOUT ? POLL_TIMEOUT
+                                                                 : static_cast<long>(next_timer);
+    int submitted;
+    if (timeout > 0) {
+      __kernel_timespec wait{timeout / 1000, (timeout % 1000) * 1000000};
+      io_uring_cqe* completion;
+      submitted = io_uring_submit_and_wait_timeout(&ring->uring, &completion, 1, &wait, nullptr);
+    } else {
+      submitted = io_uring_submit(&ring->uring);
+    }
+    if (submitted < 0 && submitted != -ETIME && submitted != -EINTR)
+      logging::ERROR("uring_server_t failed to submit: " + std::string(strerror(-submitted)));
+
+    // handle whatever completed
+    ++this->wakeups;
+    unsigned count;
+    while ((count = io_uring_peek_batch_cqe(&ring->uring, completions, MAX_COMPLETIONS))) {
+      for (unsigned i = 0; i < count; ++i) {
+        try {
+          handle_completion(*completions[i]);
+          ++this->handled;
+        } catch (const std::exception& e) {
+          logging::ERROR(std::string(__FILE__) + ":" + std::to_string(__LINE__) +
+                         " uring_server_t: " + e.what());
+        }
+      }
+      io_uring_cq_advance(&ring->uring, count);
+    }
+
+    // catch up the workers that subscribed late and check the age of a few things
+    this->handle_subscriptions();
+    this->handle_timeouts();
+  }
+
+  logging::INFO("Server handled " + std::to_string(this->handled) + " messages in " +
+                std::to_string(this->wakeups) + " wakeups");
+}
+
+template <class request_container_t, class request_info_t>
+void uring_server_t<request_container_t, request_info_t>::handle_completion(
+    const io_uring_cqe& completion) {
+  auto data = io_uring_cqe_get_data64(&completion);
+  auto id = static_cast<uint32_t>(data);
+  switch (static_cast<operation_t>(static_cast<uint8_t>(data >> 32))) {
+    case ACCEPT:
+      if (completion.res >= 0)
+        handle_accept(completion.res);
+      else
+        logging::WARN("uring_server_t failed to accept: " +
+                      std::string(strerror(-completion.res)));
+      if (!(completion.flags & IORING_CQE_F_MORE))
+        ring->accept();
+      break;
+    case RECV:
+      handle_recv(id, completion.res, completion.flags);
+      break;
+    case SEND:
+      handle_send(id, completion.res, completion.flags, false);
+      break;
+    case SEND_ZERO_COPY:
+      handle_send(id, completion.res, completion.flags, true,
+                  static_cast<uint32_t>(data >> 40) & SEQUENCE_MASK);
+      break;
+    case RESULTS:
+      // the results themselves are taken at the top of the loop
+      if (!(completion.flags & IORING_CQE_F_MORE))
+        ring->poll_results();
+      break;
+  }
+}
+
+template <class request_container_t, class request_info_t>
+void uring_server_t<request_container_t, request_info_t>::handle_accept(int fd) {
+  // responses are usually small and whole so dont hold them back
+  int enabled = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enabled, sizeof(enabled));
+
+  // find an id thats not in use, they only repeat after billions of connections
+  while (ring->connections.find(ring->next_id) != ring->connections.end())
+    ++ring->next_id;
+  auto id = ring->next_id++;
+  auto& connection = ring->connections.emplace(id, typename ring_t::connection_t(fd)).first->second;
+
+  // make space for a streaming request and start receiving it
+  auto session = this->sessions
+                     .emplace(requester(id),
+                              typename server_type::session_t{request_container_t(this->framing_only),
+                                                              timer_wheel_t::INVALID_HANDLE,
+                                                              server_type::SESSION_TIMEOUT, 0})
+                     .first;
+  this->schedule_session(session);
+  ring->receive(id, connection);
+}
+
+template <class request_container_t, class request_info_t>
+void uring_server_t<request_container_t, request_info_t>::handle_recv(uint32_t id,
+                                                                      int result,
+                                                                      uint32_t flags) {
+  auto found = ring->connections.find(id);
+  if (found == ring->connections.end())
+    return;
+  auto& connection = found->second;
+
+  // some bytes showed up, we parse them right out of the receive buffer and give it straight back
+  if (result > 0) {
+    auto index = static_cast<uint16_t>(flags >> IORING_CQE_BUFFER_SHIFT);
+    if (!connection.closing) {
+      zmq::multipart_t messages;
+      messages.emplace_back() = requester(id);
+      messages.emplace_back() = zmq::message_t(ring->buffer(index), result, nullptr);
+      this->handle_request(messages);
+    }
+    ring->recycle(index);
+  } // the client hung up or something went wrong, we forget about the session and hang up too
+  else if (result != -ENOBUFS) {
+    connection.closing = true;
+    auto session = this->sessions.find(requester(id));
+    if (session != this->sessions.end())
+      this->close_session(session);
+    // the kernel may still be sending the front of the outbox so that has to wait until its done
+    if (connection.sending) {
+      connection.hung_up = true;
+      shutdown(connection.fd, SHUT_RD);
+    } else {
+      connection.outbox.clear();
+      shutdown(connection.fd, SHUT_RDWR);
+    }
+  }
+
+  // the kernel stops a multishot receive when it runs out of buffers so we start it back up. we only
+  // count it as done here so nothing above can forget the connection while we are still using it
+  if (!(flags & IORING_CQE_F_MORE)) {
+    connection.receiving = false;
+    --connection.pending;
+    if (!connection.closing)
+      ring->receive(id, connection);
+  }
+  ring->release(found);
+}
+
+template <class request_container_t, class request_info_t>
+void uring_server_t<request_container_t, request_info_t>::handle_send(uint32_t id,
+                                                                      int result,
+                                                                      uint32_t flags,
+                                                                      bool zero_copy,
+                                                                      uint32_t sequence) {
+  auto found = ring->connections.find(id);
+  if (found == ring->connections.end())
+    return;
+  auto& connection = found->second;
+
+  // the kernel is done with the bytes of a zero copy send
+  if (flags & IORING_CQE_F_NOTIF) {
+    connection.give_back(sequence);
+    --connection.pending;
+    ring->release(found);
+    return;
+  }
+  // if a notification is coming we are still lending the kernel the bytes
+  if (!zero_copy || !(flags & IORING_CQE_F_MORE)) {
+    --connection.pending;
+    if (zero_copy)
+      connection.give_back(sequence);
+  }
+  connection.sending = false;
+
+  // older kernels and some sockets dont do zero copy so we fall back to regular sends
+  if (zero_copy && (result == -EINVAL || result == -EOPNOTSUPP)) {
+    logging::WARN("Zero copy sends are not supported, falling back to regular sends");
+    zero_copy_size = std::numeric_limits<size_t>::max();
+    result = 0;
+  }
+  // the client is gone so the rest of its responses are too
+  if (result < 0 || connection.hung_up) {
+    connection.closing = true;
+    connection.outbox.clear();
+    auto session = this->sessions.find(requester(id));
+    if (session != this->sessions.end())
+      this->close_session(session);
+    shutdown(connection.fd, SHUT_RDWR);
+    ring->release(found);
+    return;
+  }
+
+  // move on to the next response or hang up if we were waiting to
+  connection.sent += result;
+  if (!connection.outbox.empty() && connection.sent == connection.outbox.front().size()) {
+    connection.outbox.pop_front();
+    connection.sent = 0;
+  }
+  if (!connection.outbox.empty())
+    ring->send(id, connection, zero_copy_size);
+  else if (connection.closing)
+    shutdown(connection.fd, SHUT_RDWR);
+  ring->release(found);
+}
+
+template <class request_container_t, class request_info_t>
+bool uring_server_t<request_container_t, request_info_t>::reply(const zmq::message_t& requester,
+                                                                const zmq::message_t& message) {
+  uint32_t id;
+  if (requester.size() != sizeof(id))
+    return false;
+  std::memcpy(&id, requester.data(), sizeof(id));
+  auto found = ring->connections.find(id);
+  if (found == ring->connections.end() || found->second.closing)
+    return false;
+
+  // queue it up behind whatever else is going out, the bytes are shared rather than copied
+  auto& connection = found->second;
+  connection.outbox.emplace_back(message.copy());
+  if (!connection.sending)
+    ring->send(id, connection, zero_copy_size);
+  return true;
+}
+
+template <class request_container_t, class request_info_t>
+bool uring_server_t<request_container_t, request_info_t>::disconnect(
+    const zmq::message_t& requester) {
+  uint32_t id;
+  if (requester.size() != sizeof(id))
+    return false;
+  std::memcpy(&id, requester.data(), sizeof(id));
+  auto found = ring->connections.find(id);
+  if (found == ring->connections.end())
+    return false;
+
+  // let whatever responses are still going out finish before we hang up, the receive completing
+  // when we do is what lets us forget about the connection
+  auto& connection = found->second;
+  connection.closing = true;
+  if (!connection.sending)
+    shutdown(connection.fd, SHUT_RDWR);
+  ring->release(found);
+  return true;
+}
+
+// explicit instantiation for netstring and http
+template class uring_server_t<netstring_entity_t, netstring_request_info_t>;
+template class uring_server_t<http_request_t, http_request_info_t>;
+
+} // namespace prime_server
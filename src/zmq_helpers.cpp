@@ -4,7 +4,9 @@
 #else
 #include <arpa/inet.h>
 #endif
+#include <algorithm>
 #include <cerrno>
+#include <chrono>
 #include <ctime>
 #include <czmq.h>
 #include <random>
@@ -18,6 +20,15 @@ constexpr char uuid_chars[] = {'a', 'b', 'c', 'd', 'e', 'f', '0', '1',
 constexpr int ipv4 = 0; // used as a fallback to v4 only if v6 fails
 constexpr int ipv6 = 1; // dual stack gives us both v4 and v6
 
+constexpr size_t SHARED_SEND_THRESHOLD = 1024; // bytes below which sharing isnt worth it
+
+// milliseconds on a clock that doesnt jump around when the wall clock gets adjusted
+uint64_t steady_ms() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
 }
 
 namespace zmq {
@@ -40,52 +51,53 @@ context_t::operator void*() {
 }
 
 message_t::message_t(void* data, size_t size, void (*free_function)(void*, void*)) {
-  // make the c message
-  zmq_msg_t* message = new zmq_msg_t();
-  if (zmq_msg_init_data(message, data, size, free_function, nullptr) != 0)
+  // make the c message in place
+  if (zmq_msg_init_data(&message, data, size, free_function, nullptr) != 0)
     throw std::runtime_error(zmq_strerror(zmq_errno()));
-
-  // wrap it in RAII goodness
-  ptr.reset(message, [](zmq_msg_t* message) {
-    auto ret = zmq_msg_close(message);
-    if (ret != 0)
-      throw std::runtime_error("zmq_msg_close error: " + std::to_string(errno));
-    delete message;
-  });
 }
 message_t::message_t(size_t size, const void* data) {
-  // make the c message
-  zmq_msg_t* message = new zmq_msg_t();
-  if (zmq_msg_init_size(message, size) != 0)
+  // make the c message in place
+  if (zmq_msg_init_size(&message, size) != 0)
     throw std::runtime_error(zmq_strerror(zmq_errno()));
   // copy the data into it
   if (size && data)
-    memcpy(zmq_msg_data(message), data, size);
-
-  // wrap it in RAII goodness
-  ptr.reset(message, [](zmq_msg_t* message) {
-    auto ret = zmq_msg_close(message);
-    if (ret != 0)
-      throw std::runtime_error("zmq_msg_close error: " + std::to_string(errno));
-    delete message;
-  });
+    memcpy(zmq_msg_data(&message), data, size);
+}
+message_t::message_t(message_t&& other) noexcept {
+  // take the others bytes and leave it empty
+  zmq_msg_init(&message);
+  zmq_msg_move(&message, &other.message);
+}
+message_t& message_t::operator=(message_t&& other) noexcept {
+  // moving releases whatever we had before
+  if (this != &other)
+    zmq_msg_move(&message, &other.message);
+  return *this;
+}
+message_t::~message_t() {
+  zmq_msg_close(&message);
+}
+message_t message_t::copy() const {
+  message_t copied;
+  if (zmq_msg_copy(&copied.message, const_cast<zmq_msg_t*>(&message)) != 0)
+    throw std::runtime_error(zmq_strerror(zmq_errno()));
+  return copied;
 }
 message_t::operator zmq_msg_t*() {
-  return ptr.get();
+  return &message;
 }
 void* message_t::data() {
-  return zmq_msg_data(ptr.get());
+  return zmq_msg_data(&message);
 }
 const void* message_t::data() const {
-  return zmq_msg_data(const_cast<zmq_msg_t*>(ptr.get()));
+  return zmq_msg_data(const_cast<zmq_msg_t*>(&message));
 }
 size_t message_t::size() const {
-  return zmq_msg_size(const_cast<zmq_msg_t*>(ptr.get()));
+  return zmq_msg_size(&message);
 }
 
 std::string message_t::str() const {
-  return std::string(static_cast<const char*>(zmq_msg_data(const_cast<zmq_msg_t*>(ptr.get()))),
-                     zmq_msg_size(const_cast<zmq_msg_t*>(ptr.get())));
+  return std::string(static_cast<const char*>(data()), size());
 }
 
 bool message_t::operator==(const message_t& other) const {
@@ -96,6 +108,69 @@ bool message_t::operator!=(const message_t& other) const {
   return size() != other.size() || std::memcmp(data(), other.data(), size()) != 0;
 }
 
+multipart_t::multipart_t() : count(0) {
+}
+size_t multipart_t::size() const {
+  return count;
+}
+bool multipart_t::empty() const {
+  return count == 0;
+}
+message_t& multipart_t::operator[](size_t index) {
+  return index < INLINE_PARTS ? inline_parts[index] : overflow_parts[index - INLINE_PARTS];
+}
+const message_t& multipart_t::operator[](size_t index) const {
+  return index < INLINE_PARTS ? inline_parts[index] : overflow_parts[index - INLINE_PARTS];
+}
+message_t& multipart_t::front() {
+  return (*this)[0];
+}
+const message_t& multipart_t::front() const {
+  return (*this)[0];
+}
+message_t& multipart_t::back() {
+  return (*this)[count - 1];
+}
+const message_t& multipart_t::back() const {
+  return (*this)[count - 1];
+}
+multipart_t::iterator multipart_t::begin() {
+  return iterator(this, 0);
+}
+multipart_t::iterator multipart_t::end() {
+  return iterator(this, count);
+}
+multipart_t::const_iterator multipart_t::begin() const {
+  return const_iterator(this, 0);
+}
+multipart_t::const_iterator multipart_t::end() const {
+  return const_iterator(this, count);
+}
+message_t& multipart_t::emplace_back() {
+  // the inline ones are always left empty when they arent in use
+  if (count < INLINE_PARTS)
+    return inline_parts[count++];
+  overflow_parts.emplace_back();
+  ++count;
+  return overflow_parts.back();
+}
+void multipart_t::pop_back() {
+  if (count > INLINE_PARTS)
+    overflow_parts.pop_back();
+  else if (count > 0)
+    inline_parts[count - 1] = message_t();
+  count -= count > 0;
+}
+void multipart_t::pop_front() {
+  for (size_t i = 1; i < count; ++i)
+    (*this)[i - 1] = std::move((*this)[i]);
+  pop_back();
+}
+void multipart_t::clear() {
+  while (count > 0)
+    pop_back();
+}
+
 socket_t::socket_t(const context_t& context, int socket_type) : context(context) {
   // make the c socket
   auto* socket = zmq_socket(this->context, socket_type);
@@ -163,6 +238,18 @@ std::list<message_t> socket_t::recv_all(int flags) {
   } while (more);
   return messages;
 }
+// read all of the messages on this socket into the parts
+bool socket_t::recv_all(multipart_t& messages, int flags) {
+  messages.clear();
+  // grab all message parts, zmq tells us if there are more on the message itself
+  do {
+    if (!recv(messages.emplace_back(), flags)) {
+      messages.pop_back();
+      break;
+    }
+  } while (zmq_msg_more(messages.back()));
+  return !messages.empty();
+}
 // send some bytes
 bool socket_t::send(const void* bytes, size_t count, int flags) {
   auto byte_count = zmq_send(ptr.get(), bytes, count, flags);
@@ -171,6 +258,38 @@ bool socket_t::send(const void* bytes, size_t count, int flags) {
     throw std::runtime_error(zmq_strerror(zmq_errno()));
   return byte_count >= 0;
 }
+// send a single message handing its bytes over to the socket
+bool socket_t::send(message_t&& message, int flags) {
+  auto byte_count = zmq_msg_send(message, ptr.get(), flags);
+  // ignore EAGAIN it just means you asked for non-blocking and we couldnt send the message
+  if (byte_count == -1 && zmq_errno() != EAGAIN)
+    throw std::runtime_error(zmq_strerror(zmq_errno()));
+  return byte_count >= 0;
+}
+// send a single message sharing its bytes with the socket
+bool socket_t::send_shared(const message_t& message, int flags) {
+  // small messages are cheaper to copy than to share and copying them means static ones can be
+  // used from any thread
+  if (message.size() < SHARED_SEND_THRESHOLD)
+    return send(message.data(), message.size(), flags);
+  // the copy just bumps the reference count on the original bytes
+  zmq_msg_t shared;
+  zmq_msg_init(&shared);
+  if (zmq_msg_copy(&shared, const_cast<message_t&>(message)) != 0) {
+    zmq_msg_close(&shared);
+    throw std::runtime_error(zmq_strerror(zmq_errno()));
+  }
+  auto byte_count = zmq_msg_send(&shared, ptr.get(), flags);
+  // if it didnt go we still own our copy
+  if (byte_count == -1) {
+    auto err = zmq_errno();
+    zmq_msg_close(&shared);
+    // ignore EAGAIN it just means you asked for non-blocking and we couldnt send the message
+    if (err != EAGAIN)
+      throw std::runtime_error(zmq_strerror(err));
+  }
+  return byte_count >= 0;
+}
 // send a single message
 template <class container_t>
 bool socket_t::send(const container_t& message, int flags) {
@@ -186,6 +305,14 @@ size_t socket_t::send_all(const std::list<container_t>& messages, int flags) {
         send<container_t>(message, (last_message == &message ? 0 : ZMQ_SNDMORE) | flags));
   return total;
 }
+// send all the messages over this socket handing their bytes over to the socket
+size_t socket_t::send_all(multipart_t&& messages, int flags) {
+  size_t total = 0;
+  for (size_t i = 0; i < messages.size(); ++i)
+    total += static_cast<size_t>(
+        send(std::move(messages[i]), (i + 1 == messages.size() ? 0 : ZMQ_SNDMORE) | flags));
+  return total;
+}
 // for polling
 socket_t::operator void*() {
   return ptr.get();
@@ -345,6 +472,102 @@ int poll(pollitem_t* items, int count, long timeout) {
   return signaled_events;
 }
 
+reactor_t::reactor_t() {
+#ifdef ZMQ_HAVE_POLLER
+  poller = zmq_poller_new();
+  if (!poller)
+    throw std::runtime_error(zmq_strerror(zmq_errno()));
+#endif
+}
+reactor_t::~reactor_t() {
+#ifdef ZMQ_HAVE_POLLER
+  zmq_poller_destroy(&poller);
+#endif
+}
+// run the handler whenever the socket has messages waiting
+void reactor_t::add(socket_t& socket, const handler_t& handler) {
+#ifdef ZMQ_HAVE_POLLER
+  // we hang on to the index of the socket so we know whose handler to run
+  if (zmq_poller_add(poller, socket, reinterpret_cast<void*>(watched.size()), ZMQ_POLLIN) != 0)
+    throw std::runtime_error(zmq_strerror(zmq_errno()));
+  events.resize(watched.size() + 1);
+#else
+  items.push_back(zmq_pollitem_t{socket, 0, ZMQ_POLLIN, 0});
+#endif
+  watched.push_back(watched_t{socket, handler, true});
+  ready.push_back(false);
+}
+// stop or resume watching a socket
+void reactor_t::enable(socket_t& socket, bool enabled) {
+  for (size_t i = 0; i < watched.size(); ++i) {
+    if (watched[i].socket != static_cast<void*>(socket) || watched[i].enabled == enabled)
+      continue;
+    watched[i].enabled = enabled;
+#ifdef ZMQ_HAVE_POLLER
+    if (zmq_poller_modify(poller, socket, enabled ? ZMQ_POLLIN : 0) != 0)
+      throw std::runtime_error(zmq_strerror(zmq_errno()));
+#else
+    items[i].events = enabled ? ZMQ_POLLIN : 0;
+#endif
+  }
+}
+// run the handler every interval milliseconds
+reactor_t::timer_handle_t reactor_t::add_timer(long interval, const handler_t& handler) {
+  timers.push_back(periodic_t{std::max(interval, 1L), steady_ms() + std::max(interval, 1L), handler});
+  return reinterpret_cast<timer_handle_t>(&timers.back());
+}
+void reactor_t::cancel_timer(timer_handle_t timer) {
+  timers.remove_if(
+      [timer](const periodic_t& t) { return reinterpret_cast<timer_handle_t>(&t) == timer; });
+}
+// wait for sockets or timers to be ready and run their handlers
+int reactor_t::poll(long timeout) {
+  // dont wait past the next timer
+  auto now = steady_ms();
+  for (const auto& timer : timers) {
+    auto until = timer.due > now ? static_cast<long>(timer.due - now) : 0;
+    timeout = timeout < 0 ? until : std::min(timeout, until);
+  }
+
+  // see which sockets are ready
+  std::fill(ready.begin(), ready.end(), false);
+#ifdef ZMQ_HAVE_POLLER
+  auto count = zmq_poller_wait_all(poller, events.data(), static_cast<int>(events.size()), timeout);
+  // running out of time isnt an error
+  if (count < 0 && zmq_errno() != EAGAIN)
+    throw std::runtime_error(zmq_strerror(zmq_errno()));
+  for (int i = 0; i < count; ++i)
+    if (events[i].events & ZMQ_POLLIN)
+      ready[reinterpret_cast<size_t>(events[i].user_data)] = true;
+#else
+  zmq::poll(items.data(), static_cast<int>(items.size()), timeout);
+  for (size_t i = 0; i < items.size(); ++i)
+    ready[i] = items[i].revents & ZMQ_POLLIN;
+#endif
+
+  // run the handlers in the order they were added
+  int handled = 0;
+  for (size_t i = 0; i < watched.size(); ++i) {
+    if (ready[i] && watched[i].enabled) {
+      watched[i].handler();
+      ++handled;
+    }
+  }
+
+  // and any timers that are due
+  now = steady_ms();
+  for (auto timer = timers.begin(); timer != timers.end();) {
+    auto current = timer++;
+    if (current->due > now)
+      continue;
+    // if we fell behind we dont try to catch up
+    current->due = std::max(current->due + current->interval, now + 1);
+    current->handler();
+    ++handled;
+  }
+  return handled;
+}
+
 // make a random port in suggested range
 uint16_t random_port() {
   std::default_random_engine generator(std::random_device{}());
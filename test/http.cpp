@@ -1,7 +1,10 @@
 #include "http_protocol.hpp"
 #include "prime_server.hpp"
+#include "simd_scan.hpp"
 #include "testing/testing.hpp"
 
+#include <algorithm>
+#include <chrono>
 #include <cstdlib>
 #include <cstring>
 #include <functional>
@@ -217,6 +220,11 @@ void test_query_parsing() {
   if (path != "/blah" || query.size() > 0)
     throw std::runtime_error("query parsing failed");
 
+  path = "/blah";
+  query = http_request_t::split_path_query(path);
+  if (path != "/blah" || query.size() > 0)
+    throw std::runtime_error("query parsing failed");
+
   path = "/blah?&&n&n=&n=b==c&=&a=1&1=2&x=y=z=4&=b&&";
   query = http_request_t::split_path_query(path);
   if (path != "/blah")
@@ -246,6 +254,147 @@ void test_query_parsing() {
     throw std::runtime_error("wrong values");
 }
 
+void test_request_view() {
+  // a request that doesnt need decoding should just point into the bytes
+  std::string request_str("GET /wos_haescht?nen_stei=2&ne_bluem=3&&ziit HTTP/1.0\r\nHost: "
+                          "localhost:8002\r\ncOnNeCtIoN: Keep-Alive\r\nDNT:\r\nnot a header\r\n\r\n");
+  auto view = http_request_view_t::from_string(request_str.data(), request_str.size());
+  if (view.method != method_t::GET || view.version != "HTTP/1.0" ||
+      view.path() != "/wos_haescht" || view.query_string() != "nen_stei=2&ne_bluem=3&&ziit" ||
+      !view.body.empty())
+    throw std::runtime_error("Request view parsing failed");
+  if (view.path().data() < request_str.data() ||
+      view.path().data() >= request_str.data() + request_str.size())
+    throw std::runtime_error("Request view should not have copied the path");
+  if (view.header("host") != "localhost:8002" || view.header("DNT") != "" ||
+      view.header("User-Agent") || view.header("not a header"))
+    throw std::runtime_error("Request view header lookup failed");
+  if (view.query("nen_stei") != "2" || view.query("ziit") != "" || view.query("") != "" ||
+      view.query("nope"))
+    throw std::runtime_error("Request view query lookup failed");
+  if (view.to_info(0).version != 0 || view.to_info(0).connection_keep_alive != 1 ||
+      view.to_info(0).connection_close != 0)
+    throw std::runtime_error("Request view info was wrong");
+  size_t headers = 0;
+  view.visit_headers([&headers](std::string_view, std::string_view) { ++headers; });
+  if (headers != 3)
+    throw std::runtime_error("Request view should have visited 3 headers");
+
+  // it should see the same thing as the regular parser, including what the server sends workers
+  for (const auto& str :
+       {std::string("POST /is_prime HTTP/1.1\r\nContent-Length: 11\r\nConnection: Close\r\n\r\n"
+                    "32416190071"),
+        std::string("GET /blah?&&n&n=&n=b==c&=&a=1&1=2&x=y=z=4&=b&& HTTP/1.1\r\n\r\n"),
+        std::string("GET /a%20b/%7e?q=%26%3d&r=%zz HTTP/1.1\r\nX-Odd:   spaced \r\n\r\n"),
+        http_request_t::to_string(method_t::PUT, "/spaces and/%percents%", "the body",
+                                  {{"k", {"v w"}}, {"x", {"#y"}}}, {{"A", "b"}})}) {
+    auto request = http_request_t::from_string(str.data(), str.size());
+    view.parse(str.data(), str.size());
+    query_t query;
+    view.visit_query([&query](std::string_view key, std::string_view value) {
+      query[std::string(key)].emplace_back(value);
+    });
+    headers_t headers;
+    view.visit_headers([&headers](std::string_view name, std::string_view value) {
+      headers.emplace(std::string(name), std::string(value));
+    });
+    if (view.method != request.method || view.path() != request.path ||
+        view.version != request.version || view.body != request.body || query != request.query ||
+        headers != request.headers)
+      throw std::runtime_error("Request view disagreed with the parser for: " + str);
+  }
+
+  // the same errors as the regular parser
+  for (const auto& bad : {std::pair<std::string, uint16_t>{"BLAH / HTTP/1.1\r\n\r\n", 501},
+                          {"GET / HTTP/2.0\r\n\r\n", 505},
+                          {"GET / HTTP/1.1\r\nContent-Length: x\r\n\r\n", 400}}) {
+    try {
+      http_request_view_t::from_string(bad.first.data(), bad.first.size());
+      throw std::runtime_error("Request view parsing should have failed");
+    } catch (const http_request_t::request_exception_t& e) {
+      if (e.code != bad.second)
+        throw std::runtime_error("Request view failed with the wrong code");
+    }
+  }
+  for (const auto& incomplete : {"GET /", "GET / HTTP/1.1\r\nHost: a\r\n",
+                                 "GET / HTTP/1.1\r\nContent-Length: 5\r\n\r\nabc"}) {
+    try {
+      http_request_view_t::from_string(incomplete, strlen(incomplete));
+      throw std::logic_error("Request view parsing should have failed");
+    } catch (const std::runtime_error&) {}
+  }
+}
+
+void test_deadline() {
+  // the deadline is how long the client will wait from when we got it, in milliseconds after the
+  // time stamp which is the whole second it got here in
+  std::string request_str("GET / HTTP/1.1\r\nX-Timeout-Ms: 250\r\n\r\n");
+  auto view = http_request_view_t::from_string(request_str.data(), request_str.size());
+  auto request = http_request_t::from_string(request_str.data(), request_str.size());
+  auto before = epoch_ms();
+  std::vector<http_request_info_t> infos{view.to_info(0), request.to_info(0)};
+  auto after = epoch_ms();
+  for (const auto& info : infos) {
+    auto deadline = info.time_stamp * uint64_t(1000) + info.deadline;
+    if (deadline < before + 250 || deadline > after + 250)
+      throw std::runtime_error("Expected a deadline 250ms after it got here but got " +
+                               std::to_string(deadline - before) + "ms");
+  }
+  // no or garbage timeouts mean no deadline
+  for (const auto& bad : {std::string("GET / HTTP/1.1\r\n\r\n"),
+                          std::string("GET / HTTP/1.1\r\nX-Timeout-Ms: soon\r\n\r\n"),
+                          std::string("GET / HTTP/1.1\r\nX-Timeout-Ms: 0\r\n\r\n")}) {
+    if (http_request_view_t::from_string(bad.data(), bad.size()).to_info(0).deadline != 0 ||
+        http_request_t::from_string(bad.data(), bad.size()).to_info(0).deadline != 0)
+      throw std::runtime_error("Expected no deadline for: " + bad);
+  }
+}
+
+void test_request_job() {
+  // what the server would have parsed
+  std::string request_str("PUT /a%20path?k=1&eq=%3D%3D&k=2&empty HTTP/1.0\r\nHost: "
+                          "localhost\r\nConnection: Keep-Alive\r\nContent-Length: 9\r\n\r\n"
+                          "the\r\nbody");
+  auto request = http_request_t::from_string(request_str.data(), request_str.size());
+  auto job = request.to_job();
+  const auto* bytes = static_cast<const char*>(job.data());
+  if (!http_request_view_t::is_job(bytes, job.size()) ||
+      http_request_view_t::is_job(request_str.data(), request_str.size()))
+    throw std::runtime_error("Could not tell a job from a request");
+
+  // the view should see exactly what the parser did without copying any of it
+  auto view = http_request_view_t::from_string(bytes, job.size());
+  if (view.method != method_t::PUT || view.version != "HTTP/1.0" || view.path() != "/a path" ||
+      view.body != "the\r\nbody" || view.header("connection") != "Keep-Alive" ||
+      view.query("eq") != "==" || view.query("empty") != "" || view.query("nope"))
+    throw std::runtime_error("Request job was not viewed properly");
+  if (view.path().data() < bytes || view.body.data() + view.body.size() > bytes + job.size())
+    throw std::runtime_error("Request job view should point into the job");
+  if (view.to_info(0).version != 0 || view.to_info(0).connection_keep_alive != 1)
+    throw std::runtime_error("Request job info was wrong");
+  query_t query;
+  view.visit_query([&query](std::string_view key, std::string_view value) {
+    query[std::string(key)].emplace_back(value);
+  });
+  if (query != request.query)
+    throw std::runtime_error("Request job query was wrong");
+
+  // and so should the regular parser
+  auto decoded = http_request_t::from_string(bytes, job.size());
+  if (decoded.method != request.method || decoded.path != request.path ||
+      decoded.version != request.version || decoded.query != request.query ||
+      decoded.headers != request.headers || decoded.body != request.body)
+    throw std::runtime_error("Request job was not decoded properly");
+
+  // cutting it short shouldnt read past the end
+  for (size_t size = 1; size < job.size(); ++size) {
+    try {
+      http_request_view_t::from_string(bytes, size);
+      throw std::logic_error("Truncated request job should have failed");
+    } catch (const std::runtime_error&) {}
+  }
+}
+
 void test_response() {
   std::string http = http_response_t::generic(200, "OK", headers_t{}, "e_chliises_schtoeckli");
   if (http != "HTTP/1.1 200 OK\r\nContent-Length: 21\r\n\r\ne_chliises_schtoeckli")
@@ -282,6 +431,19 @@ void test_response_parsing() {
     throw std::runtime_error("Response parsing failed");
 }
 
+void test_chunked_response() {
+  // the headers without a length and then the chunks
+  http_response_t response(200, "OK", http_response_t::chunk("first"),
+                           {{"Transfer-Encoding", "chunked"}});
+  auto response_str = response.to_string();
+  if (response_str.find("Content-Length") != std::string::npos)
+    throw std::logic_error("Chunked responses dont have a length");
+  response_str += http_response_t::chunk(std::string(300, 's')) + http_response_t::chunk("");
+  auto parsed = http_response_t::from_string(response_str.c_str(), response_str.size());
+  if (parsed.body != "first" + std::string(300, 's'))
+    throw std::logic_error("Chunked response body was wrong");
+}
+
 void test_shortcircuit() {
   // a server who lets us snoop on what its doing
   zmq::context_t context;
@@ -330,15 +492,16 @@ std::string random_string(size_t length) {
   return random;
 }
 
-void http_client_work(zmq::context_t& context) {
+void http_client_work(zmq::context_t& context,
+                      const std::string& endpoint = "tcp://127.0.0.1:15701",
+                      size_t total = 100000) {
   // client makes requests and gets back responses in a batch fashion
-  static constexpr size_t total = 100000;
   std::unordered_set<std::string> requests;
   size_t received = 0;
   std::string request;
   http_client_t client(
-      context, "tcp://127.0.0.1:15701",
-      [&requests, &request]() {
+      context, endpoint,
+      [&requests, &request, total]() {
         // we want more requests
         if (requests.size() < total) {
           std::pair<std::unordered_set<std::string>::iterator, bool> inserted =
@@ -356,7 +519,7 @@ void http_client_work(zmq::context_t& context) {
           request.clear();
         return std::make_pair(static_cast<const void*>(request.c_str()), request.size());
       },
-      [&requests, &received](const void* data, size_t size) {
+      [&requests, &received, total](const void* data, size_t size) {
         // get the result and tell if there is more or not
         auto response = http_response_t::from_string(static_cast<const char*>(data), size);
         if (requests.find(response.body) == requests.end())
@@ -380,7 +543,10 @@ void test_parallel_clients() {
                     "inproc://test_http_results", "inproc://test_http_interrupt", false,
                     MAX_REQUEST_SIZE, DEFAULT_REQUEST_TIMEOUT,
                     [](const http_request_t& r) -> bool { return r.path == "/health_check"; },
-                    http_response_t{200, "OK", "foo_bar_baz"}.to_string())));
+                    http_response_t{200, "OK", "foo_bar_baz"}.to_string(), DEFAULT_SESSION_TIMEOUT,
+                    DEFAULT_HEADER_TIMEOUT, DEFAULT_WAKEUP_BUDGET, false, {0, 1, -1},
+                    DEFAULT_MAX_REORDER_SIZE, DEFAULT_STREAM_BODY_SIZE,
+                    [](const http_request_t& r) -> bool { return r.path == "/metrics"; })));
   server.detach();
 
   // load balancer for parsing
@@ -417,12 +583,324 @@ void test_parallel_clients() {
   worker.detach();
 
   // make a bunch of clients
-  std::thread client1(std::bind(&http_client_work, std::ref(context)));
-  std::thread client2(std::bind(&http_client_work, std::ref(context)));
+  std::thread client1([&context]() { http_client_work(context); });
+  std::thread client2([&context]() { http_client_work(context); });
   client1.join();
   client2.join();
 }
 
+void test_sharded_clients() {
+
+  zmq::context_t context;
+
+  // server with a couple of shards sharing the port
+  std::thread server(std::bind(&http_sharded_server_t::serve,
+                               http_sharded_server_t(context, "tcp://127.0.0.1:15702",
+                                                     "inproc://test_sharded_proxy_upstream",
+                                                     "inproc://test_sharded_results",
+                                                     "inproc://test_sharded_interrupt", 2)));
+  server.detach();
+
+  // load balancer for parsing
+  std::thread proxy(
+      std::bind(&proxy_t::forward, proxy_t(context, "inproc://test_sharded_proxy_upstream",
+                                           "inproc://test_sharded_proxy_downstream")));
+  proxy.detach();
+
+  // echo worker, the results have to find their way back to the right shard
+  std::thread worker(
+      std::bind(&worker_t::work,
+                worker_t(context, "inproc://test_sharded_proxy_downstream", "inproc://dev_null",
+                         "inproc://test_sharded_results", "inproc://test_sharded_interrupt",
+                         [](const std::list<zmq::message_t>& job, void* request_info,
+                            worker_t::interrupt_function_t&) {
+                           auto request = http_request_t::from_string(static_cast<const char*>(
+                                                                          job.front().data()),
+                                                                      job.front().size());
+                           http_response_t response(200, "OK");
+                           response.body = request.method == method_t::POST ? request.body
+                                                                             : request.path;
+                           response.from_info(*static_cast<http_request_info_t*>(request_info));
+                           worker_t::result_t result{false, {}, {}};
+                           result.messages.emplace_back(response.to_string());
+                           return result;
+                         })));
+  worker.detach();
+
+  // enough clients that both shards should get some
+  std::list<std::thread> clients;
+  for (size_t i = 0; i < 4; ++i)
+    clients.emplace_back([&context]() { http_client_work(context, "tcp://127.0.0.1:15702", 10000); });
+  for (auto& client : clients)
+    client.join();
+}
+
+void test_pipelined_order() {
+  zmq::context_t context;
+
+  // server
+  std::thread server(std::bind(&http_server_t::serve,
+                               http_server_t(context, "tcp://127.0.0.1:15704",
+                                             "inproc://test_pipelined_proxy_upstream",
+                                             "inproc://test_pipelined_results",
+                                             "inproc://test_pipelined_interrupt")));
+  server.detach();
+
+  // load balancer for parsing
+  std::thread proxy(
+      std::bind(&proxy_t::forward, proxy_t(context, "inproc://test_pipelined_proxy_upstream",
+                                           "inproc://test_pipelined_proxy_downstream")));
+  proxy.detach();
+
+  // a couple of workers so the slow request can finish after the ones behind it
+  for (size_t i = 0; i < 2; ++i) {
+    std::thread worker(std::bind(
+        &worker_t::work,
+        worker_t(context, "inproc://test_pipelined_proxy_downstream", "inproc://dev_null",
+                 "inproc://test_pipelined_results", "inproc://test_pipelined_interrupt",
+                 [](const std::list<zmq::message_t>& job, void* request_info,
+                    worker_t::interrupt_function_t&) {
+                   auto request = http_request_t::from_string(static_cast<const char*>(
+                                                                  job.front().data()),
+                                                              job.front().size());
+                   if (request.path == "/slow")
+                     std::this_thread::sleep_for(std::chrono::milliseconds(500));
+                   http_response_t response(200, "OK", request.path);
+                   response.from_info(*static_cast<http_request_info_t*>(request_info));
+                   worker_t::result_t result{false, {}, {}};
+                   result.messages.emplace_back(response.to_string());
+                   return result;
+                 })));
+    worker.detach();
+  }
+
+  // pipeline a slow one and then some fast ones, they have to come back in the order we sent them
+  std::vector<std::string> paths{"/slow", "/fast1", "/fast2", "/fast3"};
+  std::vector<std::string> received;
+  size_t sent = 0;
+  std::string request;
+  http_client_t client(
+      context, "tcp://127.0.0.1:15704",
+      [&paths, &sent, &request]() {
+        request = sent < paths.size() ? http_request_t::to_string(GET, paths[sent++]) : "";
+        return std::make_pair(static_cast<const void*>(request.c_str()), request.size());
+      },
+      [&paths, &received](const void* data, size_t size) {
+        auto response = http_response_t::from_string(static_cast<const char*>(data), size);
+        received.push_back(response.body);
+        return received.size() < paths.size();
+      },
+      paths.size());
+  client.batch();
+  if (received != paths)
+    throw std::logic_error("Pipelined responses came back out of order");
+}
+
+void test_streaming_response() {
+  zmq::context_t context;
+
+  // server
+  std::thread server(std::bind(&http_server_t::serve,
+                               http_server_t(context, "tcp://127.0.0.1:15705",
+                                             "inproc://test_streaming_proxy_upstream",
+                                             "inproc://test_streaming_results",
+                                             "inproc://test_streaming_interrupt")));
+  server.detach();
+
+  // load balancer for parsing
+  std::thread proxy(
+      std::bind(&proxy_t::forward, proxy_t(context, "inproc://test_streaming_proxy_upstream",
+                                           "inproc://test_streaming_proxy_downstream")));
+  proxy.detach();
+
+  // worker that sends back the headers and then a few chunks one at a time
+  auto pieces = std::make_shared<size_t>(0);
+  std::thread worker(std::bind(
+      &worker_t::work,
+      worker_t(context, "inproc://test_streaming_proxy_downstream", "inproc://dev_null",
+               "inproc://test_streaming_results", "inproc://test_streaming_interrupt",
+               [pieces](const std::list<zmq::message_t>&, void* request_info,
+                        worker_t::interrupt_function_t&) {
+                 worker_t::result_t result{false, {}, {}, true};
+                 if (*pieces == 0) {
+                   http_response_t response(200, "OK", "", {{"Transfer-Encoding", "chunked"}});
+                   response.from_info(*static_cast<http_request_info_t*>(request_info));
+                   result.messages.emplace_back(response.to_string());
+                 } else if (*pieces < 4) {
+                   result.messages.emplace_back(
+                       http_response_t::chunk("piece" + std::to_string(*pieces)));
+                 } else {
+                   result.messages.emplace_back(http_response_t::chunk(""));
+                   result.more = false;
+                 }
+                 *pieces = result.more ? *pieces + 1 : 0;
+                 return result;
+               })));
+  worker.detach();
+
+  // a plain stream socket so we can see the response come in pieces
+  zmq::socket_t client(context, ZMQ_STREAM);
+  client.connect("tcp://127.0.0.1:15705");
+  auto connection = client.recv_all(0);
+  auto request = http_request_t::to_string(GET, "/stream");
+  client.send(connection.front(), ZMQ_SNDMORE);
+  client.send(request, 0);
+
+  http_response_t response;
+  std::list<http_response_t> responses;
+  while (responses.empty()) {
+    auto messages = client.recv_all(0);
+    responses = response.from_stream(static_cast<const char*>(messages.back().data()),
+                                      messages.back().size());
+  }
+  if (responses.front().body != "piece1piece2piece3")
+    throw std::logic_error("Streamed response body was wrong: " + responses.front().body);
+}
+
+void test_streaming_request() {
+  zmq::context_t context;
+
+  // server that doesnt hang on to bodies bigger than a kilobyte
+  std::thread server(std::bind(
+      &http_server_t::serve,
+      http_server_t(context, "tcp://127.0.0.1:15706", "inproc://test_upload_proxy_upstream",
+                    "inproc://test_upload_results", "inproc://test_upload_interrupt", false,
+                    MAX_REQUEST_SIZE, DEFAULT_REQUEST_TIMEOUT, {}, {}, DEFAULT_SESSION_TIMEOUT,
+                    DEFAULT_HEADER_TIMEOUT, DEFAULT_WAKEUP_BUDGET, false, {0, 1, -1},
+                    DEFAULT_MAX_REORDER_SIZE, 1024)));
+  server.detach();
+
+  // load balancer for parsing
+  std::thread proxy(
+      std::bind(&proxy_t::forward, proxy_t(context, "inproc://test_upload_proxy_upstream",
+                                           "inproc://test_upload_proxy_downstream")));
+  proxy.detach();
+
+  // a couple of workers that put the body back together and echo a hash of it, the client only
+  // handles responses that come back in one read
+  for (size_t i = 0; i < 2; ++i) {
+    std::thread worker(std::bind(
+        &worker_t::work,
+        worker_t(context, "inproc://test_upload_proxy_downstream", "inproc://dev_null",
+                 "inproc://test_upload_results", "inproc://test_upload_interrupt",
+                 [](const std::list<zmq::message_t>& job, void* request_info,
+                    worker_t::interrupt_function_t&) {
+                   auto request = http_request_t::from_string(static_cast<const char*>(
+                                                                  job.front().data()),
+                                                              job.front().size());
+                   for (auto piece = std::next(job.begin()); piece != job.end(); ++piece)
+                     request.body.append(static_cast<const char*>(piece->data()), piece->size());
+                   http_response_t response(200, "OK",
+                                            std::to_string(std::hash<std::string>{}(request.body)));
+                   response.from_info(*static_cast<http_request_info_t*>(request_info));
+                   worker_t::result_t result{false, {}, {}};
+                   result.messages.emplace_back(response.to_string());
+                   return result;
+                 })));
+    worker.detach();
+  }
+
+  // bodies bigger than the server would take if it had to buffer them, one chunked, with a small
+  // one in between
+  std::string body(MAX_REQUEST_SIZE * 3, ' ');
+  for (size_t i = 0; i < body.size(); ++i)
+    body[i] = (i % 95) + 32;
+  std::string chunked = "POST /chunked HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n";
+  for (size_t i = 0; i < body.size(); i += 4096)
+    chunked += http_response_t::chunk(body.substr(i, 4096));
+  chunked += http_response_t::chunk("");
+  std::vector<std::string> requests{http_request_t::to_string(POST, "/upload", body),
+                                    http_request_t::to_string(POST, "/small", "small"), chunked};
+  auto hashed = std::to_string(std::hash<std::string>{}(body));
+  std::vector<std::string> expected{hashed, std::to_string(std::hash<std::string>{}("small")),
+                                    hashed};
+  std::vector<std::string> received;
+  size_t sent = 0;
+  http_client_t client(
+      context, "tcp://127.0.0.1:15706",
+      [&requests, &sent]() {
+        if (sent == requests.size())
+          return std::make_pair(static_cast<const void*>(nullptr), size_t(0));
+        const auto& request = requests[sent++];
+        return std::make_pair(static_cast<const void*>(request.data()), request.size());
+      },
+      [&received, &expected](const void* data, size_t size) {
+        auto response = http_response_t::from_string(static_cast<const char*>(data), size);
+        received.push_back(response.body);
+        return received.size() < expected.size();
+      },
+      requests.size());
+  client.batch();
+  if (received != expected)
+    throw std::logic_error("Streamed request bodies didnt make it to the worker intact");
+}
+
+void test_slow_upload() {
+  zmq::context_t context;
+
+  // server that streams anything but tiny bodies and only gives a second to send the headers
+  std::thread server(std::bind(
+      &http_server_t::serve,
+      http_server_t(context, "tcp://127.0.0.1:15719", "inproc://test_slow_upload_proxy_upstream",
+                    "inproc://test_slow_upload_results", "inproc://test_slow_upload_interrupt", false,
+                    MAX_REQUEST_SIZE, DEFAULT_REQUEST_TIMEOUT, {}, {}, DEFAULT_SESSION_TIMEOUT, 1,
+                    DEFAULT_WAKEUP_BUDGET, false, {0, 1, -1}, DEFAULT_MAX_REORDER_SIZE, 16)));
+  server.detach();
+
+  std::thread proxy(std::bind(&proxy_t::forward,
+                              proxy_t(context, "inproc://test_slow_upload_proxy_upstream",
+                                      "inproc://test_slow_upload_proxy_downstream")));
+  proxy.detach();
+
+  // echoes the body once its all there
+  std::thread worker(std::bind(
+      &worker_t::work,
+      worker_t(context, "inproc://test_slow_upload_proxy_downstream", "inproc://dev_null",
+               "inproc://test_slow_upload_results", "inproc://test_slow_upload_interrupt",
+               [](const std::list<zmq::message_t>& job, void* request_info,
+                  worker_t::interrupt_function_t&) {
+                 auto request = http_request_t::from_string(static_cast<const char*>(
+                                                                job.front().data()),
+                                                            job.front().size());
+                 for (auto piece = std::next(job.begin()); piece != job.end(); ++piece)
+                   request.body.append(static_cast<const char*>(piece->data()), piece->size());
+                 http_response_t response(200, "OK", request.body);
+                 response.from_info(*static_cast<http_request_info_t*>(request_info));
+                 worker_t::result_t result{false, {}, {}};
+                 result.messages.emplace_back(response.to_string());
+                 return result;
+               })));
+  worker.detach();
+
+  // the body trickles in over a couple of seconds which is longer than the header timeout but each
+  // piece shows up well within the request timeout so it should make it through
+  std::string body = "0123456789abcdefghijklmnopqrstuvwxyz";
+  auto request = http_request_t::to_string(POST, "/slow", body);
+  std::vector<std::string> pieces{request.substr(0, request.size() - 30)};
+  for (size_t i = request.size() - 30; i < request.size(); i += 6)
+    pieces.push_back(request.substr(i, 6));
+  size_t sent = 0;
+  std::string received;
+  http_client_t client(
+      context, "tcp://127.0.0.1:15719",
+      [&pieces, &sent]() {
+        if (sent == pieces.size())
+          return std::make_pair(static_cast<const void*>(nullptr), size_t(0));
+        if (sent != 0)
+          std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        const auto& piece = pieces[sent++];
+        return std::make_pair(static_cast<const void*>(piece.data()), piece.size());
+      },
+      [&received](const void* data, size_t size) {
+        received = http_response_t::from_string(static_cast<const char*>(data), size).body;
+        return false;
+      },
+      pieces.size());
+  client.batch();
+  if (received != body)
+    throw std::logic_error("Slowly streamed body was cut off, got: " + received);
+}
+
 void test_malformed() {
   zmq::context_t context;
   std::string request = "isch_doch_unsinn";
@@ -443,6 +921,36 @@ void test_malformed() {
   // TODO: check that you're disconnected
 }
 
+void test_metrics() {
+  zmq::context_t context;
+  auto request = http_request_t{GET, "/metrics"}.to_string();
+  http_client_t client(
+      context, "tcp://127.0.0.1:15701",
+      [&request]() {
+        return std::make_pair(static_cast<const void*>(request.c_str()), request.size());
+      },
+      [](const void* data, size_t size) {
+        auto response = http_response_t::from_string(static_cast<const char*>(data), size);
+        if (response.code != 200)
+          throw std::runtime_error("Expected 200 response code!");
+        // the earlier tests went through this server, its proxy and its worker
+        std::string server = "{server=\"tcp://127.0.0.1:15701\",shard=\"0\"}";
+        std::string proxy = "{proxy=\"inproc://test_http_proxy_upstream\"";
+        for (const auto& expected :
+             {"prime_server_requests_total" + server, "prime_server_sessions" + server,
+              "prime_server_request_seconds_count" + server,
+              "prime_server_proxy_dispatched_total" + proxy + "}",
+              "prime_server_proxy_idle_workers" + proxy + "}",
+              "prime_server_worker_job_seconds" + proxy + ",worker="}) {
+          if (response.body.find(expected) == std::string::npos)
+            throw std::runtime_error("Expected " + expected + " in the metrics");
+        }
+        return false;
+      },
+      1);
+  client.batch();
+}
+
 void test_too_large() {
   zmq::context_t context;
   std::string request =
@@ -517,6 +1025,101 @@ void test_health_check() {
   // TODO: check that you're disconnected
 }
 
+void test_fragmented_parsing() {
+  // a few requests back to back with delimiters that look like they might be there but arent
+  const std::string stream =
+      "GET /a%20b?c=d&c=e HTTP/1.1\r\nHost: x\r\nX-Odd: \r\r\r\n\r\n"
+      "POST /post HTTP/1.0\r\nContent-Length: 11\r\n\r\nhi\r\nthere\r\r"
+      "PUT /chunk HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n3\r\nabc\r\n"
+      "10\r\n0123456789abcdef\r\n0\r\n\r\n"
+      "DELETE /" +
+      std::string(100, 'x') + " HTTP/1.1\r\nA: " + std::string(70, 'y') + "\r\n\r\n";
+
+  auto same = [](const std::list<http_request_t>& a, const std::list<http_request_t>& b) {
+    return a.size() == b.size() &&
+           std::equal(a.begin(), a.end(), b.begin(), [](const auto& x, const auto& y) {
+             return x.method == y.method && x.path == y.path && x.query == y.query &&
+                    x.version == y.version && x.headers == y.headers && x.body == y.body;
+           });
+  };
+
+  // every implementation should parse it the same no matter how its broken up, the last one that
+  // we select is the widest one so thats what is left in place afterwards
+  std::list<http_request_t> expected;
+  for (const auto* implementation : {"scalar", "sse2", "avx2"}) {
+    if (!simd::select(implementation))
+      continue;
+    http_request_t whole;
+    auto requests = whole.from_stream(stream.data(), stream.size());
+    if (requests.size() != 4 || requests.front().headers["X-Odd"] != "\r\r" ||
+        std::next(requests.begin())->body != "hi\r\nthere\r\r" ||
+        std::next(requests.begin(), 2)->body != "abc0123456789abcdef")
+      throw std::runtime_error(std::string("Bad parse with ") + implementation);
+    if (expected.empty())
+      expected = requests;
+    else if (!same(requests, expected))
+      throw std::runtime_error(std::string("Different parse with ") + implementation);
+
+    for (size_t split = 1; split < stream.size(); ++split) {
+      http_request_t pieces;
+      auto first = pieces.from_stream(stream.data(), split);
+      auto rest = pieces.from_stream(stream.data() + split, stream.size() - split);
+      first.splice(first.end(), rest);
+      if (!same(first, expected))
+        throw std::runtime_error(std::string("Different parse with ") + implementation +
+                                 " when split at " + std::to_string(split));
+    }
+  }
+}
+
+void test_framing_only() {
+  const std::string stream =
+      "GET /a%20b?c=d&c=e HTTP/1.1\r\nHost: x\r\nConnection: Close\r\nX-Timeout-Ms: 250\r\n\r\n"
+      "POST /post HTTP/1.0\r\nContent-Length: 11\r\nX-Other: y\r\n\r\nhi\r\nthere\r\r"
+      "PUT /chunk HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n3\r\nabc\r\n"
+      "10\r\n0123456789abcdef\r\n0\r\nTrailer: z\r\n\r\n"
+      "GET /health_check HTTP/1.1\r\n\r\n";
+  http_request_t parser;
+  auto expected = parser.from_stream(stream.data(), stream.size());
+
+  // no matter where it gets broken up, framing should find the same requests with the same bytes
+  for (size_t split = 1; split < stream.size(); ++split) {
+    http_request_t framer(true);
+    auto framed = framer.from_stream(stream.data(), split);
+    auto rest = framer.from_stream(stream.data() + split, stream.size() - split);
+    framed.splice(framed.end(), rest);
+    if (framed.size() != expected.size())
+      throw std::runtime_error("Framing found the wrong number of requests at " +
+                               std::to_string(split));
+
+    std::string jobs;
+    auto parsed = expected.cbegin();
+    for (const auto& request : framed) {
+      // just enough to know about keep-alive, deadlines and health checks
+      if (request.method != parsed->method || request.version != parsed->version ||
+          request.to_info(0).connection_close != parsed->to_info(0).connection_close ||
+          (request.to_info(0).deadline == 0) != (parsed->to_info(0).deadline == 0) ||
+          !request.body.empty() || !request.query.empty() ||
+          request.headers.find("X-Other") != request.headers.cend() ||
+          request.headers.find("Host") != request.headers.cend())
+        throw std::runtime_error("Framing kept the wrong things");
+
+      // and the worker can parse the rest of it
+      auto job = request.to_job();
+      jobs.append(static_cast<const char*>(job.data()), job.size());
+      auto worker = http_request_t::from_string(static_cast<const char*>(job.data()), job.size());
+      if (worker.path != parsed->path || worker.query != parsed->query ||
+          worker.headers != parsed->headers || worker.body != parsed->body)
+        throw std::runtime_error("Framed request did not parse the same on the worker");
+      ++parsed;
+    }
+    if (jobs != stream)
+      throw std::runtime_error("Framed requests should be the original bytes");
+    if (framed.back().path != "/health_check" || framed.front().path != "/a%20b")
+      throw std::runtime_error("Framing should leave the path alone but drop the query");
+  }
+}
+
 void test_chunked_encoding() {
   http_request_t req;
 
@@ -578,6 +1181,40 @@ void test_chunked_encoding() {
     throw std::logic_error("The chunked body was wrong");
 }
 
+void test_streamed_body() {
+  // the request goes as soon as the headers are in and the body follows in pieces
+  std::string body(100, 'b');
+  auto request_str = http_request_t::to_string(POST, "/upload", body) +
+                     http_request_t::to_string(GET, "/after");
+  http_request_t req;
+  std::list<http_request_t> reqs;
+  for (size_t i = 0; i < request_str.size(); i += 7) {
+    auto length = std::min(size_t(7), request_str.size() - i);
+    auto parsed = req.from_stream(request_str.c_str() + i, length, 100, 10);
+    reqs.splice(reqs.end(), parsed);
+  }
+  if (reqs.size() < 4 || reqs.front().part != REQUEST_START || reqs.front().path != "/upload" ||
+      reqs.back().part != WHOLE_REQUEST || reqs.back().path != "/after" ||
+      std::prev(reqs.end(), 2)->part != BODY_END)
+    throw std::logic_error("Streamed request should be a start, pieces, an end and then the next");
+  std::string streamed;
+  for (const auto& r : reqs)
+    if (r.part != WHOLE_REQUEST)
+      streamed += r.body;
+  if (streamed != body)
+    throw std::logic_error("The streamed body was wrong");
+
+  // chunked bodies stream once they get too big
+  req.flush_stream();
+  request_str = "POST /chunked HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n" +
+                http_response_t::chunk("small") + http_response_t::chunk(std::string(20, 'c')) +
+                http_response_t::chunk("");
+  reqs = req.from_stream(request_str.c_str(), request_str.size(), 100, 10);
+  if (reqs.size() != 2 || reqs.front().part != REQUEST_START ||
+      reqs.front().body != "small" + std::string(20, 'c') || reqs.back().part != BODY_END)
+    throw std::logic_error("Chunked body should have streamed once it got too big");
+}
+
 } // namespace
 
 int main() {
@@ -594,12 +1231,26 @@ int main() {
 
   suite.test(TEST_CASE(test_query_parsing));
 
+  suite.test(TEST_CASE(test_request_view));
+
+  suite.test(TEST_CASE(test_deadline));
+
+  suite.test(TEST_CASE(test_request_job));
+
   suite.test(TEST_CASE(test_response));
 
   suite.test(TEST_CASE(test_response_parsing));
 
+  suite.test(TEST_CASE(test_chunked_response));
+
   suite.test(TEST_CASE(test_chunked_encoding));
 
+  suite.test(TEST_CASE(test_streamed_body));
+
+  suite.test(TEST_CASE(test_fragmented_parsing));
+
+  suite.test(TEST_CASE(test_framing_only));
+
   suite.test(TEST_CASE(test_shortcircuit));
 
   // fail if it hangs
@@ -607,6 +1258,16 @@ int main() {
 
   suite.test(TEST_CASE(test_parallel_clients));
 
+  suite.test(TEST_CASE(test_sharded_clients));
+
+  suite.test(TEST_CASE(test_pipelined_order));
+
+  suite.test(TEST_CASE(test_streaming_response));
+
+  suite.test(TEST_CASE(test_streaming_request));
+
+  suite.test(TEST_CASE(test_slow_upload));
+
   suite.test(TEST_CASE(test_malformed));
 
   suite.test(TEST_CASE(test_too_large));
@@ -615,5 +1276,7 @@ int main() {
 
   suite.test(TEST_CASE(test_health_check));
 
+  suite.test(TEST_CASE(test_metrics));
+
   return suite.tear_down();
 }
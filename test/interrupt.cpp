@@ -2,6 +2,7 @@
 #include "prime_server.hpp"
 #include "testing/testing.hpp"
 
+#include <atomic>
 #include <condition_variable>
 #include <cstdlib>
 #include <cstring>
@@ -15,9 +16,22 @@
 using namespace prime_server;
 
 namespace {
-// use these to manipulate flow control
+// use these to manipulate flow control, each hand off bumps the step so waiting for one cant miss it
+// even if it happened before we started waiting
 std::mutex mutex;
 std::condition_variable condition;
+int step = 0;
+void hand_off() {
+  std::lock_guard<std::mutex> lock(mutex);
+  ++step;
+  condition.notify_all();
+}
+void wait_for(int target) {
+  std::unique_lock<std::mutex> lock(mutex);
+  condition.wait(lock, [target]() { return step >= target; });
+}
+// how many jobs a worker actually started
+std::atomic<int> calls(0);
 
 class testable_client_t : public netstring_client_t {
 public:
@@ -32,14 +46,14 @@ public:
 
 protected:
   virtual void handle_interrupt(bool force_check) override {
-    std::unique_lock<std::mutex> lock(mutex);
-    condition.notify_one();
-    condition.wait(lock);
+    // let the test know we got the job and wait for the client to hang up
+    hand_off();
+    wait_for(2);
     // I dont like doing this but... with pub sub delivery isnt gauranteed so its best to wait around
     std::this_thread::sleep_for(std::chrono::seconds(1));
     try {
       worker_t::handle_interrupt(force_check);
-    } catch (...) { condition.notify_one(); }
+    } catch (...) { hand_off(); }
   }
 };
 
@@ -50,6 +64,7 @@ busy_work(const std::list<zmq::message_t>&, void*, worker_t::interrupt_function_
 
 void test_early() {
   zmq::context_t context;
+  step = 0;
 
   // server
   std::thread server(std::bind(&netstring_server_t::serve,
@@ -88,15 +103,15 @@ void test_early() {
   client->batch();
 
   // wait for job, disconnect, wait for cancel
-  std::unique_lock<std::mutex> lock(mutex);
-  condition.wait(lock);
+  wait_for(1);
   delete client;
-  condition.notify_one();
-  condition.wait(lock);
+  hand_off();
+  wait_for(3);
 }
 
 void test_loop() {
   zmq::context_t context;
+  step = 0;
 
   // server
   std::thread server(std::bind(&netstring_server_t::serve,
@@ -135,20 +150,19 @@ void test_loop() {
                          "inproc://test_loop_results", "inproc://test_loop_interrupt",
                          [](const std::list<zmq::message_t>&, void*,
                             worker_t::interrupt_function_t& interrupt) -> worker_t::result_t {
-                           condition.notify_one();
+                           hand_off();
                            while (true) {
                              try {
                                interrupt();
-                             } catch (...) { condition.notify_one(); }
+                             } catch (...) { hand_off(); }
                            }
                          })));
   worker.detach();
 
   // wait for notify of working, send the cancel, wait for cancel
-  std::unique_lock<std::mutex> lock(mutex);
-  condition.wait(lock);
+  wait_for(1);
   delete client;
-  condition.wait(lock);
+  wait_for(2);
 }
 
 void test_timeout() {
@@ -192,6 +206,279 @@ void test_timeout() {
   client.batch();
 }
 
+void test_queued() {
+  zmq::context_t context;
+
+  // server
+  std::thread server(std::bind(&netstring_server_t::serve,
+                               netstring_server_t(context, "tcp://127.0.0.1:15710",
+                                                  "inproc://test_queued_proxy_upstream",
+                                                  "inproc://test_queued_results",
+                                                  "inproc://test_queued_interrupt", false,
+                                                  DEFAULT_MAX_REQUEST_SIZE, 1)));
+  server.detach();
+
+  // load balancer
+  std::thread proxy(
+      std::bind(&proxy_t::forward, proxy_t(context, "inproc://test_queued_proxy_upstream",
+                                           "inproc://test_queued_proxy_downstream")));
+  proxy.detach();
+
+  // slow worker that takes all the jobs up front so that they all time out while it has them
+  std::thread worker(
+      std::bind(&worker_t::work,
+                worker_t(context, "inproc://test_queued_proxy_downstream", "inproc://dev_null",
+                         "inproc://test_queued_results", "inproc://test_queued_interrupt",
+                         [](const std::list<zmq::message_t>&, void*,
+                            worker_t::interrupt_function_t&) -> worker_t::result_t {
+                           ++calls;
+                           std::this_thread::sleep_for(std::chrono::seconds(3));
+                           return {false, {"too late"}, ""};
+                         },
+                         {}, "", 4)));
+  worker.detach();
+
+  std::string request = netstring_entity_t::to_string("wart uf mi");
+  int responses = 0;
+  testable_client_t client(
+      context, "tcp://127.0.0.1:15710",
+      [&request]() {
+        return std::make_pair(static_cast<const void*>(request.c_str()), request.size());
+      },
+      [&responses](const void* data, size_t size) {
+        auto response = netstring_entity_t::from_string(static_cast<const char*>(data), size);
+        if (response.body.substr(0, 7) != "TIMEOUT")
+          throw std::runtime_error("Expected TIMEOUT response!");
+        return ++responses < 3;
+      },
+      3);
+  client.batch();
+
+  // the worker should only have started the first one, the ones it queued behind it were cancelled
+  std::this_thread::sleep_for(std::chrono::seconds(4));
+  if (calls != 1)
+    throw std::runtime_error("Expected queued jobs to be dropped but " + std::to_string(calls) +
+                             " were worked");
+}
+
+void test_expired() {
+  zmq::context_t context;
+  calls = 0;
+
+  // server
+  std::thread server(std::bind(&netstring_server_t::serve,
+                               netstring_server_t(context, "tcp://127.0.0.1:15716",
+                                                  "inproc://test_expired_proxy_upstream",
+                                                  "inproc://test_expired_results",
+                                                  "inproc://test_expired_interrupt", false,
+                                                  DEFAULT_MAX_REQUEST_SIZE, 1)));
+  server.detach();
+
+  // load balancer
+  std::thread proxy(
+      std::bind(&proxy_t::forward, proxy_t(context, "inproc://test_expired_proxy_upstream",
+                                           "inproc://test_expired_proxy_downstream")));
+  proxy.detach();
+
+  // slow worker that only takes one job at a time so the others wait in the proxy
+  std::thread worker(
+      std::bind(&worker_t::work,
+                worker_t(context, "inproc://test_expired_proxy_downstream", "inproc://dev_null",
+                         "inproc://test_expired_results", "inproc://test_expired_interrupt",
+                         [](const std::list<zmq::message_t>&, void*,
+                            worker_t::interrupt_function_t&) -> worker_t::result_t {
+                           ++calls;
+                           std::this_thread::sleep_for(std::chrono::seconds(3));
+                           return {false, {"too late"}, ""};
+                         })));
+  worker.detach();
+
+  std::string request = netstring_entity_t::to_string("wart uf mi");
+  int responses = 0;
+  testable_client_t client(
+      context, "tcp://127.0.0.1:15716",
+      [&request]() {
+        return std::make_pair(static_cast<const void*>(request.c_str()), request.size());
+      },
+      [&responses](const void* data, size_t size) {
+        auto response = netstring_entity_t::from_string(static_cast<const char*>(data), size);
+        if (response.body.substr(0, 7) != "TIMEOUT")
+          throw std::runtime_error("Expected TIMEOUT response!");
+        return ++responses < 3;
+      },
+      3);
+  client.batch();
+
+  // by the time the worker was free the other jobs were past their deadline so the proxy dropped them
+  std::this_thread::sleep_for(std::chrono::seconds(4));
+  if (calls != 1)
+    throw std::runtime_error("Expected expired jobs to be dropped but " + std::to_string(calls) +
+                             " were worked");
+}
+
+void test_cancelled() {
+  zmq::context_t context;
+  calls = 0;
+
+  // server
+  std::thread server(std::bind(&netstring_server_t::serve,
+                               netstring_server_t(context, "tcp://127.0.0.1:15717",
+                                                  "inproc://test_cancelled_proxy_upstream",
+                                                  "inproc://test_cancelled_results",
+                                                  "inproc://test_cancelled_interrupt")));
+  server.detach();
+
+  // load balancer that listens for interrupts
+  std::thread proxy(std::bind(&proxy_t::forward,
+                              proxy_t(context, "inproc://test_cancelled_proxy_upstream",
+                                      "inproc://test_cancelled_proxy_downstream", {},
+                                      DEFAULT_BATCH_SIZE, DEFAULT_BATCH_WAIT, DEFAULT_WORKER_EXPIRY,
+                                      FIFO, {}, DEFAULT_AFFINITY_WAIT,
+                                      "inproc://test_cancelled_interrupt")));
+  proxy.detach();
+
+  // slow worker that only takes one job at a time so the others wait in the proxy
+  std::thread worker(
+      std::bind(&worker_t::work,
+                worker_t(context, "inproc://test_cancelled_proxy_downstream", "inproc://dev_null",
+                         "inproc://test_cancelled_results", "inproc://test_cancelled_interrupt",
+                         [](const std::list<zmq::message_t>&, void*,
+                            worker_t::interrupt_function_t&) -> worker_t::result_t {
+                           ++calls;
+                           std::this_thread::sleep_for(std::chrono::seconds(3));
+                           return {false, {"nobody is listening"}, ""};
+                         })));
+  worker.detach();
+
+  // a plain stream socket so we can hang up by closing it while the jobs are still waiting
+  {
+    zmq::socket_t client(context, ZMQ_STREAM);
+    client.connect("tcp://127.0.0.1:15717");
+    auto connection = client.recv_all(0);
+    std::string request = netstring_entity_t::to_string("wart uf mi");
+    client.send(connection.front(), ZMQ_SNDMORE);
+    client.send(request + request + request, 0);
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  }
+
+  // the client went away before the worker was free so the proxy dropped the other jobs
+  std::this_thread::sleep_for(std::chrono::seconds(4));
+  if (calls != 1)
+    throw std::runtime_error("Expected interrupted jobs to be dropped but " + std::to_string(calls) +
+                             " were worked");
+}
+
+void test_late_subscriber() {
+  zmq::context_t context;
+  calls = 0;
+
+  // server
+  std::thread server(std::bind(&netstring_server_t::serve,
+                               netstring_server_t(context, "tcp://127.0.0.1:15722",
+                                                  "inproc://test_late_proxy_upstream",
+                                                  "inproc://test_late_results",
+                                                  "inproc://test_late_interrupt")));
+  server.detach();
+
+  // load balancer that doesnt listen for interrupts so it hands out jobs whose clients are gone
+  std::thread proxy(std::bind(&proxy_t::forward,
+                              proxy_t(context, "inproc://test_late_proxy_upstream",
+                                      "inproc://test_late_proxy_downstream")));
+  proxy.detach();
+
+  // slow worker that only takes one job at a time so it gets the others long after they were
+  // interrupted, it only counts the jobs it finishes
+  std::thread worker(
+      std::bind(&worker_t::work,
+                worker_t(context, "inproc://test_late_proxy_downstream", "inproc://dev_null",
+                         "inproc://test_late_results", "inproc://test_late_interrupt",
+                         [](const std::list<zmq::message_t>&, void*,
+                            worker_t::interrupt_function_t& interrupt) -> worker_t::result_t {
+                           for (int i = 0; i < 20; ++i) {
+                             std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                             interrupt();
+                           }
+                           ++calls;
+                           return {false, {"nobody is listening"}, ""};
+                         })));
+  worker.detach();
+
+  // hang up while the first job is being worked on and the others wait in the proxy
+  {
+    zmq::socket_t client(context, ZMQ_STREAM);
+    client.connect("tcp://127.0.0.1:15722");
+    auto connection = client.recv_all(0);
+    std::string request = netstring_entity_t::to_string("wart uf mi");
+    client.send(connection.front(), ZMQ_SNDMORE);
+    client.send(request + request + request, 0);
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  }
+
+  // the worker subscribed to the others after their interrupts went out, it should hear them anyway
+  std::this_thread::sleep_for(std::chrono::seconds(5));
+  if (calls != 0)
+    throw std::runtime_error("Expected every interrupted job to be cut short but " +
+                             std::to_string(calls) + " were finished");
+}
+
+void test_deadline_loop() {
+  zmq::context_t context;
+  calls = 0;
+
+  // server that gives up on requests after a second
+  std::thread server(std::bind(&netstring_server_t::serve,
+                               netstring_server_t(context, "tcp://127.0.0.1:15718",
+                                                  "inproc://test_deadline_loop_proxy_upstream",
+                                                  "inproc://test_deadline_loop_results",
+                                                  "inproc://test_deadline_loop_interrupt", false,
+                                                  DEFAULT_MAX_REQUEST_SIZE, 1)));
+  server.detach();
+
+  // load balancer
+  std::thread proxy(
+      std::bind(&proxy_t::forward, proxy_t(context, "inproc://test_deadline_loop_proxy_upstream",
+                                           "inproc://test_deadline_loop_proxy_downstream")));
+  proxy.detach();
+
+  // worker that spins on checking for interrupts, it only stops once its past the deadline
+  std::thread worker(
+      std::bind(&worker_t::work,
+                worker_t(context, "inproc://test_deadline_loop_proxy_downstream",
+                         "inproc://dev_null", "inproc://test_deadline_loop_results",
+                         "inproc://test_deadline_loop_interrupt",
+                         [](const std::list<zmq::message_t>&, void*,
+                            worker_t::interrupt_function_t& interrupt) -> worker_t::result_t {
+                           try {
+                             while (true)
+                               interrupt();
+                           } catch (...) {
+                             ++calls;
+                             throw;
+                           }
+                         })));
+  worker.detach();
+
+  std::string request = netstring_entity_t::to_string("hoer uf");
+  testable_client_t client(
+      context, "tcp://127.0.0.1:15718",
+      [&request]() {
+        return std::make_pair(static_cast<const void*>(request.c_str()), request.size());
+      },
+      [](const void* data, size_t size) {
+        auto response = netstring_entity_t::from_string(static_cast<const char*>(data), size);
+        if (response.body.substr(0, 7) != "TIMEOUT")
+          throw std::runtime_error("Expected TIMEOUT response!");
+        return false;
+      },
+      1);
+  client.batch();
+
+  // the listener flags the job when its deadline passes so the loop doesnt spin forever
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  if (calls != 1)
+    throw std::runtime_error("Expected the work function to bail at its deadline");
+}
+
 } // namespace
 
 int main() {
@@ -206,5 +493,15 @@ int main() {
 
   suite.test(TEST_CASE(test_timeout));
 
+  suite.test(TEST_CASE(test_queued));
+
+  suite.test(TEST_CASE(test_expired));
+
+  suite.test(TEST_CASE(test_cancelled));
+
+  suite.test(TEST_CASE(test_late_subscriber));
+
+  suite.test(TEST_CASE(test_deadline_loop));
+
   return suite.tear_down();
 }
@@ -0,0 +1,104 @@
+#include "metrics.hpp"
+#include "testing/testing.hpp"
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace prime_server::metrics;
+
+namespace {
+
+void test_counters() {
+  auto& registry = registry_t::get();
+  auto& counter = registry.counter("test_things_total", "Things", label("kind", "a"));
+  // asking again gets you the same one
+  if (&counter != &registry.counter("test_things_total", "Things", label("kind", "a")))
+    throw std::runtime_error("Same name and labels should be the same counter");
+  if (&counter == &registry.counter("test_things_total", "Things", label("kind", "b")))
+    throw std::runtime_error("Different labels should be a different counter");
+
+  // lots of threads adding at once dont lose any
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; ++i)
+    threads.emplace_back([&counter]() {
+      for (int j = 0; j < 10000; ++j)
+        counter.increment();
+    });
+  for (auto& thread : threads)
+    thread.join();
+  if (counter.get() != 40000)
+    throw std::runtime_error("Expected 40000 but got " + std::to_string(counter.get()));
+
+  auto& gauge = registry.gauge("test_level", "Level");
+  gauge.set(5);
+  gauge.add(-7);
+  if (gauge.get() != -2)
+    throw std::runtime_error("Gauge should be able to go negative");
+}
+
+void test_histogram() {
+  histogram_t histogram;
+  if (histogram.quantile(.5) != 0 || histogram.count() != 0)
+    throw std::runtime_error("Empty histogram should have nothing in it");
+
+  // small values are exact
+  for (uint64_t i = 1; i <= 10; ++i)
+    histogram.record(i);
+  if (histogram.quantile(.5) != 5 || histogram.quantile(1) != 10 || histogram.quantile(0) != 1)
+    throw std::runtime_error("Small values should be recorded exactly");
+  if (histogram.count() != 10 || histogram.sum() != 55)
+    throw std::runtime_error("Wrong count or sum");
+
+  // big ones are within a sixteenth
+  histogram_t big;
+  for (uint64_t value : {uint64_t(1000), uint64_t(123456789), uint64_t(0xFFFFFFFFFFFFFFFF)}) {
+    big.record(value);
+    auto highest = big.quantile(1);
+    if (highest < value || highest - value > value / 16)
+      throw std::runtime_error("Value " + std::to_string(value) + " came back as " +
+                               std::to_string(highest));
+  }
+
+  // the tail shows up in the upper quantiles
+  histogram_t tail;
+  for (int i = 0; i < 990; ++i)
+    tail.record(100);
+  for (int i = 0; i < 10; ++i)
+    tail.record(100000);
+  if (tail.quantile(.5) > 106 || tail.quantile(.99) > 106 || tail.quantile(.999) < 100000)
+    throw std::runtime_error("Quantiles dont reflect the tail");
+}
+
+void test_scrape() {
+  auto& registry = registry_t::get();
+  registry.counter("test_scraped_total", "Scraped things", label("path", "a\"b")).increment(3);
+  registry.histogram("test_latency_seconds", "Latency").record(1500);
+  auto scraped = registry.scrape();
+  for (const auto& expected :
+       {std::string("# TYPE test_scraped_total counter\n"),
+        std::string("test_scraped_total{path=\"a\\\"b\"} 3\n"),
+        std::string("# TYPE test_latency_seconds summary\n"),
+        std::string("test_latency_seconds{quantile=\"0.5\"} 0.001535\n"),
+        std::string("test_latency_seconds_sum 0.001500\n"),
+        std::string("test_latency_seconds_count 1\n")}) {
+    if (scraped.find(expected) == std::string::npos)
+      throw std::runtime_error("Scrape is missing: " + expected + scraped);
+  }
+}
+
+} // namespace
+
+int main() {
+  testing::suite suite("metrics");
+
+  suite.test(TEST_CASE(test_counters));
+
+  suite.test(TEST_CASE(test_histogram));
+
+  suite.test(TEST_CASE(test_scrape));
+
+  return suite.tear_down();
+}
@@ -2,13 +2,16 @@
 #include "prime_server.hpp"
 #include "testing/testing.hpp"
 
+#include <chrono>
 #include <cstdlib>
 #include <cstring>
 #include <functional>
 #include <iterator>
 #include <memory>
+#include <sstream>
 #include <thread>
 #include <unordered_set>
+#include <vector>
 
 using namespace prime_server;
 
@@ -55,6 +58,18 @@ void netstring_client_work(zmq::context_t& context,
   client.batch();
 }
 
+// what all of the workers behind a proxy added up to for one of the metrics it keeps on each
+int64_t worker_total(const std::string& name, const std::string& upstream_endpoint) {
+  std::istringstream scraped(metrics::registry_t::get().scrape());
+  auto prefix = name + "{" + metrics::label("proxy", upstream_endpoint) + ",";
+  int64_t total = 0;
+  for (std::string line; std::getline(scraped, line);) {
+    if (line.compare(0, prefix.size(), prefix) == 0)
+      total += std::stoll(line.substr(line.rfind(' ') + 1));
+  }
+  return total;
+}
+
 void test_unshaped() {
   zmq::context_t context;
 
@@ -178,6 +193,596 @@ void test_shaped() {
                            std::to_string(as) + " and B had " + std::to_string(bs));
 }
 
+void test_lifo() {
+  zmq::context_t context;
+
+  // server
+  std::thread server(std::bind(&netstring_server_t::serve,
+                               netstring_server_t(context, "tcp://127.0.0.1:15713",
+                                                  "inproc://test_lifo_proxy_upstream",
+                                                  "inproc://test_lifo_results",
+                                                  "inproc://test_lifo_interrupt", false)));
+  server.detach();
+
+  // load balancer that sends jobs to whichever worker became available last
+  std::thread proxy(std::bind(&proxy_t::forward,
+                              testable_proxy_t(context, "inproc://test_lifo_proxy_upstream",
+                                               "inproc://test_lifo_proxy_downstream", {},
+                                               DEFAULT_BATCH_SIZE, DEFAULT_BATCH_WAIT,
+                                               DEFAULT_WORKER_EXPIRY, LIFO)));
+  proxy.detach();
+
+  // a or b workers
+  for (const auto& response : {std::string("A"), std::string("B")}) {
+    std::thread worker(
+        std::bind(&worker_t::work,
+                  worker_t(
+                      context, "inproc://test_lifo_proxy_downstream", "inproc://dev_null",
+                      "inproc://test_lifo_results", "inproc://test_lifo_interrupt",
+                      [response](const std::list<zmq::message_t>&, void*,
+                                 worker_t::interrupt_function_t&) {
+                        worker_t::result_t result{false,
+                                                  {netstring_entity_t::to_string(response)},
+                                                  response};
+                        return result;
+                      },
+                      []() {}, response)));
+    worker.detach();
+  }
+
+  // one request at a time means whoever did the last one is always the last to become available
+  std::list<std::string> responses;
+  std::thread client(std::bind(&netstring_client_work, std::ref(context), "A", std::ref(responses),
+                               "tcp://127.0.0.1:15713", 1000, 1));
+  client.join();
+  size_t as = 0;
+  size_t bs = 0;
+  for (const auto& response : responses) {
+    as += response == "A";
+    bs += response == "B";
+  }
+  if (as != 0 && bs != 0)
+    throw std::logic_error("One worker should have done all the work but A had " +
+                           std::to_string(as) + " and B had " + std::to_string(bs));
+}
+
+void test_round_robin() {
+  zmq::context_t context;
+
+  // server
+  std::thread server(std::bind(&netstring_server_t::serve,
+                               netstring_server_t(context, "tcp://127.0.0.1:15723",
+                                                  "inproc://test_round_robin_proxy_upstream",
+                                                  "inproc://test_round_robin_results",
+                                                  "inproc://test_round_robin_interrupt", false)));
+  server.detach();
+
+  // load balancer that sends jobs to each worker in turn
+  std::thread proxy(std::bind(&proxy_t::forward,
+                              testable_proxy_t(context, "inproc://test_round_robin_proxy_upstream",
+                                               "inproc://test_round_robin_proxy_downstream", {},
+                                               DEFAULT_BATCH_SIZE, DEFAULT_BATCH_WAIT,
+                                               DEFAULT_WORKER_EXPIRY, ROUND_ROBIN)));
+  proxy.detach();
+
+  // a or b workers that take lots of jobs ahead so neither ever runs out of credits
+  for (const auto& response : {std::string("A"), std::string("B")}) {
+    std::thread worker(
+        std::bind(&worker_t::work,
+                  worker_t(
+                      context, "inproc://test_round_robin_proxy_downstream", "inproc://dev_null",
+                      "inproc://test_round_robin_results", "inproc://test_round_robin_interrupt",
+                      [response](const std::list<zmq::message_t>&, void*,
+                                 worker_t::interrupt_function_t&) {
+                        worker_t::result_t result{false,
+                                                  {netstring_entity_t::to_string(response)},
+                                                  response};
+                        return result;
+                      },
+                      []() {}, response, 100)));
+    worker.detach();
+  }
+
+  // several requests at a time and since nobody leaves the turn order they split exactly in half
+  std::list<std::string> responses;
+  std::thread client(std::bind(&netstring_client_work, std::ref(context), "A", std::ref(responses),
+                               "tcp://127.0.0.1:15723", 1000, 10));
+  client.join();
+  size_t as = 0;
+  size_t bs = 0;
+  for (const auto& response : responses) {
+    as += response == "A";
+    bs += response == "B";
+  }
+  if (as != 500 || bs != 500)
+    throw std::logic_error("Workers should have taken turns but A had " + std::to_string(as) +
+                           " and B had " + std::to_string(bs));
+}
+
+void test_random() {
+  zmq::context_t context;
+
+  // server
+  std::thread server(std::bind(&netstring_server_t::serve,
+                               netstring_server_t(context, "tcp://127.0.0.1:15724",
+                                                  "inproc://test_random_proxy_upstream",
+                                                  "inproc://test_random_results",
+                                                  "inproc://test_random_interrupt", false)));
+  server.detach();
+
+  // load balancer that sends jobs to any worker with credits
+  std::thread proxy(std::bind(&proxy_t::forward,
+                              testable_proxy_t(context, "inproc://test_random_proxy_upstream",
+                                               "inproc://test_random_proxy_downstream", {},
+                                               DEFAULT_BATCH_SIZE, DEFAULT_BATCH_WAIT,
+                                               DEFAULT_WORKER_EXPIRY, RANDOM)));
+  proxy.detach();
+
+  // a or b workers that take lots of jobs ahead so neither ever runs out of credits
+  for (const auto& response : {std::string("A"), std::string("B")}) {
+    std::thread worker(
+        std::bind(&worker_t::work,
+                  worker_t(
+                      context, "inproc://test_random_proxy_downstream", "inproc://dev_null",
+                      "inproc://test_random_results", "inproc://test_random_interrupt",
+                      [response](const std::list<zmq::message_t>&, void*,
+                                 worker_t::interrupt_function_t&) {
+                        worker_t::result_t result{false,
+                                                  {netstring_entity_t::to_string(response)},
+                                                  response};
+                        return result;
+                      },
+                      []() {}, response, 100)));
+    worker.detach();
+  }
+
+  // several requests at a time, over this many both should get a fair share
+  std::list<std::string> responses;
+  std::thread client(std::bind(&netstring_client_work, std::ref(context), "A", std::ref(responses),
+                               "tcp://127.0.0.1:15724", 1000, 10));
+  client.join();
+  size_t as = 0;
+  size_t bs = 0;
+  for (const auto& response : responses) {
+    as += response == "A";
+    bs += response == "B";
+  }
+  if (as < 400 || bs < 400)
+    throw std::logic_error("Both workers should have gotten a fair share but A had " +
+                           std::to_string(as) + " and B had " + std::to_string(bs));
+}
+
+void test_best_of_two() {
+  zmq::context_t context;
+
+  // server
+  std::thread server(std::bind(&netstring_server_t::serve,
+                               netstring_server_t(context, "tcp://127.0.0.1:15714",
+                                                  "inproc://test_best_proxy_upstream",
+                                                  "inproc://test_best_results",
+                                                  "inproc://test_best_interrupt", false)));
+  server.detach();
+
+  // load balancer that favors whichever worker has been faster
+  std::thread proxy(std::bind(&proxy_t::forward,
+                              testable_proxy_t(context, "inproc://test_best_proxy_upstream",
+                                               "inproc://test_best_proxy_downstream", {},
+                                               DEFAULT_BATCH_SIZE, DEFAULT_BATCH_WAIT,
+                                               DEFAULT_WORKER_EXPIRY, BEST_OF_TWO)));
+  proxy.detach();
+
+  // a fast worker and a slow one
+  for (const auto& response : {std::string("F"), std::string("S")}) {
+    std::thread worker(
+        std::bind(&worker_t::work,
+                  worker_t(
+                      context, "inproc://test_best_proxy_downstream", "inproc://dev_null",
+                      "inproc://test_best_results", "inproc://test_best_interrupt",
+                      [response](const std::list<zmq::message_t>&, void*,
+                                 worker_t::interrupt_function_t&) {
+                        if (response == "S")
+                          std::this_thread::sleep_for(std::chrono::milliseconds(20));
+                        worker_t::result_t result{false,
+                                                  {netstring_entity_t::to_string(response)},
+                                                  response};
+                        return result;
+                      },
+                      []() {}, response)));
+    worker.detach();
+  }
+
+  // with only two workers both are always the choices so once each has done a job the slow one
+  // shouldnt get any more
+  std::list<std::string> responses;
+  std::thread client(std::bind(&netstring_client_work, std::ref(context), "A", std::ref(responses),
+                               "tcp://127.0.0.1:15714", 200, 1));
+  client.join();
+  size_t slow = 0;
+  for (const auto& response : responses)
+    slow += response == "S";
+  if (slow > 2)
+    throw std::logic_error("The slow worker should have only gotten a job or two but got " +
+                           std::to_string(slow));
+
+  // once the workers check in after their last jobs the proxy knows they finished every one
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  auto finished =
+      worker_total("prime_server_proxy_worker_jobs_total", "inproc://test_best_proxy_upstream");
+  auto outstanding =
+      worker_total("prime_server_proxy_worker_outstanding", "inproc://test_best_proxy_upstream");
+  if (finished != 200 || outstanding != 0)
+    throw std::logic_error("Expected 200 finished and none outstanding but got " +
+                           std::to_string(finished) + " and " + std::to_string(outstanding));
+}
+
+void test_affinity() {
+  zmq::context_t context;
+
+  // server
+  std::thread server(std::bind(&netstring_server_t::serve,
+                               netstring_server_t(context, "tcp://127.0.0.1:15715",
+                                                  "inproc://test_affinity_proxy_upstream",
+                                                  "inproc://test_affinity_results",
+                                                  "inproc://test_affinity_interrupt", false)));
+  server.detach();
+
+  // load balancer that sends jobs with the same body to the same worker
+  std::thread proxy(
+      std::bind(&proxy_t::forward,
+                testable_proxy_t(context, "inproc://test_affinity_proxy_upstream",
+                                 "inproc://test_affinity_proxy_downstream", {}, DEFAULT_BATCH_SIZE,
+                                 DEFAULT_BATCH_WAIT, DEFAULT_WORKER_EXPIRY, FIFO,
+                                 [](const std::list<zmq::message_t>& job) {
+                                   return std::string(static_cast<const char*>(job.front().data()),
+                                                      job.front().size());
+                                 })));
+  proxy.detach();
+
+  // a or b workers
+  for (const auto& response : {std::string("A"), std::string("B")}) {
+    std::thread worker(
+        std::bind(&worker_t::work,
+                  worker_t(
+                      context, "inproc://test_affinity_proxy_downstream", "inproc://dev_null",
+                      "inproc://test_affinity_results", "inproc://test_affinity_interrupt",
+                      [response](const std::list<zmq::message_t>&, void*,
+                                 worker_t::interrupt_function_t&) {
+                        worker_t::result_t result{false,
+                                                  {netstring_entity_t::to_string(response)},
+                                                  response};
+                        return result;
+                      },
+                      []() {}, response)));
+    worker.detach();
+  }
+
+  // every request is the same so they should all land on the same worker even though fifo would
+  // have them bounce back and forth
+  std::list<std::string> responses;
+  std::thread client(std::bind(&netstring_client_work, std::ref(context), "A", std::ref(responses),
+                               "tcp://127.0.0.1:15715", 1000, 1));
+  client.join();
+  size_t as = 0;
+  size_t bs = 0;
+  for (const auto& response : responses) {
+    as += response == "A";
+    bs += response == "B";
+  }
+  if (as != 0 && bs != 0)
+    throw std::logic_error("One worker should have done all the work but A had " +
+                           std::to_string(as) + " and B had " + std::to_string(bs));
+}
+
+void test_batched() {
+  zmq::context_t context;
+
+  // server
+  std::thread server(std::bind(&netstring_server_t::serve,
+                               netstring_server_t(context, "tcp://127.0.0.1:15711",
+                                                  "inproc://test_batched_proxy_upstream",
+                                                  "inproc://test_batched_results",
+                                                  "inproc://test_batched_interrupt", false)));
+  server.detach();
+
+  // load balancer that holds on to jobs for a bit to fill batches of 4
+  std::thread proxy(std::bind(&proxy_t::forward,
+                              proxy_t(context, "inproc://test_batched_proxy_upstream",
+                                      "inproc://test_batched_proxy_downstream", {}, 4, 100000)));
+  proxy.detach();
+
+  // worker that answers each job with how big the batch was that it came in
+  std::thread worker(std::bind(
+      &worker_t::work,
+      worker_t(context, "inproc://test_batched_proxy_downstream", "inproc://dev_null",
+               "inproc://test_batched_results", "inproc://test_batched_interrupt",
+               [](std::list<worker_t::job_t>& jobs, worker_t::interrupt_function_t&) {
+                 std::list<worker_t::result_t> results;
+                 for (size_t i = 0; i < jobs.size(); ++i)
+                   results.push_back(
+                       {false, {netstring_entity_t::to_string(std::to_string(jobs.size()))}, ""});
+                 return results;
+               },
+               4)));
+  worker.detach();
+
+  // a client that sends 4 requests at a time should mostly get them worked on together
+  std::list<std::string> responses;
+  std::thread client(std::bind(&netstring_client_work, std::ref(context), "A", std::ref(responses),
+                               "tcp://127.0.0.1:15711", 400, 4));
+  client.join();
+  size_t full = 0;
+  for (const auto& response : responses) {
+    if (response < "1" || response > "4")
+      throw std::logic_error("Batches should have been between 1 and 4 jobs but got " + response);
+    full += response == "4";
+  }
+  if (full == 0)
+    throw std::logic_error("Expected at least some full batches");
+}
+
+void test_dead_worker() {
+  zmq::context_t context;
+
+  // server
+  std::thread server(std::bind(&netstring_server_t::serve,
+                               netstring_server_t(context, "tcp://127.0.0.1:15712",
+                                                  "inproc://test_dead_proxy_upstream",
+                                                  "inproc://test_dead_results",
+                                                  "inproc://test_dead_interrupt", false)));
+  server.detach();
+
+  // load balancer
+  std::thread proxy(std::bind(&proxy_t::forward,
+                              proxy_t(context, "inproc://test_dead_proxy_upstream",
+                                      "inproc://test_dead_proxy_downstream")));
+  proxy.detach();
+
+  // a worker that says its ready for lots of work and then dies before it gets any
+  {
+    zmq::socket_t dead(context, ZMQ_DEALER);
+    dead.connect("inproc://test_dead_proxy_downstream");
+    uint32_t credits = 100;
+    dead.send(static_cast<const void*>("D"), 1, ZMQ_SNDMORE);
+    dead.send(static_cast<const void*>(&credits), sizeof(credits), 0);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  // a worker that is still alive behind it in line
+  std::thread worker(
+      std::bind(&worker_t::work,
+                worker_t(context, "inproc://test_dead_proxy_downstream", "inproc://dev_null",
+                         "inproc://test_dead_results", "inproc://test_dead_interrupt",
+                         [](const std::list<zmq::message_t>&, void*,
+                            worker_t::interrupt_function_t&) {
+                           worker_t::result_t result{false, {netstring_entity_t::to_string("A")},
+                                                     "A"};
+                           return result;
+                         })));
+  worker.detach();
+
+  // if the jobs went to the dead worker we would never hear back
+  std::list<std::string> responses;
+  std::thread client(std::bind(&netstring_client_work, std::ref(context), "A", std::ref(responses),
+                               "tcp://127.0.0.1:15712", 10, 1));
+  client.join();
+  for (const auto& response : responses) {
+    if (response != "A")
+      throw std::logic_error("Expected every response to come from the live worker");
+  }
+}
+
+void test_busy_worker() {
+  zmq::context_t context;
+
+  // server
+  std::thread server(std::bind(&netstring_server_t::serve,
+                               netstring_server_t(context, "tcp://127.0.0.1:15721",
+                                                  "inproc://test_busy_proxy_upstream",
+                                                  "inproc://test_busy_results",
+                                                  "inproc://test_busy_interrupt", false)));
+  server.detach();
+
+  // load balancer that sends jobs by their body, waits a long time for a jobs own worker and gives
+  // up on workers it hasnt heard from in a few seconds
+  std::thread proxy(
+      std::bind(&proxy_t::forward,
+                proxy_t(context, "inproc://test_busy_proxy_upstream",
+                        "inproc://test_busy_proxy_downstream", {}, DEFAULT_BATCH_SIZE,
+                        DEFAULT_BATCH_WAIT, 3, FIFO,
+                        [](const std::list<zmq::message_t>& job) {
+                          return std::string(static_cast<const char*>(job.front().data()),
+                                             job.front().size());
+                        },
+                        10000000)));
+  proxy.detach();
+
+  // workers that take two jobs at a time and spend longer than that on each, checking in as they go
+  auto work = [](const std::string& name) {
+    return [name](const std::list<zmq::message_t>&, void*,
+                  worker_t::interrupt_function_t& interrupt) {
+      for (int i = 0; i < 110; ++i) {
+        interrupt();
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      }
+      worker_t::result_t result{false, {netstring_entity_t::to_string(name)}, name};
+      return result;
+    };
+  };
+  std::thread a(std::bind(&worker_t::work,
+                          worker_t(context, "inproc://test_busy_proxy_downstream",
+                                   "inproc://dev_null", "inproc://test_busy_results",
+                                   "inproc://test_busy_interrupt", work("A"), {}, "", 2)));
+  a.detach();
+  std::thread b(std::bind(&worker_t::work,
+                          worker_t(context, "inproc://test_busy_proxy_downstream",
+                                   "inproc://dev_null", "inproc://test_busy_results",
+                                   "inproc://test_busy_interrupt", work("B"), {}, "", 2)));
+  b.detach();
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+  // the second job for the same key shows up after the first has been worked on for longer than the
+  // expiry, its worker still has a credit to spare and has been checking in so its still its job
+  std::list<std::string> first, second;
+  std::thread early(std::bind(&netstring_client_work, std::ref(context), "key", std::ref(first),
+                              "tcp://127.0.0.1:15721", 1, 1));
+  std::this_thread::sleep_for(std::chrono::milliseconds(4500));
+  std::thread late(std::bind(&netstring_client_work, std::ref(context), "key", std::ref(second),
+                             "tcp://127.0.0.1:15721", 1, 1));
+  early.join();
+  late.join();
+  if (first.size() != 1 || second.size() != 1 || first.front() != second.front())
+    throw std::logic_error("Both jobs should have gone to the same busy worker");
+}
+
+void test_dead_affinity() {
+  zmq::context_t context;
+
+  // server
+  std::thread server(std::bind(&netstring_server_t::serve,
+                               netstring_server_t(context, "tcp://127.0.0.1:15720",
+                                                  "inproc://test_dead_affinity_proxy_upstream",
+                                                  "inproc://test_dead_affinity_results",
+                                                  "inproc://test_dead_affinity_interrupt", false)));
+  server.detach();
+
+  // load balancer that sends jobs by their body, waits a long time for a jobs own worker and gives
+  // up on workers it hasnt heard from in a second
+  std::thread proxy(
+      std::bind(&proxy_t::forward,
+                proxy_t(context, "inproc://test_dead_affinity_proxy_upstream",
+                        "inproc://test_dead_affinity_proxy_downstream", {}, DEFAULT_BATCH_SIZE,
+                        DEFAULT_BATCH_WAIT, 1, FIFO,
+                        [](const std::list<zmq::message_t>& job) {
+                          return std::string(static_cast<const char*>(job.front().data()),
+                                             job.front().size());
+                        },
+                        10000000)));
+  proxy.detach();
+
+  // a worker that takes a job and dies while its working on it, it has places on the ring that a lot
+  // of keys would go to if it stayed there
+  {
+    zmq::socket_t dead(context, ZMQ_DEALER);
+    dead.connect("inproc://test_dead_affinity_proxy_downstream");
+    uint32_t credits = 1;
+    dead.send(static_cast<const void*>("D"), 1, ZMQ_SNDMORE);
+    dead.send(static_cast<const void*>(&credits), sizeof(credits), 0);
+    zmq::socket_t upstream(context, ZMQ_DEALER);
+    upstream.connect("inproc://test_dead_affinity_proxy_upstream");
+    netstring_request_info_t info{1, static_cast<uint32_t>(time(nullptr)), 0};
+    upstream.send(static_cast<const void*>(&info), sizeof(info), ZMQ_SNDMORE);
+    upstream.send(static_cast<const void*>("held"), 4, 0);
+    zmq::pollitem_t items[]{{dead, 0, ZMQ_POLLIN, 0}};
+    if (zmq::poll(items, 1, 5000) != 1 || dead.recv_all(0).size() != 2)
+      throw std::logic_error("Dead worker should have gotten the job");
+  }
+
+  // a worker that is still alive, by the time the client comes along the dead one has been dropped
+  std::thread worker(
+      std::bind(&worker_t::work,
+                worker_t(context, "inproc://test_dead_affinity_proxy_downstream",
+                         "inproc://dev_null", "inproc://test_dead_affinity_results",
+                         "inproc://test_dead_affinity_interrupt",
+                         [](const std::list<zmq::message_t>&, void*,
+                            worker_t::interrupt_function_t&) {
+                           worker_t::result_t result{false, {netstring_entity_t::to_string("A")},
+                                                     "A"};
+                           return result;
+                         })));
+  worker.detach();
+  std::this_thread::sleep_for(std::chrono::seconds(3));
+
+  // lots of different keys, some of which were on the dead workers part of the ring. if they still
+  // were they would each wait the whole affinity wait for it
+  std::vector<std::string> requests;
+  for (int i = 0; i < 20; ++i)
+    requests.push_back(netstring_entity_t::to_string(std::to_string(i)));
+  size_t sent = 0;
+  std::list<std::string> responses;
+  auto start = std::chrono::steady_clock::now();
+  netstring_client_t client(
+      context, "tcp://127.0.0.1:15720",
+      [&requests, &sent]() -> std::pair<const void*, size_t> {
+        if (sent == requests.size())
+          return std::make_pair(nullptr, 0);
+        const auto& request = requests[sent++];
+        return std::make_pair(static_cast<const void*>(request.c_str()), request.size());
+      },
+      [&responses, &requests](const void* data, size_t size) {
+        auto response = netstring_entity_t::from_string(static_cast<const char*>(data), size);
+        responses.push_back(response.body);
+        return responses.size() < requests.size();
+      },
+      requests.size());
+  client.batch();
+  auto took = std::chrono::steady_clock::now() - start;
+  if (responses.size() != requests.size() || took > std::chrono::seconds(5))
+    throw std::logic_error("Jobs for the dead workers keys should have gone to the live one but " +
+                           std::to_string(responses.size()) + " came back in " +
+                           std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(took)
+                                              .count()) +
+                           "ms");
+}
+
+// how many jobs come in to a worker within the given time
+size_t jobs_within(zmq::socket_t& worker, int milliseconds) {
+  size_t jobs = 0;
+  auto until = std::chrono::steady_clock::now() + std::chrono::milliseconds(milliseconds);
+  zmq::pollitem_t items[]{{worker, 0, ZMQ_POLLIN, 0}};
+  for (auto now = std::chrono::steady_clock::now(); now < until;
+       now = std::chrono::steady_clock::now()) {
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(until - now).count();
+    if (zmq::poll(items, 1, left) == 1 && worker.recv_all(0).size() == 2)
+      ++jobs;
+  }
+  return jobs;
+}
+
+void test_credits() {
+  zmq::context_t context;
+
+  // load balancer
+  std::thread proxy(std::bind(&proxy_t::forward,
+                              proxy_t(context, "inproc://test_credits_proxy_upstream",
+                                      "inproc://test_credits_proxy_downstream")));
+  proxy.detach();
+
+  // a worker that can hold two jobs at once, it says so again before the ones it was sent get to it
+  // like an idle worker would and then again after it finishes one
+  zmq::socket_t worker(context, ZMQ_DEALER);
+  worker.connect("inproc://test_credits_proxy_downstream");
+  auto advertise = [&worker](uint32_t finished) {
+    uint32_t advertisement[]{2, finished, 0};
+    worker.send(static_cast<const void*>("W"), 1, ZMQ_SNDMORE);
+    worker.send(static_cast<const void*>(advertisement), sizeof(advertisement), 0);
+  };
+  advertise(0);
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  // more jobs than it can hold
+  zmq::socket_t upstream(context, ZMQ_DEALER);
+  upstream.connect("inproc://test_credits_proxy_upstream");
+  for (uint32_t id = 1; id <= 5; ++id) {
+    netstring_request_info_t info{id, static_cast<uint32_t>(time(nullptr)), 0};
+    upstream.send(static_cast<const void*>(&info), sizeof(info), ZMQ_SNDMORE);
+    upstream.send(static_cast<const void*>("job"), 3, 0);
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  advertise(0);
+  advertise(0);
+
+  // it should never be holding more than it said it could
+  auto jobs = jobs_within(worker, 300);
+  if (jobs != 2)
+    throw std::logic_error("Worker should have gotten 2 jobs but got " + std::to_string(jobs));
+  advertise(1);
+  jobs = jobs_within(worker, 300);
+  if (jobs != 1)
+    throw std::logic_error("Worker should have gotten 1 more job after finishing one but got " +
+                           std::to_string(jobs));
+}
+
 } // namespace
 
 int main() {
@@ -190,5 +795,25 @@ int main() {
 
   suite.test(TEST_CASE(test_shaped));
 
+  suite.test(TEST_CASE(test_lifo));
+
+  suite.test(TEST_CASE(test_round_robin));
+
+  suite.test(TEST_CASE(test_random));
+
+  suite.test(TEST_CASE(test_best_of_two));
+
+  suite.test(TEST_CASE(test_affinity));
+
+  suite.test(TEST_CASE(test_batched));
+
+  suite.test(TEST_CASE(test_dead_worker));
+
+  suite.test(TEST_CASE(test_busy_worker));
+
+  suite.test(TEST_CASE(test_dead_affinity));
+
+  suite.test(TEST_CASE(test_credits));
+
   return suite.tear_down();
 }
@@ -0,0 +1,135 @@
+#include "testing/testing.hpp"
+#include "timer_wheel.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+using namespace prime_server;
+
+namespace {
+
+void test_fire() {
+  timer_wheel_t timers(1000);
+  timers.schedule(1005, 1, 7);
+  timers.schedule(1300, 2);
+  timers.schedule(70000, 3);
+  if (timers.size() != 3)
+    throw std::runtime_error("Wrong number of timers scheduled");
+  if (timers.next_expiry(1000) != 5)
+    throw std::runtime_error("Next expiry should be in 5 ticks");
+
+  std::vector<uint64_t> fired;
+  timers.advance(1004, [&fired](uint64_t key, uint8_t) { fired.push_back(key); });
+  if (!fired.empty())
+    throw std::runtime_error("Nothing should have fired yet");
+  timers.advance(1005, [&fired](uint64_t key, uint8_t kind) {
+    if (kind != 7)
+      throw std::runtime_error("Wrong timer kind");
+    fired.push_back(key);
+  });
+  if (fired != std::vector<uint64_t>{1})
+    throw std::runtime_error("First timer should have fired");
+  timers.advance(100000, [&fired](uint64_t key, uint8_t) { fired.push_back(key); });
+  if (fired != std::vector<uint64_t>{1, 2, 3})
+    throw std::runtime_error("Timers should fire in deadline order");
+  if (timers.size() != 0 || timers.next_expiry(100000) != -1)
+    throw std::runtime_error("There should be no timers left");
+}
+
+void test_cancel() {
+  timer_wheel_t timers;
+  auto handle = timers.schedule(10, 1);
+  auto stale = handle;
+  timers.cancel(handle);
+  if (handle != timer_wheel_t::INVALID_HANDLE)
+    throw std::runtime_error("Cancelling should invalidate the handle");
+  // the storage gets reused but the stale handle shouldnt be able to cancel the new timer
+  timers.schedule(20, 2);
+  timers.cancel(stale);
+  if (timers.size() != 1)
+    throw std::runtime_error("Stale handle cancelled someone elses timer");
+
+  std::vector<uint64_t> fired;
+  timers.advance(100, [&fired](uint64_t key, uint8_t) { fired.push_back(key); });
+  if (fired != std::vector<uint64_t>{2})
+    throw std::runtime_error("Only the second timer should have fired");
+}
+
+void test_reentrant() {
+  // timers that schedule more timers that are already due should fire in the same advance
+  timer_wheel_t timers;
+  size_t fired = 0;
+  timers.schedule(3, 1);
+  timers.advance(10, [&](uint64_t key, uint8_t) {
+    ++fired;
+    if (key == 1)
+      timers.schedule(2, 2);
+  });
+  if (fired != 2)
+    throw std::runtime_error("Timer scheduled while firing should have fired");
+}
+
+void test_random() {
+  // compare against a brute force implementation across all the levels of the wheel
+  std::mt19937_64 generator(17);
+  uint64_t now = generator() % 100000;
+  timer_wheel_t timers(now);
+  std::map<uint64_t, std::pair<uint64_t, timer_wheel_t::handle_t>> live;
+  uint64_t key = 0;
+  for (int i = 0; i < 20000; ++i) {
+    auto op = generator() % 10;
+    if (op < 5) {
+      auto deadline =
+          now + (generator() % 4 == 0 ? generator() % (uint64_t(1) << 34) : generator() % 70000);
+      live[key] = {deadline, timers.schedule(deadline, key, 1)};
+      ++key;
+    } else if (op < 7 && !live.empty()) {
+      auto timer = std::next(live.begin(), generator() % live.size());
+      timers.cancel(timer->second.second);
+      live.erase(timer);
+    } else {
+      auto then = now + (generator() % 3 == 0 ? generator() % (1 << 26) : generator() % 500);
+      timers.advance(then, [&](uint64_t key, uint8_t) {
+        auto timer = live.find(key);
+        if (timer == live.end() || timer->second.first > then)
+          throw std::runtime_error("Timer fired that shouldnt have");
+        live.erase(timer);
+      });
+      now = then;
+      for (const auto& timer : live)
+        if (timer.second.first <= now)
+          throw std::runtime_error("Timer didnt fire when it should have");
+    }
+    if (timers.size() != live.size())
+      throw std::runtime_error("Wrong number of timers");
+    // we should never be told to sleep past the next deadline
+    if (!live.empty()) {
+      auto next = timers.next_expiry(now);
+      auto earliest = std::min_element(live.begin(), live.end(), [](const auto& a, const auto& b) {
+                        return a.second.first < b.second.first;
+                      })->second.first;
+      if (next < 0 || now + next > std::max(earliest, now + 1))
+        throw std::runtime_error("Next expiry is too late");
+    }
+  }
+}
+
+} // namespace
+
+int main() {
+  testing::suite suite("timer_wheel");
+
+  suite.test(TEST_CASE(test_fire));
+
+  suite.test(TEST_CASE(test_cancel));
+
+  suite.test(TEST_CASE(test_reentrant));
+
+  suite.test(TEST_CASE(test_random));
+
+  return suite.tear_down();
+}
@@ -0,0 +1,209 @@
+#include "http_protocol.hpp"
+#include "prime_server.hpp"
+#include "testing/testing.hpp"
+#include "uring_server.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <limits>
+#include <list>
+#include <string>
+#include <thread>
+#include <unordered_set>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace prime_server;
+
+namespace {
+
+constexpr size_t LARGE_RESPONSE_SIZE = 1024 * 1024;
+constexpr size_t LARGE_RESPONSES = 10;
+constexpr size_t HUGE_RESPONSE_SIZE = 64 * 1024 * 1024;
+
+// echos the path of a get or the body of a post, or a large body of the size in the path
+worker_t::result_t echo(const std::list<zmq::message_t>& job,
+                        void* request_info,
+                        worker_t::interrupt_function_t&) {
+  auto request = http_request_t::from_string(static_cast<const char*>(job.front().data()),
+                                             job.front().size());
+  http_response_t response(200, "OK");
+  if (request.path.find("/large/") == 0)
+    response.body.assign(std::stoul(request.path.substr(7)), 'l');
+  else if (request.method == method_t::POST)
+    response.body = request.body;
+  else
+    response.body = request.path;
+  response.from_info(*static_cast<http_request_info_t*>(request_info));
+  worker_t::result_t result{false, {}, {}};
+  result.messages.emplace_back(response.to_string());
+  return result;
+}
+
+// a server, proxy and worker behind the given port, a different one for each test
+void start(zmq::context_t& context,
+           const std::string& port,
+           size_t zero_copy_size = DEFAULT_ZERO_COPY_SIZE) {
+  auto name = "inproc://test_uring_" + port;
+  std::thread server(
+      std::bind(&http_uring_server_t::serve,
+                http_uring_server_t(context, "tcp://127.0.0.1:" + port, name + "_proxy_upstream",
+                                    name + "_results", name + "_interrupt", false,
+                                    DEFAULT_MAX_REQUEST_SIZE, DEFAULT_REQUEST_TIMEOUT, {}, {},
+                                    DEFAULT_SESSION_TIMEOUT, DEFAULT_HEADER_TIMEOUT,
+                                    DEFAULT_WAKEUP_BUDGET, false, zero_copy_size)));
+  server.detach();
+
+  std::thread proxy(std::bind(&proxy_t::forward, proxy_t(context, name + "_proxy_upstream",
+                                                         name + "_proxy_downstream")));
+  proxy.detach();
+
+  std::thread worker(std::bind(&worker_t::work,
+                               worker_t(context, name + "_proxy_downstream", "inproc://dev_null",
+                                        name + "_results", name + "_interrupt", echo)));
+  worker.detach();
+}
+
+void client_work(zmq::context_t& context, const std::string& port, size_t total) {
+  std::unordered_set<std::string> requests;
+  size_t received = 0;
+  std::string request;
+  http_client_t client(
+      context, "tcp://127.0.0.1:" + port,
+      [&requests, &request, total]() {
+        if (requests.size() < total) {
+          std::string path;
+          do {
+            path = "/" + std::to_string(rand());
+          } while (!requests.insert(path).second);
+          request = requests.size() % 2
+                        ? http_request_t::to_string(method_t::GET, path)
+                        : http_request_t::to_string(method_t::POST, "", path);
+        } // blank request means we are done
+        else
+          request.clear();
+        return std::make_pair(static_cast<const void*>(request.c_str()), request.size());
+      },
+      [&requests, &received, total](const void* data, size_t size) {
+        auto response = http_response_t::from_string(static_cast<const char*>(data), size);
+        if (requests.find(response.body) == requests.end())
+          throw std::runtime_error("Unexpected response!");
+        return ++received < total;
+      },
+      100);
+  client.batch();
+}
+
+void test_parallel_clients() {
+  zmq::context_t context;
+  start(context, "15725");
+
+  std::thread client1(std::bind(&client_work, std::ref(context), "15725", 10000));
+  std::thread client2(std::bind(&client_work, std::ref(context), "15725", 10000));
+  client1.join();
+  client2.join();
+}
+
+// asks for a bunch of large responses all at once and checks they all come back whole. the client
+// only handles responses that come back in one read so we use a plain stream socket
+void large_responses(zmq::context_t& context, const std::string& port) {
+  zmq::socket_t client(context, ZMQ_STREAM);
+  client.connect(("tcp://127.0.0.1:" + port).c_str());
+  auto connection = client.recv_all(0);
+  std::string requests;
+  for (size_t i = 0; i < LARGE_RESPONSES; ++i)
+    requests += http_request_t::to_string(method_t::GET,
+                                          "/large/" + std::to_string(LARGE_RESPONSE_SIZE + i));
+  client.send(connection.front(), ZMQ_SNDMORE);
+  client.send(requests.data(), requests.size(), 0);
+
+  // dont read right away so the responses back up in the kernel, then it hangs on to the bytes of
+  // several zero copy sends at once and tells us its done with them later on
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  http_response_t response;
+  std::list<http_response_t> responses;
+  while (responses.size() < LARGE_RESPONSES) {
+    auto messages = client.recv_all(0);
+    responses.splice(responses.end(),
+                     response.from_stream(static_cast<const char*>(messages.back().data()),
+                                          messages.back().size()));
+  }
+  size_t i = 0;
+  for (const auto& large : responses)
+    if (large.body != std::string(LARGE_RESPONSE_SIZE + i++, 'l'))
+      throw std::runtime_error("Wrong large response");
+}
+
+void test_large_responses() {
+  // big enough to go out zero copy and enough of them that the kernel holds on to several at once
+  zmq::context_t context;
+  start(context, "15726");
+  large_responses(context, "15726");
+}
+
+void test_regular_sends() {
+  // what we fall back to when zero copy isnt supported
+  zmq::context_t context;
+  start(context, "15727", std::numeric_limits<size_t>::max());
+  large_responses(context, "15727");
+}
+
+void test_hang_up() {
+  // the client hangs up while a large response is still going out, the rest of it and the one
+  // queued up behind it should be dropped and everyone else should still get served
+  zmq::context_t context;
+  start(context, "15728", std::numeric_limits<size_t>::max());
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in address{};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(15728);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0)
+    throw std::runtime_error("Could not connect");
+  std::string requests;
+  for (size_t i = 0; i < 2; ++i)
+    requests += http_request_t::to_string(method_t::GET,
+                                          "/large/" + std::to_string(HUGE_RESPONSE_SIZE));
+  if (send(fd, requests.data(), requests.size(), 0) != static_cast<ssize_t>(requests.size()))
+    throw std::runtime_error("Could not send");
+
+  // stop talking partway through the first one while the sends are still completing and read
+  // whats left
+  char buffer[65536];
+  ssize_t received = 0, bytes;
+  while ((bytes = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+    if (received < static_cast<ssize_t>(HUGE_RESPONSE_SIZE / 8) &&
+        received + bytes >= static_cast<ssize_t>(HUGE_RESPONSE_SIZE / 8))
+      shutdown(fd, SHUT_WR);
+    received += bytes;
+  }
+  close(fd);
+  if (received >= static_cast<ssize_t>(2 * HUGE_RESPONSE_SIZE))
+    throw std::runtime_error("Responses kept going out after the client hung up");
+
+  client_work(context, "15728", 100);
+}
+
+} // namespace
+
+int main() {
+
+  testing::suite suite("uring");
+
+  // fail if it hangs
+  testing::set_timeout(300);
+
+  suite.test(TEST_CASE(test_parallel_clients));
+
+  suite.test(TEST_CASE(test_large_responses));
+
+  suite.test(TEST_CASE(test_regular_sends));
+
+  suite.test(TEST_CASE(test_hang_up));
+
+  return suite.tear_down();
+}
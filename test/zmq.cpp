@@ -322,6 +322,105 @@ void test_pub_sub() {
   subscriber.join();
 }
 
+void test_zero_copy_send() {
+  zmq::context_t context;
+  zmq::socket_t sender(context, ZMQ_PAIR);
+  sender.bind("inproc://test_zero_copy_send");
+  zmq::socket_t receiver(context, ZMQ_PAIR);
+  receiver.connect("inproc://test_zero_copy_send");
+
+  // sharing a message should leave the original intact and point at the same bytes
+  auto body = readable_string(1024 * 1024);
+  zmq::message_t shared(body.size(), body.data());
+  if (!sender.send_shared(shared, 0))
+    throw std::logic_error("Couldnt send shared message");
+  auto messages = receiver.recv_all(0);
+  if (messages.size() != 1 || messages.front().str() != body || shared.str() != body)
+    throw std::logic_error("Shared message didnt make it across intact");
+  if (messages.front().data() != shared.data())
+    throw std::logic_error("Shared message should not have been copied");
+
+  // small ones get copied but should still arrive
+  zmq::message_t small(5, "small");
+  if (!sender.send_shared(small, 0) || receiver.recv_all(0).front().str() != "small")
+    throw std::logic_error("Small shared message didnt make it across intact");
+
+  // handing off a message leaves it empty
+  zmq::message_t handed(body.size(), body.data());
+  const void* bytes = handed.data();
+  if (!sender.send(std::move(handed), 0))
+    throw std::logic_error("Couldnt send handed off message");
+  messages = receiver.recv_all(0);
+  if (messages.size() != 1 || messages.front().str() != body || messages.front().data() != bytes)
+    throw std::logic_error("Handed off message should not have been copied");
+}
+
+void test_multipart() {
+  zmq::multipart_t messages;
+  // spill over the inline parts and reuse them a few times
+  for (int round = 0; round < 3; ++round) {
+    messages.clear();
+    for (int i = 0; i < 7; ++i) {
+      auto part = std::to_string(i);
+      messages.emplace_back() = zmq::message_t(part.size(), part.data());
+    }
+    if (messages.size() != 7 || messages.front().str() != "0" || messages.back().str() != "6")
+      throw std::logic_error("Wrong parts in multipart message");
+    messages.pop_front();
+    std::string all;
+    for (const auto& message : messages)
+      all += message.str();
+    if (all != "123456")
+      throw std::logic_error("Parts didnt shift down after popping the front");
+    while (messages.size() > 2)
+      messages.pop_back();
+    if (messages.back().str() != "2")
+      throw std::logic_error("Wrong part after popping the back");
+  }
+
+  // copies share bytes and moves leave the original empty
+  auto copied = messages.back().copy();
+  if (copied.str() != "2" || messages.back().str() != "2")
+    throw std::logic_error("Copy should have the same bytes as the original");
+  zmq::message_t moved(std::move(messages.front()));
+  if (moved.str() != "1" || messages.front().size() != 0)
+    throw std::logic_error("Move should have left the original empty");
+}
+
+void test_reactor() {
+  zmq::context_t context;
+  zmq::socket_t sender(context, ZMQ_PAIR);
+  sender.bind("inproc://test_reactor");
+  zmq::socket_t receiver(context, ZMQ_PAIR);
+  receiver.connect("inproc://test_reactor");
+
+  zmq::reactor_t reactor;
+  size_t received = 0, ticks = 0;
+  reactor.add(receiver, [&]() {
+    receiver.recv_all(0);
+    ++received;
+  });
+  reactor.add_timer(10, [&ticks]() { ++ticks; });
+
+  // nothing to do but the timer
+  while (ticks == 0)
+    reactor.poll(1000);
+  if (received != 0)
+    throw std::logic_error("Handler ran without any messages");
+
+  // a disabled socket shouldnt run its handler
+  sender.send(std::string("hello"), 0);
+  reactor.enable(receiver, false);
+  reactor.poll(50);
+  if (received != 0)
+    throw std::logic_error("Handler ran while its socket was disabled");
+
+  // but it should once its enabled again
+  reactor.enable(receiver, true);
+  while (received == 0)
+    reactor.poll(1000);
+}
+
 } // namespace
 
 int main() {
@@ -342,5 +441,11 @@ int main() {
 
   suite.test(TEST_CASE(test_pub_sub));
 
+  suite.test(TEST_CASE(test_zero_copy_send));
+
+  suite.test(TEST_CASE(test_multipart));
+
+  suite.test(TEST_CASE(test_reactor));
+
   return suite.tear_down();
 }